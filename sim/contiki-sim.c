@@ -0,0 +1,881 @@
+/*
+ * Contiki API of include/, on top of the simulator engine. Everything that
+ * the firmwares keep in memory (timers, lists, connections) lives inside the
+ * memory of the node, the simulator only keeps events pointing to it: an
+ * event is dispatched once its node is resident (see sim_enter).
+ */
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sim.h"
+#include "random.h"
+#include "uart0.h"
+#include "cfs/cfs.h"
+#include "lib/trickle-timer.h"
+#include "lib/crc16.h"
+#include "dev/button-sensor.h"
+#include "dev/temperature-sensor.h"
+#include "dev/battery-sensor.h"
+
+// retransmission timeout of runicast, doubled at each retransmission (Contiki's REXMIT_TIME)
+#define REXMIT_TIME CLOCK_SECOND
+
+// the state of the API is per thread: each thread runs its own partition of the nodes
+static __thread struct process *current_process;
+// owner of the ctimers set outside of a process, ctimer_expired() only looks at it being set
+static struct process ctimer_process;
+
+/********************************************//**
+*  Clock
+***********************************************/
+
+void clock_init(void) {
+}
+
+clock_time_t clock_time(void) {
+  return (clock_time_t)(sim_now - sim_current->boot);
+}
+
+unsigned long clock_seconds(void) {
+  return (sim_now - sim_current->boot) / CLOCK_SECOND;
+}
+
+/********************************************//**
+*  Processes
+***********************************************/
+
+static void call_process(struct process *p, process_event_t ev, process_data_t data) {
+  struct process *caller = current_process;
+  if(p->state == 0) {
+    return;
+  }
+  current_process = p;
+  if(p->thread(&p->pt, ev, data) >= PT_EXITED) {
+    p->state = 0;
+  }
+  current_process = caller;
+}
+
+struct process *process_current(void) {
+  return current_process;
+}
+
+void process_start(struct process *p, process_data_t data) {
+  if(sim_current->num_processes < SIM_MAX_PROCESSES) {
+    sim_current->processes[sim_current->num_processes++] = p;
+  }
+  PT_INIT(&p->pt);
+  p->state = 1;
+  call_process(p, PROCESS_EVENT_INIT, data);
+}
+
+int process_post(struct process *p, process_event_t ev, process_data_t data) {
+  struct sim_event *e = sim_event_new(SIM_PROCESS, sim_current, 0);
+  e->ptr = p;
+  e->ev = ev;
+  e->data = data;
+  sim_schedule(e);
+  return 0;
+}
+
+void process_poll(struct process *p) {
+  process_post(p, PROCESS_EVENT_POLL, NULL);
+}
+
+void sim_boot(struct sim_node *node) {
+  struct process * const *p;
+  sim_enter(node);
+  node->boot = sim_now;
+  current_process = NULL;
+  for(p = node->firmware->autostart; *p != NULL; p++) {
+    process_start(*p, NULL);
+  }
+}
+
+/********************************************//**
+*  Timers
+***********************************************/
+
+void timer_set(struct timer *t, clock_time_t interval) {
+  t->interval = interval;
+  t->start = clock_time();
+}
+
+void timer_reset(struct timer *t) {
+  t->start += t->interval;
+}
+
+void timer_restart(struct timer *t) {
+  t->start = clock_time();
+}
+
+int timer_expired(struct timer *t) {
+  // same as Contiki: handles the wrap around of the 16 bits clock
+  clock_time_t diff = (clock_time() - t->start) + 1;
+  return t->interval < diff;
+}
+
+clock_time_t timer_remaining(struct timer *t) {
+  return t->start + t->interval - clock_time();
+}
+
+// schedules the expiration of an etimer whose timer was just set
+static void etimer_schedule(struct etimer *et, int type) {
+  struct sim_event *e;
+  et->generation++;
+  e = sim_event_new(type, sim_current, timer_expired(&et->timer) ? 0 : timer_remaining(&et->timer));
+  e->ptr = et;
+  e->generation = et->generation;
+  sim_schedule(e);
+}
+
+void etimer_set(struct etimer *et, clock_time_t interval) {
+  timer_set(&et->timer, interval);
+  et->p = current_process;
+  etimer_schedule(et, SIM_ETIMER);
+}
+
+void etimer_reset(struct etimer *et) {
+  timer_reset(&et->timer);
+  et->p = current_process;
+  etimer_schedule(et, SIM_ETIMER);
+}
+
+void etimer_restart(struct etimer *et) {
+  timer_restart(&et->timer);
+  et->p = current_process;
+  etimer_schedule(et, SIM_ETIMER);
+}
+
+void etimer_stop(struct etimer *et) {
+  et->p = PROCESS_NONE;
+  et->generation++;
+}
+
+int etimer_expired(struct etimer *et) {
+  return et->p == PROCESS_NONE;
+}
+
+static void ctimer_schedule(struct ctimer *c) {
+  c->etimer.p = current_process != NULL ? current_process : &ctimer_process;
+  etimer_schedule(&c->etimer, SIM_CTIMER);
+}
+
+void ctimer_set(struct ctimer *c, clock_time_t t, void (*f)(void *), void *ptr) {
+  c->f = f;
+  c->ptr = ptr;
+  timer_set(&c->etimer.timer, t);
+  ctimer_schedule(c);
+}
+
+void ctimer_reset(struct ctimer *c) {
+  timer_reset(&c->etimer.timer);
+  ctimer_schedule(c);
+}
+
+void ctimer_restart(struct ctimer *c) {
+  timer_restart(&c->etimer.timer);
+  ctimer_schedule(c);
+}
+
+void ctimer_stop(struct ctimer *c) {
+  etimer_stop(&c->etimer);
+}
+
+int ctimer_expired(struct ctimer *c) {
+  return etimer_expired(&c->etimer);
+}
+
+/********************************************//**
+*  Trickle timer
+***********************************************/
+
+static void trickle_new_interval(struct trickle_timer *tt);
+
+static void trickle_interval_end(void *ptr) {
+  struct trickle_timer *tt = ptr;
+  tt->i_cur = tt->i_cur >= tt->i_max_abs / 2 ? tt->i_max_abs : tt->i_cur * 2;
+  trickle_new_interval(tt);
+}
+
+static void trickle_tx(void *ptr) {
+  struct trickle_timer *tt = ptr;
+  ctimer_set(&tt->ct, tt->i_start + tt->i_cur - clock_time(), trickle_interval_end, tt);
+  tt->cb(tt->cb_arg, tt->k == 0 || tt->c < tt->k ? TRICKLE_TIMER_TX_OK : TRICKLE_TIMER_TX_SUPPRESS);
+}
+
+// starts an interval of i_cur, the transmission happens in its second half
+static void trickle_new_interval(struct trickle_timer *tt) {
+  tt->c = 0;
+  tt->i_start = clock_time();
+  ctimer_set(&tt->ct, tt->i_cur / 2 + random_rand() % (tt->i_cur / 2 + 1), trickle_tx, tt);
+}
+
+uint8_t trickle_timer_config(struct trickle_timer *tt, clock_time_t i_min, uint8_t i_max, uint8_t k) {
+  unsigned long i_max_abs = (unsigned long) i_min << i_max;
+  tt->i_min = i_min;
+  tt->i_max = i_max;
+  tt->i_max_abs = i_max_abs > 0x7FFF ? 0x7FFF : i_max_abs;
+  tt->k = k;
+  return 1;
+}
+
+uint8_t trickle_timer_set(struct trickle_timer *tt, trickle_timer_cb_t proto_cb, void *ptr) {
+  tt->cb = proto_cb;
+  tt->cb_arg = ptr;
+  tt->i_cur = tt->i_min;
+  trickle_new_interval(tt);
+  return 1;
+}
+
+void trickle_timer_inconsistency(struct trickle_timer *tt) {
+  if(tt->i_cur != tt->i_min) {
+    tt->i_cur = tt->i_min;
+    trickle_new_interval(tt);
+  }
+}
+
+/********************************************//**
+*  Lists and memory blocks
+***********************************************/
+
+struct list {
+  struct list *next;
+};
+
+void list_init(list_t list) {
+  *list = NULL;
+}
+
+void *list_head(list_t list) {
+  return *list;
+}
+
+void *list_tail(list_t list) {
+  struct list *l;
+  if(*list == NULL) {
+    return NULL;
+  }
+  for(l = *list; l->next != NULL; l = l->next);
+  return l;
+}
+
+void list_remove(list_t list, void *item) {
+  struct list *l, *r = NULL;
+  for(l = *list; l != NULL; l = l->next) {
+    if(l == item) {
+      if(r == NULL) {
+        *list = l->next;
+      } else {
+        r->next = l->next;
+      }
+      l->next = NULL;
+      return;
+    }
+    r = l;
+  }
+}
+
+void list_add(list_t list, void *item) {
+  struct list *l;
+  list_remove(list, item);
+  ((struct list *)item)->next = NULL;
+  l = list_tail(list);
+  if(l == NULL) {
+    *list = item;
+  } else {
+    l->next = item;
+  }
+}
+
+void list_push(list_t list, void *item) {
+  list_remove(list, item);
+  ((struct list *)item)->next = *list;
+  *list = item;
+}
+
+void *list_pop(list_t list) {
+  struct list *l = *list;
+  if(l != NULL) {
+    *list = l->next;
+  }
+  return l;
+}
+
+void *list_chop(list_t list) {
+  struct list *l = list_tail(list);
+  if(l != NULL) {
+    list_remove(list, l);
+  }
+  return l;
+}
+
+int list_length(list_t list) {
+  struct list *l;
+  int n = 0;
+  for(l = *list; l != NULL; l = l->next) {
+    n++;
+  }
+  return n;
+}
+
+void list_insert(list_t list, void *previtem, void *newitem) {
+  if(previtem == NULL) {
+    list_push(list, newitem);
+  } else {
+    list_remove(list, newitem);
+    ((struct list *)newitem)->next = ((struct list *)previtem)->next;
+    ((struct list *)previtem)->next = newitem;
+  }
+}
+
+void *list_item_next(void *item) {
+  return item == NULL ? NULL : ((struct list *)item)->next;
+}
+
+void memb_init(struct memb *m) {
+  memset(m->count, 0, m->num);
+  memset(m->mem, 0, (size_t) m->size * m->num);
+}
+
+void *memb_alloc(struct memb *m) {
+  int i;
+  for(i = 0; i < m->num; i++) {
+    if(m->count[i] == 0) {
+      m->count[i]++;
+      return (char *)m->mem + i * m->size;
+    }
+  }
+  return NULL;
+}
+
+char memb_free(struct memb *m, void *ptr) {
+  int i;
+  for(i = 0; i < m->num; i++) {
+    if((char *)m->mem + i * m->size == (char *)ptr) {
+      if(m->count[i] > 0) {
+        m->count[i]--;
+      }
+      return m->count[i];
+    }
+  }
+  return -1;
+}
+
+/********************************************//**
+*  C library
+***********************************************/
+
+// strtok keeps its position in a static variable, shared by the threads
+char *sim_strtok(char *str, const char *delim) {
+  static __thread char *position;
+  return strtok_r(str, delim, &position);
+}
+
+// CRC-16 of Contiki (CCITT polynomial, bits reflected)
+unsigned short crc16_add(unsigned char b, unsigned short acc) {
+  acc ^= b;
+  acc = (acc >> 8) | (acc << 8);
+  acc ^= (acc & 0xff00) << 4;
+  acc ^= (acc >> 8) >> 4;
+  acc ^= (acc & 0xff00) >> 5;
+  return acc;
+}
+
+unsigned short crc16_data(const unsigned char *data, int datalen, unsigned short acc) {
+  int i;
+  for(i = 0; i < datalen; i++) {
+    acc = crc16_add(data[i], acc);
+  }
+  return acc;
+}
+
+/********************************************//**
+*  External flash: the files of the node are kept by the simulator
+***********************************************/
+
+static struct sim_file *file_find(const char *name) {
+  int i;
+  for(i = 0; i < SIM_MAX_FILES; i++) {
+    if(sim_current->files[i].data != NULL && strcmp(sim_current->files[i].name, name) == 0) {
+      return &sim_current->files[i];
+    }
+  }
+  return NULL;
+}
+
+int cfs_open(const char *name, int flags) {
+  struct sim_file *f = file_find(name);
+  int i, fd;
+  if(strlen(name) >= sizeof(f->name)) {
+    return -1;
+  }
+  for(fd = 0; fd < SIM_MAX_FDS && sim_current->fd_file[fd] >= 0; fd++);
+  if(fd == SIM_MAX_FDS) {
+    return -1;
+  }
+  if(f == NULL) {
+    if((flags & (CFS_WRITE | CFS_APPEND)) == 0) {
+      return -1;
+    }
+    for(i = 0; i < SIM_MAX_FILES && sim_current->files[i].data != NULL; i++);
+    if(i == SIM_MAX_FILES) {
+      return -1;
+    }
+    f = &sim_current->files[i];
+    strcpy(f->name, name);
+    f->data = malloc(1);
+    f->size = 0;
+  }
+  sim_current->fd_file[fd] = f - sim_current->files;
+  sim_current->fd_pos[fd] = (flags & CFS_APPEND) ? f->size : 0;
+  return fd;
+}
+
+void cfs_close(int fd) {
+  if(fd >= 0 && fd < SIM_MAX_FDS) {
+    sim_current->fd_file[fd] = -1;
+  }
+}
+
+int cfs_read(int fd, void *buf, unsigned int len) {
+  struct sim_file *f;
+  if(fd < 0 || fd >= SIM_MAX_FDS || sim_current->fd_file[fd] < 0) {
+    return -1;
+  }
+  f = &sim_current->files[sim_current->fd_file[fd]];
+  if(sim_current->fd_pos[fd] + (long) len > f->size) {
+    len = sim_current->fd_pos[fd] < f->size ? f->size - sim_current->fd_pos[fd] : 0;
+  }
+  memcpy(buf, f->data + sim_current->fd_pos[fd], len);
+  sim_current->fd_pos[fd] += len;
+  return len;
+}
+
+int cfs_write(int fd, const void *buf, unsigned int len) {
+  struct sim_file *f;
+  long end;
+  if(fd < 0 || fd >= SIM_MAX_FDS || sim_current->fd_file[fd] < 0) {
+    return -1;
+  }
+  f = &sim_current->files[sim_current->fd_file[fd]];
+  end = sim_current->fd_pos[fd] + len;
+  if(end > f->size) {
+    f->data = realloc(f->data, end);
+    memset(f->data + f->size, 0, end - f->size);
+    f->size = end;
+  }
+  memcpy(f->data + sim_current->fd_pos[fd], buf, len);
+  sim_current->fd_pos[fd] = end;
+  return len;
+}
+
+cfs_offset_t cfs_seek(int fd, cfs_offset_t offset, int whence) {
+  struct sim_file *f;
+  if(fd < 0 || fd >= SIM_MAX_FDS || sim_current->fd_file[fd] < 0) {
+    return -1;
+  }
+  f = &sim_current->files[sim_current->fd_file[fd]];
+  if(whence == CFS_SEEK_CUR) {
+    offset += sim_current->fd_pos[fd];
+  } else if(whence == CFS_SEEK_END) {
+    offset += f->size;
+  }
+  if(offset < 0) {
+    return -1;
+  }
+  // like Coffee, seeking past the end does not extend the file until a write
+  sim_current->fd_pos[fd] = offset;
+  return offset;
+}
+
+int cfs_remove(const char *name) {
+  struct sim_file *f = file_find(name);
+  int fd;
+  if(f == NULL) {
+    return -1;
+  }
+  for(fd = 0; fd < SIM_MAX_FDS; fd++) {
+    if(sim_current->fd_file[fd] == f - sim_current->files) {
+      sim_current->fd_file[fd] = -1;
+    }
+  }
+  free(f->data);
+  f->data = NULL;
+  return 0;
+}
+
+/********************************************//**
+*  Random numbers, sensors, UART and console
+***********************************************/
+
+void random_init(unsigned short seed) {
+  sim_current->random ^= seed;
+}
+
+unsigned short random_rand(void) {
+  return sim_random(&sim_current->random) >> 16;
+}
+
+static int sensor_configure(int type, int value) {
+  return 1;
+}
+
+static int sensor_status(int type) {
+  return 1;
+}
+
+static int button_value(int type) {
+  return 0;
+}
+
+// random walk of the temperature of the node, in tenths of degree
+static int temperature_value(int type) {
+  struct sim_node *n = sim_current;
+  n->temperature += (int)(sim_random(&n->sensor) % 5) - 2;
+  if(n->temperature < 150) {
+    n->temperature = 150;
+  } else if(n->temperature > 350) {
+    n->temperature = 350;
+  }
+  return n->temperature;
+}
+
+// with an energy budget (-e), the battery goes down to SIM_BATTERY_EMPTY as the node spends it
+static int battery_value(int type) {
+  struct sim_node *n = sim_current;
+  if(sim_energy != 0 && n->index != 0) {
+    return SIM_BATTERY_EMPTY + (int)((long)(n->battery - SIM_BATTERY_EMPTY) * (long) n->energy / (long) sim_energy);
+  }
+  return n->battery;
+}
+
+const struct sensors_sensor button_sensor = {"Button", button_value, sensor_configure, sensor_status};
+const struct sensors_sensor temperature_sensor = {"Temperature", temperature_value, sensor_configure, sensor_status};
+const struct sensors_sensor battery_sensor = {"Battery", battery_value, sensor_configure, sensor_status};
+
+void uart0_init(unsigned long ubr) {
+}
+
+void uart0_set_input(int (*input)(unsigned char c)) {
+  sim_current->uart_input = input;
+}
+
+// the UART sends a byte in 10 bits at 115200 bauds
+#define UART_BYTES_PER_SECOND 11520
+
+static unsigned long uart_now(void) {
+  return sim_now * UART_BYTES_PER_SECOND / CLOCK_SECOND;
+}
+
+void uart0_writeb(unsigned char c) {
+  if(sim_current->uart_idle < uart_now()) {
+    sim_current->uart_idle = uart_now();
+  }
+  sim_current->uart_idle++;
+  putchar(c);
+}
+
+uint8_t uart0_active(void) {
+  return sim_current->uart_idle > uart_now();
+}
+
+// the console of the root node is the UART read by the gateway
+int sim_printf(const char *fmt, ...) {
+  va_list ap;
+  int n = 0;
+  va_start(ap, fmt);
+  if(sim_current->index == 0) {
+    n = vprintf(fmt, ap);
+  } else if(sim_verbose) {
+    fprintf(stderr, "%lu.%03lu %d.%d: ", sim_now / CLOCK_SECOND, (sim_now % CLOCK_SECOND) * 1000 / CLOCK_SECOND,
+            sim_current->addr.u8[0], sim_current->addr.u8[1]);
+    n = vfprintf(stderr, fmt, ap);
+    fputc('\n', stderr);
+  }
+  va_end(ap);
+  return n;
+}
+
+/********************************************//**
+*  Rime
+***********************************************/
+
+__thread linkaddr_t linkaddr_node_addr;
+const linkaddr_t linkaddr_null = {{0, 0}};
+
+int linkaddr_cmp(const linkaddr_t *addr1, const linkaddr_t *addr2) {
+  return addr1->u8[0] == addr2->u8[0] && addr1->u8[1] == addr2->u8[1];
+}
+
+void linkaddr_copy(linkaddr_t *dest, const linkaddr_t *from) {
+  dest->u8[0] = from->u8[0];
+  dest->u8[1] = from->u8[1];
+}
+
+// one more byte so that the received text messages are always terminated
+static __thread uint8_t packetbuf[PACKETBUF_SIZE + 1];
+static __thread uint16_t packetbuf_len;
+
+void packetbuf_clear(void) {
+  packetbuf_len = 0;
+}
+
+void *packetbuf_dataptr(void) {
+  return packetbuf;
+}
+
+uint16_t packetbuf_datalen(void) {
+  return packetbuf_len;
+}
+
+void packetbuf_set_datalen(uint16_t len) {
+  packetbuf_len = len > PACKETBUF_SIZE ? PACKETBUF_SIZE : len;
+}
+
+int packetbuf_copyfrom(const void *from, uint16_t len) {
+  packetbuf_set_datalen(len);
+  memcpy(packetbuf, from, packetbuf_len);
+  return packetbuf_len;
+}
+
+int packetbuf_copyto(void *to) {
+  memcpy(to, packetbuf, packetbuf_len);
+  return packetbuf_len;
+}
+
+static void conn_open(int type, uint16_t channel, void *c) {
+  struct sim_node *n = sim_current;
+  if(n->num_conns == SIM_MAX_CONNS) {
+    fprintf(stderr, "sim: node %d.%d opens too many connections\n", n->addr.u8[0], n->addr.u8[1]);
+    return;
+  }
+  n->conns[n->num_conns].type = type;
+  n->conns[n->num_conns].channel = channel;
+  n->conns[n->num_conns].conn = c;
+  n->num_conns++;
+}
+
+static void conn_close(void *c) {
+  struct sim_node *n = sim_current;
+  int i;
+  for(i = 0; i < n->num_conns; i++) {
+    if(n->conns[i].conn == c) {
+      n->conns[i] = n->conns[--n->num_conns];
+      return;
+    }
+  }
+}
+
+static void *conn_find(struct sim_node *n, int type, uint16_t channel) {
+  int i;
+  for(i = 0; i < n->num_conns; i++) {
+    if(n->conns[i].type == type && n->conns[i].channel == channel) {
+      return n->conns[i].conn;
+    }
+  }
+  return NULL;
+}
+
+void broadcast_open(struct broadcast_conn *c, uint16_t channel, const struct broadcast_callbacks *u) {
+  c->channel = channel;
+  c->u = u;
+  conn_open(SIM_BROADCAST, channel, c);
+}
+
+void broadcast_close(struct broadcast_conn *c) {
+  conn_close(c);
+}
+
+int broadcast_send(struct broadcast_conn *c) {
+  sim_radio_send(SIM_BROADCAST, c->channel, NULL, 0);
+  return 1;
+}
+
+void unicast_open(struct unicast_conn *c, uint16_t channel, const struct unicast_callbacks *u) {
+  c->channel = channel;
+  c->u = u;
+  conn_open(SIM_UNICAST, channel, c);
+}
+
+void unicast_close(struct unicast_conn *c) {
+  conn_close(c);
+}
+
+int unicast_send(struct unicast_conn *c, const linkaddr_t *receiver) {
+  sim_radio_send(SIM_UNICAST, c->channel, receiver, 0);
+  return 1;
+}
+
+void runicast_open(struct runicast_conn *c, uint16_t channel, const struct runicast_callbacks *u) {
+  c->channel = channel;
+  c->u = u;
+  c->is_tx = 0;
+  c->sndnxt = 0;
+  conn_open(SIM_RUNICAST, channel, c);
+}
+
+void runicast_close(struct runicast_conn *c) {
+  c->is_tx = 0;
+  conn_close(c);
+}
+
+static void runicast_transmit(struct runicast_conn *c) {
+  struct sim_event *e;
+  packetbuf_copyfrom(c->buf, c->len);
+  sim_radio_send(SIM_RUNICAST, c->channel, &c->receiver, c->sndnxt);
+  e = sim_event_new(SIM_REXMIT, sim_current, (unsigned long) REXMIT_TIME << (c->rxmit > 4 ? 4 : c->rxmit));
+  e->ptr = c;
+  e->seqno = c->sndnxt;
+  e->generation = c->rxmit;
+  sim_schedule(e);
+}
+
+int runicast_send(struct runicast_conn *c, const linkaddr_t *receiver, uint8_t max_retransmissions) {
+  if(c->is_tx) {
+    return 0;
+  }
+  c->is_tx = 1;
+  c->sndnxt++;
+  c->rxmit = 0;
+  c->max_rxmit = max_retransmissions;
+  linkaddr_copy(&c->receiver, receiver);
+  c->len = packetbuf_datalen();
+  memcpy(c->buf, packetbuf_dataptr(), c->len);
+  runicast_transmit(c);
+  return 1;
+}
+
+uint8_t runicast_is_transmitting(struct runicast_conn *c) {
+  return c->is_tx;
+}
+
+// a packet (or acknowledgement) reached the node, which is resident
+static void receive(struct sim_event *e) {
+  struct sim_node *n = e->node;
+  void *c = conn_find(n, e->conn_type, e->channel);
+  if(c == NULL) {
+    return;
+  }
+  n->rx++;
+  sim_spend(n);
+  packetbuf_copyfrom(e->payload, e->len);
+  packetbuf[packetbuf_len] = '\0';
+  switch(e->conn_type) {
+  case SIM_BROADCAST:
+    ((struct broadcast_conn *)c)->u->recv(c, &e->from);
+    break;
+  case SIM_UNICAST:
+    ((struct unicast_conn *)c)->u->recv(c, &e->from);
+    break;
+  case SIM_RUNICAST:
+    {
+      // acknowledge the packet, the acknowledgement can be lost as well
+      struct sim_node *sender = e->ptr;
+      if(sim_random(&n->radio) >= sim_loss_threshold) {
+        struct sim_event *ack = sim_event_new(SIM_ACK, sender, sim_latency);
+        ack->conn_type = SIM_RUNICAST;
+        ack->channel = e->channel;
+        ack->from = n->addr;
+        ack->seqno = e->seqno;
+        sim_schedule(ack);
+      } else {
+        n->lost++;
+      }
+      ((struct runicast_conn *)c)->u->recv(c, &e->from, e->seqno);
+    }
+    break;
+  }
+}
+
+static void runicast_ack(struct sim_event *e) {
+  struct runicast_conn *c = conn_find(e->node, SIM_RUNICAST, e->channel);
+  linkaddr_t to;
+  if(c == NULL || !c->is_tx || c->sndnxt != e->seqno || !linkaddr_cmp(&c->receiver, &e->from)) {
+    return;
+  }
+  c->is_tx = 0;
+  to = c->receiver;
+  if(c->u->sent != NULL) {
+    c->u->sent(c, &to, c->rxmit);
+  }
+}
+
+static void runicast_rexmit(struct sim_event *e) {
+  struct runicast_conn *c = e->ptr;
+  linkaddr_t to;
+  if(!c->is_tx || c->sndnxt != e->seqno || c->rxmit != e->generation) {
+    return;
+  }
+  if(c->rxmit >= c->max_rxmit) {
+    c->is_tx = 0;
+    to = c->receiver;
+    if(c->u->timedout != NULL) {
+      c->u->timedout(c, &to, c->rxmit);
+    }
+    return;
+  }
+  c->rxmit++;
+  runicast_transmit(c);
+}
+
+/********************************************//**
+*  Dispatch of the events of the engine
+***********************************************/
+
+void sim_dispatch(struct sim_event *e) {
+  struct etimer *et;
+  struct ctimer *ct;
+  struct process *p;
+  int i;
+
+  if(e->type == SIM_BOOT) {
+    sim_boot(e->node);
+    return;
+  }
+  sim_enter(e->node);
+  current_process = NULL;
+  switch(e->type) {
+  case SIM_ETIMER:
+    et = e->ptr;
+    if(et->generation == e->generation && et->p != PROCESS_NONE) {
+      p = et->p;
+      et->p = PROCESS_NONE;
+      call_process(p, PROCESS_EVENT_TIMER, et);
+    }
+    break;
+  case SIM_CTIMER:
+    ct = e->ptr;
+    if(ct->etimer.generation == e->generation && ct->etimer.p != PROCESS_NONE) {
+      p = ct->etimer.p;
+      ct->etimer.p = PROCESS_NONE;
+      current_process = p == &ctimer_process ? NULL : p;
+      ct->f(ct->ptr);
+      current_process = NULL;
+    }
+    break;
+  case SIM_PROCESS:
+    if(e->ptr != PROCESS_BROADCAST) {
+      call_process(e->ptr, e->ev, e->data);
+    } else {
+      for(i = 0; i < e->node->num_processes; i++) {
+        call_process(e->node->processes[i], e->ev, e->data);
+      }
+    }
+    break;
+  case SIM_PACKET:
+    receive(e);
+    break;
+  case SIM_ACK:
+    runicast_ack(e);
+    break;
+  case SIM_REXMIT:
+    runicast_rexmit(e);
+    break;
+  case SIM_UART:
+    for(i = 0; i < e->len && e->node->uart_input != NULL; i++) {
+      e->node->uart_input(e->payload[i]);
+    }
+    break;
+  }
+}
@@ -0,0 +1,209 @@
+/*
+ * Subset of the Contiki API used by the firmwares, implemented by the
+ * simulator (see contiki-sim.c). The semantics follow Contiki 3.0, the
+ * clock ticks CLOCK_SECOND times per second like on the sky motes.
+ */
+#ifndef CONTIKI_H_
+#define CONTIKI_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/********************************************//**
+*  Clock
+***********************************************/
+
+typedef unsigned short clock_time_t;
+#define CLOCK_SECOND 128
+
+void clock_init(void);
+clock_time_t clock_time(void);
+unsigned long clock_seconds(void);
+
+/********************************************//**
+*  Protothreads and processes
+***********************************************/
+
+typedef unsigned short lc_t;
+#define LC_INIT(s) s = 0;
+#define LC_RESUME(s) switch(s) { case 0:
+#define LC_SET(s) s = __LINE__; case __LINE__:
+#define LC_END(s) }
+
+struct pt {
+  lc_t lc;
+};
+
+#define PT_WAITING 0
+#define PT_YIELDED 1
+#define PT_EXITED  2
+#define PT_ENDED   3
+
+#define PT_INIT(pt) LC_INIT((pt)->lc)
+#define PT_THREAD(name_args) char name_args
+#define PT_BEGIN(pt) { char PT_YIELD_FLAG = 1; if(PT_YIELD_FLAG) {;} LC_RESUME((pt)->lc)
+#define PT_END(pt) LC_END((pt)->lc); PT_YIELD_FLAG = 0; PT_INIT(pt); return PT_ENDED; }
+#define PT_WAIT_UNTIL(pt, condition) \
+  do { LC_SET((pt)->lc); if(!(condition)) { return PT_WAITING; } } while(0)
+#define PT_YIELD(pt) \
+  do { PT_YIELD_FLAG = 0; LC_SET((pt)->lc); if(PT_YIELD_FLAG == 0) { return PT_YIELDED; } } while(0)
+#define PT_YIELD_UNTIL(pt, cond) \
+  do { PT_YIELD_FLAG = 0; LC_SET((pt)->lc); if((PT_YIELD_FLAG == 0) || !(cond)) { return PT_YIELDED; } } while(0)
+
+typedef unsigned char process_event_t;
+typedef void *process_data_t;
+
+#define PROCESS_EVENT_NONE     0x80
+#define PROCESS_EVENT_INIT     0x81
+#define PROCESS_EVENT_POLL     0x82
+#define PROCESS_EVENT_EXIT     0x83
+#define PROCESS_EVENT_CONTINUE 0x85
+#define PROCESS_EVENT_TIMER    0x88
+
+struct process {
+  struct process *next;
+  const char *name;
+  PT_THREAD((* thread)(struct pt *, process_event_t, process_data_t));
+  struct pt pt;
+  unsigned char state, needspoll;
+};
+
+#define PROCESS_NONE NULL
+#define PROCESS_BROADCAST NULL
+
+#define PROCESS_THREAD(name, ev, data) \
+  static PT_THREAD(process_thread_##name(struct pt *process_pt, process_event_t ev, process_data_t data))
+#define PROCESS_NAME(name) extern struct process name
+#define PROCESS(name, strname) \
+  PROCESS_THREAD(name, ev, data); \
+  struct process name = { NULL, strname, process_thread_##name }
+
+#define PROCESS_BEGIN() PT_BEGIN(process_pt)
+#define PROCESS_END() PT_END(process_pt)
+#define PROCESS_WAIT_EVENT() PROCESS_YIELD()
+#define PROCESS_WAIT_EVENT_UNTIL(c) PROCESS_YIELD_UNTIL(c)
+#define PROCESS_YIELD() PT_YIELD(process_pt)
+#define PROCESS_YIELD_UNTIL(c) PT_YIELD_UNTIL(process_pt, c)
+#define PROCESS_WAIT_UNTIL(c) PT_WAIT_UNTIL(process_pt, c)
+#define PROCESS_EXITHANDLER(handler) if(ev == PROCESS_EVENT_EXIT) { handler; }
+#define PROCESS_PAUSE() do { \
+  process_post(PROCESS_CURRENT(), PROCESS_EVENT_CONTINUE, NULL); \
+  PROCESS_WAIT_EVENT_UNTIL(ev == PROCESS_EVENT_CONTINUE); \
+} while(0)
+#define PROCESS_CURRENT() process_current()
+
+#define AUTOSTART_PROCESSES(...) \
+  struct process * const autostart_processes[] = {__VA_ARGS__, NULL}
+
+struct process *process_current(void);
+void process_start(struct process *p, process_data_t data);
+int process_post(struct process *p, process_event_t ev, process_data_t data);
+void process_poll(struct process *p);
+
+/********************************************//**
+*  Timers
+***********************************************/
+
+struct timer {
+  clock_time_t start;
+  clock_time_t interval;
+};
+
+void timer_set(struct timer *t, clock_time_t interval);
+void timer_reset(struct timer *t);
+void timer_restart(struct timer *t);
+int timer_expired(struct timer *t);
+clock_time_t timer_remaining(struct timer *t);
+
+struct etimer {
+  struct timer timer;
+  struct process *p;
+  // incremented each time the timer is set, to ignore stale expirations
+  unsigned long generation;
+};
+
+void etimer_set(struct etimer *et, clock_time_t interval);
+void etimer_reset(struct etimer *et);
+void etimer_restart(struct etimer *et);
+void etimer_stop(struct etimer *et);
+int etimer_expired(struct etimer *et);
+
+struct ctimer {
+  struct etimer etimer;
+  void (*f)(void *);
+  void *ptr;
+};
+
+void ctimer_set(struct ctimer *c, clock_time_t t, void (*f)(void *), void *ptr);
+void ctimer_reset(struct ctimer *c);
+void ctimer_restart(struct ctimer *c);
+void ctimer_stop(struct ctimer *c);
+int ctimer_expired(struct ctimer *c);
+
+/********************************************//**
+*  Lists and memory blocks
+***********************************************/
+
+#define LIST_CONCAT2(s1, s2) s1##s2
+#define LIST_CONCAT(s1, s2) LIST_CONCAT2(s1, s2)
+#define LIST(name) \
+  static void *LIST_CONCAT(name, _list) = NULL; \
+  static list_t name = (list_t)&LIST_CONCAT(name, _list)
+typedef void ** list_t;
+
+void list_init(list_t list);
+void *list_head(list_t list);
+void *list_tail(list_t list);
+void *list_pop(list_t list);
+void list_push(list_t list, void *item);
+void *list_chop(list_t list);
+void list_add(list_t list, void *item);
+void list_remove(list_t list, void *item);
+int list_length(list_t list);
+void list_insert(list_t list, void *previtem, void *newitem);
+void *list_item_next(void *item);
+
+struct memb {
+  unsigned short size;
+  unsigned short num;
+  char *count;
+  void *mem;
+};
+#define MEMB(name, structure, num) \
+  static char LIST_CONCAT(name, _memb_count)[num]; \
+  static structure LIST_CONCAT(name, _memb_mem)[num]; \
+  static struct memb name = {sizeof(structure), num, \
+                             LIST_CONCAT(name, _memb_count), \
+                             (void *)LIST_CONCAT(name, _memb_mem)}
+
+void memb_init(struct memb *m);
+void *memb_alloc(struct memb *m);
+char memb_free(struct memb *m, void *ptr);
+
+/********************************************//**
+*  Sensors
+***********************************************/
+
+struct sensors_sensor {
+  const char *type;
+  int (* value)(int type);
+  int (* configure)(int type, int value);
+  int (* status)(int type);
+};
+#define SENSORS_ACTIVATE(sensor) (sensor).configure(0x7F, 1)
+#define SENSORS_DEACTIVATE(sensor) (sensor).configure(0x7F, 0)
+
+/********************************************//**
+*  Console: the output of the root node is its UART
+***********************************************/
+
+int sim_printf(const char *fmt, ...);
+#define printf sim_printf
+
+// the C library functions with a hidden state are replaced by thread-safe ones
+#include <string.h>
+char *sim_strtok(char *str, const char *delim);
+#define strtok sim_strtok
+
+#endif /* CONTIKI_H_ */
@@ -0,0 +1,6 @@
+#ifndef BATTERY_SENSOR_H_
+#define BATTERY_SENSOR_H_
+#include "contiki.h"
+/* Raw 12 bits ADC value of the battery voltage */
+extern const struct sensors_sensor battery_sensor;
+#endif
@@ -0,0 +1,5 @@
+#ifndef BUTTON_SENSOR_H_
+#define BUTTON_SENSOR_H_
+#include "contiki.h"
+extern const struct sensors_sensor button_sensor;
+#endif
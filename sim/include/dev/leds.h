@@ -0,0 +1,2 @@
+/* See contiki.h */
+#include "contiki.h"
@@ -0,0 +1,6 @@
+#ifndef TEMPERATURE_SENSOR_H_
+#define TEMPERATURE_SENSOR_H_
+#include "contiki.h"
+/* Temperature in tenths of degree */
+extern const struct sensors_sensor temperature_sensor;
+#endif
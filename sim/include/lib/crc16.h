@@ -0,0 +1,6 @@
+/* CRC-16 with the API of Contiki's core/lib/crc16.h */
+#ifndef CRC16_H_
+#define CRC16_H_
+unsigned short crc16_add(unsigned char b, unsigned short acc);
+unsigned short crc16_data(const unsigned char *data, int datalen, unsigned short acc);
+#endif
@@ -0,0 +1,30 @@
+/* Trickle timer (RFC 6206) with the API of Contiki's core/lib/trickle-timer.h */
+#ifndef TRICKLE_TIMER_H_
+#define TRICKLE_TIMER_H_
+#include "contiki.h"
+
+#define TRICKLE_TIMER_TX_SUPPRESS 0
+#define TRICKLE_TIMER_TX_OK 1
+
+typedef void (* trickle_timer_cb_t)(void *ptr, uint8_t suppress);
+
+struct trickle_timer {
+  clock_time_t i_min;
+  clock_time_t i_cur;
+  clock_time_t i_start;
+  clock_time_t i_max_abs;
+  struct ctimer ct;
+  trickle_timer_cb_t cb;
+  void *cb_arg;
+  uint8_t i_max;
+  uint8_t k;
+  uint8_t c;
+};
+
+uint8_t trickle_timer_config(struct trickle_timer *tt, clock_time_t i_min, uint8_t i_max, uint8_t k);
+uint8_t trickle_timer_set(struct trickle_timer *tt, trickle_timer_cb_t proto_cb, void *ptr);
+void trickle_timer_inconsistency(struct trickle_timer *tt);
+#define trickle_timer_consistency(tt) (++((tt)->c))
+#define trickle_timer_reset_event(tt) trickle_timer_inconsistency(tt)
+
+#endif /* TRICKLE_TIMER_H_ */
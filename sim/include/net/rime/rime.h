@@ -0,0 +1,75 @@
+/*
+ * Rime primitives used by the firmwares: broadcast, unicast and reliable
+ * unicast. The state of a connection lives in the connection structure,
+ * inside the memory of the node.
+ */
+#ifndef RIME_H_
+#define RIME_H_
+#include "contiki.h"
+
+typedef union {
+  unsigned char u8[2];
+  uint16_t u16;
+} linkaddr_t;
+
+// address of the running node, per thread of the simulator
+extern __thread linkaddr_t linkaddr_node_addr;
+extern const linkaddr_t linkaddr_null;
+int linkaddr_cmp(const linkaddr_t *addr1, const linkaddr_t *addr2);
+void linkaddr_copy(linkaddr_t *dest, const linkaddr_t *from);
+
+#define PACKETBUF_SIZE 128
+void packetbuf_clear(void);
+void *packetbuf_dataptr(void);
+uint16_t packetbuf_datalen(void);
+void packetbuf_set_datalen(uint16_t len);
+int packetbuf_copyfrom(const void *from, uint16_t len);
+int packetbuf_copyto(void *to);
+
+struct broadcast_conn;
+struct broadcast_callbacks {
+  void (* recv)(struct broadcast_conn *ptr, const linkaddr_t *sender);
+  void (* sent)(struct broadcast_conn *ptr, int status, int num_tx);
+};
+struct broadcast_conn {
+  uint16_t channel;
+  const struct broadcast_callbacks *u;
+};
+void broadcast_open(struct broadcast_conn *c, uint16_t channel, const struct broadcast_callbacks *u);
+void broadcast_close(struct broadcast_conn *c);
+int broadcast_send(struct broadcast_conn *c);
+
+struct unicast_conn;
+struct unicast_callbacks {
+  void (* recv)(struct unicast_conn *c, const linkaddr_t *from);
+  void (* sent)(struct unicast_conn *ptr, int status, int num_tx);
+};
+struct unicast_conn {
+  uint16_t channel;
+  const struct unicast_callbacks *u;
+};
+void unicast_open(struct unicast_conn *c, uint16_t channel, const struct unicast_callbacks *u);
+void unicast_close(struct unicast_conn *c);
+int unicast_send(struct unicast_conn *c, const linkaddr_t *receiver);
+
+struct runicast_conn;
+struct runicast_callbacks {
+  void (* recv)(struct runicast_conn *c, const linkaddr_t *from, uint8_t seqno);
+  void (* sent)(struct runicast_conn *c, const linkaddr_t *to, uint8_t retransmissions);
+  void (* timedout)(struct runicast_conn *c, const linkaddr_t *to, uint8_t retransmissions);
+};
+struct runicast_conn {
+  uint16_t channel;
+  const struct runicast_callbacks *u;
+  // packet being transmitted
+  linkaddr_t receiver;
+  uint8_t buf[PACKETBUF_SIZE];
+  uint16_t len;
+  uint8_t is_tx, sndnxt, rxmit, max_rxmit;
+};
+void runicast_open(struct runicast_conn *c, uint16_t channel, const struct runicast_callbacks *u);
+void runicast_close(struct runicast_conn *c);
+int runicast_send(struct runicast_conn *c, const linkaddr_t *receiver, uint8_t max_retransmissions);
+uint8_t runicast_is_transmitting(struct runicast_conn *c);
+
+#endif /* RIME_H_ */
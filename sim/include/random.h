@@ -0,0 +1,8 @@
+/* Pseudo-random numbers, a deterministic stream per node */
+#ifndef RANDOM_H_
+#define RANDOM_H_
+#include "contiki.h"
+#define RANDOM_RAND_MAX 65535U
+void random_init(unsigned short seed);
+unsigned short random_rand(void);
+#endif
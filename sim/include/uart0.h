@@ -0,0 +1,10 @@
+/* UART of the root node: the simulator writes it to stdout and feeds it from the command file */
+#ifndef UART0_H_
+#define UART0_H_
+#include "contiki.h"
+#define BAUD2UBR(baud) (baud)
+void uart0_init(unsigned long ubr);
+void uart0_set_input(int (*input)(unsigned char c));
+void uart0_writeb(unsigned char c);
+uint8_t uart0_active(void);
+#endif
@@ -0,0 +1,651 @@
+/*
+ * Engine of the simulator: loads the firmwares, places the nodes and runs
+ * their events in the order of their time.
+ *
+ * The nodes are split in spatial partitions (stripes of the area), each run
+ * by a thread with its own copy of the firmwares. The partitions advance by
+ * conservative time windows: every event crossing nodes (packet,
+ * acknowledgement) happens at least the radio latency after its cause, so
+ * the events of [T, T + latency), where T is the earliest pending event,
+ * cannot depend on each other across partitions. Between two windows the
+ * partitions exchange their events through lock-free inboxes.
+ *
+ * Events of the same time are ordered by the node which created them and
+ * its own count of created events, and all the random draws come from
+ * per-node streams seeded by the seed of the run: the output of a run does
+ * not depend on the number of threads.
+ *
+ * Usage: sim [-n nodes] [-t seconds] [-s seed] [-r range] [-l loss] [-d latency]
+ *            [-p positions] [-i commands] [-j threads] [-e packets] [-v]
+ * The root node is the first node, its UART is written to stdout and
+ * fed with the lines "<seconds> <command>" of the commands file, or
+ * "<seconds> :<hex bytes>" for binary input. -v prints
+ * the console of the sensor nodes on stderr, -v -v the packets as well.
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <limits.h>
+#include <link.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sim.h"
+
+// the firmwares index the nodes with the two bytes of their address, each below MAX_INDEX,
+// and the address 0.0 is the null address
+#ifndef MAX_INDEX
+#define MAX_INDEX 10
+#endif
+#define MAX_NODES (MAX_INDEX * MAX_INDEX - 1)
+
+__thread unsigned long sim_now;
+__thread struct sim_node *sim_current;
+int sim_verbose;
+// about the wake-up delay of ContikiMAC, and the lookahead of the partitions
+unsigned long sim_latency = CLOCK_SECOND / 16;
+uint32_t sim_loss_threshold;
+unsigned long sim_energy;
+
+static struct sim_node *nodes;
+static int num_nodes;
+
+// a partition of the nodes, run by one thread
+struct sim_partition {
+  int index;
+  pthread_t thread;
+  // binary heap of the pending events of the nodes of the partition
+  struct sim_event **heap;
+  size_t heap_size, heap_capacity;
+  // events sent by the other partitions during the current window
+  _Atomic(struct sim_event *) inbox;
+  // copies of the firmwares for the nodes of the partition
+  struct sim_firmware root, sensor;
+  // earliest pending event of the partition at the end of the last two windows
+  unsigned long next_time[2];
+  // earliest event sent to another partition during the current window
+  unsigned long sent_time;
+  unsigned long events;
+};
+
+static struct sim_partition *partitions;
+static int num_partitions = 1;
+static unsigned long end_time;
+// sense-reversing barrier between the windows
+static atomic_int barrier_count, barrier_sense;
+
+/********************************************//**
+*  Events
+***********************************************/
+
+static int before(const struct sim_event *a, const struct sim_event *b) {
+  if(a->time != b->time) {
+    return a->time < b->time;
+  }
+  if(a->origin != b->origin) {
+    return a->origin < b->origin;
+  }
+  return a->seq < b->seq;
+}
+
+struct sim_event *sim_event_new(int type, struct sim_node *node, unsigned long delay) {
+  struct sim_event *e = calloc(1, sizeof(struct sim_event));
+  if(e == NULL) {
+    perror("sim");
+    exit(1);
+  }
+  e->type = type;
+  e->node = node;
+  e->time = sim_now + delay;
+  return e;
+}
+
+static void heap_push(struct sim_partition *p, struct sim_event *e) {
+  size_t i;
+  if(p->heap_size == p->heap_capacity) {
+    p->heap_capacity = p->heap_capacity ? p->heap_capacity * 2 : 1024;
+    p->heap = realloc(p->heap, p->heap_capacity * sizeof(struct sim_event *));
+    if(p->heap == NULL) {
+      perror("sim");
+      exit(1);
+    }
+  }
+  for(i = p->heap_size++; i > 0 && before(e, p->heap[(i - 1) / 2]); i = (i - 1) / 2) {
+    p->heap[i] = p->heap[(i - 1) / 2];
+  }
+  p->heap[i] = e;
+}
+
+static struct sim_event *heap_pop(struct sim_partition *p) {
+  struct sim_event *top, *last;
+  size_t i, child;
+  if(p->heap_size == 0) {
+    return NULL;
+  }
+  top = p->heap[0];
+  last = p->heap[--p->heap_size];
+  for(i = 0; (child = 2 * i + 1) < p->heap_size; i = child) {
+    if(child + 1 < p->heap_size && before(p->heap[child + 1], p->heap[child])) {
+      child++;
+    }
+    if(!before(p->heap[child], last)) {
+      break;
+    }
+    p->heap[i] = p->heap[child];
+  }
+  p->heap[i] = last;
+  return top;
+}
+
+void sim_schedule(struct sim_event *e) {
+  // events created outside of a node (boot, commands) belong to their node
+  struct sim_node *origin = sim_current != NULL ? sim_current : e->node;
+  struct sim_partition *p = &partitions[e->node->partition];
+  e->origin = origin->index;
+  e->seq = origin->seq++;
+  if(sim_current == NULL || e->node->partition == sim_current->partition) {
+    heap_push(p, e);
+  } else {
+    // another partition: lock-free push, its owner only reads its inbox between two windows
+    if(e->time < partitions[sim_current->partition].sent_time) {
+      partitions[sim_current->partition].sent_time = e->time;
+    }
+    e->next = atomic_load_explicit(&p->inbox, memory_order_relaxed);
+    while(!atomic_compare_exchange_weak_explicit(&p->inbox, &e->next, e, memory_order_release, memory_order_relaxed));
+  }
+}
+
+/********************************************//**
+*  Nodes and radio
+***********************************************/
+
+// xorshift32, the state must not be 0
+uint32_t sim_random(uint32_t *state) {
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+// swaps the memory of the node in its firmware
+void sim_enter(struct sim_node *node) {
+  struct sim_firmware *f = node->firmware;
+  if(f->resident != node) {
+    if(f->resident != NULL) {
+      memcpy(f->resident->state, f->segment, f->size);
+    }
+    memcpy(f->segment, node->state, f->size);
+    f->resident = node;
+  }
+  sim_current = node;
+  linkaddr_node_addr = node->addr;
+}
+
+void sim_radio_send(int conn_type, uint16_t channel, const linkaddr_t *to, uint8_t seqno) {
+  struct sim_node *sender = sim_current;
+  struct sim_event *e;
+  int i;
+  if(sender->recovery != 0 && sim_now >= sender->failure && sim_now < sender->recovery) {
+    return;
+  }
+  sender->tx++;
+  sim_spend(sender);
+  if(sim_verbose > 1) {
+    fprintf(stderr, "%lu.%03lu %d.%d -> %s%d.%d (%u): %.*s\n", sim_now / CLOCK_SECOND, (sim_now % CLOCK_SECOND) * 1000 / CLOCK_SECOND,
+            sender->addr.u8[0], sender->addr.u8[1], to == NULL ? "*" : "", to == NULL ? 0 : to->u8[0], to == NULL ? 0 : to->u8[1],
+            channel, (int) packetbuf_datalen(), (char *) packetbuf_dataptr());
+  }
+  for(i = 0; i < sender->num_neighbors; i++) {
+    struct sim_node *n = &nodes[sender->neighbors[i]];
+    if(to != NULL && !linkaddr_cmp(&n->addr, to)) {
+      continue;
+    }
+    if(sim_random(&sender->radio) < sim_loss_threshold) {
+      sender->lost++;
+      continue;
+    }
+    e = sim_event_new(SIM_PACKET, n, sim_latency);
+    e->ptr = sender;
+    e->conn_type = conn_type;
+    e->channel = channel;
+    e->from = sender->addr;
+    e->seqno = seqno;
+    e->len = packetbuf_datalen();
+    memcpy(e->payload, packetbuf_dataptr(), e->len);
+    sim_schedule(e);
+  }
+}
+
+// a packet sent or received costs a unit of energy to a sensor node, which fails once it has none left
+void sim_spend(struct sim_node *node) {
+  if(sim_energy == 0 || node->index == 0 || node->energy == 0) {
+    return;
+  }
+  if(--node->energy == 0) {
+    node->depleted = sim_now;
+    if(node->failure == 0 || node->failure > sim_now) {
+      node->failure = sim_now;
+      node->recovery = 0;
+    }
+  }
+}
+
+static void place_nodes(const char *positions, double range) {
+  int i, j, side = (int) ceil(sqrt(num_nodes));
+  if(positions != NULL) {
+    FILE *f = fopen(positions, "r");
+    if(f == NULL) {
+      perror(positions);
+      exit(1);
+    }
+    for(i = 0; i < num_nodes; i++) {
+      if(fscanf(f, "%lf %lf", &nodes[i].x, &nodes[i].y) != 2) {
+        fprintf(stderr, "sim: %s has no position for node %d\n", positions, i + 1);
+        exit(1);
+      }
+    }
+    fclose(f);
+  } else {
+    // grid, with the root node in a corner
+    for(i = 0; i < num_nodes; i++) {
+      nodes[i].x = i % side;
+      nodes[i].y = i / side;
+    }
+  }
+  for(i = 0; i < num_nodes; i++) {
+    nodes[i].neighbors = malloc(num_nodes * sizeof(int));
+    for(j = 0; j < num_nodes; j++) {
+      double dx = nodes[i].x - nodes[j].x, dy = nodes[i].y - nodes[j].y;
+      if(j != i && dx * dx + dy * dy <= range * range) {
+        nodes[i].neighbors[nodes[i].num_neighbors++] = j;
+      }
+    }
+    // only the room of the neighbors is kept, O(n) memory instead of O(n^2)
+    nodes[i].neighbors = realloc(nodes[i].neighbors, (nodes[i].num_neighbors + 1) * sizeof(int));
+  }
+}
+
+static int compare_position(const void *a, const void *b) {
+  const struct sim_node *n1 = &nodes[*(const int *)a], *n2 = &nodes[*(const int *)b];
+  if(n1->x != n2->x) {
+    return n1->x < n2->x ? -1 : 1;
+  }
+  if(n1->y != n2->y) {
+    return n1->y < n2->y ? -1 : 1;
+  }
+  return n1->index - n2->index;
+}
+
+// splits the area in stripes of the same number of nodes, so that most neighbors share a partition
+static void partition_nodes(void) {
+  int i, *order = malloc(num_nodes * sizeof(int));
+  for(i = 0; i < num_nodes; i++) {
+    order[i] = i;
+  }
+  qsort(order, num_nodes, sizeof(int), compare_position);
+  for(i = 0; i < num_nodes; i++) {
+    nodes[order[i]].partition = (int)((long) i * num_partitions / num_nodes);
+  }
+  free(order);
+}
+
+/********************************************//**
+*  Firmwares
+***********************************************/
+
+struct segment_search {
+  void *base;
+  unsigned char *segment;
+  size_t size;
+};
+
+static int find_segment(struct dl_phdr_info *info, size_t size, void *data) {
+  struct segment_search *s = data;
+  int i;
+  for(i = 0; i < info->dlpi_phnum; i++) {
+    const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+    // the base of a shared object is the address of its first segment
+    if(ph->p_type == PT_LOAD && ph->p_offset == 0 && (void *)(info->dlpi_addr + ph->p_vaddr) != s->base) {
+      return 0;
+    }
+  }
+  for(i = 0; i < info->dlpi_phnum; i++) {
+    const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+    if(ph->p_type == PT_LOAD && (ph->p_flags & PF_W)) {
+      s->segment = (unsigned char *)(info->dlpi_addr + ph->p_vaddr);
+      s->size = ph->p_memsz;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// loads a private copy of a firmware: the same path would give the copy of another partition
+static void load_firmware(struct sim_firmware *f, const char *path, int partition) {
+  struct segment_search s;
+  Dl_info info;
+  char copy[PATH_MAX];
+  f->path = path;
+  if(partition == 0) {
+    f->handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+  } else {
+    char buf[BUFSIZ];
+    size_t n;
+    FILE *in = fopen(path, "rb"), *out;
+    int fd;
+    snprintf(copy, sizeof(copy), "/tmp/sim-%d-XXXXXX.so", partition);
+    fd = mkstemps(copy, 3);
+    if(in == NULL || fd < 0 || (out = fdopen(fd, "wb")) == NULL) {
+      perror(path);
+      exit(1);
+    }
+    while((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+      fwrite(buf, 1, n, out);
+    }
+    fclose(in);
+    fclose(out);
+    f->handle = dlopen(copy, RTLD_NOW | RTLD_LOCAL);
+    unlink(copy);
+  }
+  if(f->handle == NULL) {
+    fprintf(stderr, "sim: %s\n", dlerror());
+    exit(1);
+  }
+  f->autostart = dlsym(f->handle, "autostart_processes");
+  if(f->autostart == NULL || dladdr((void *) f->autostart, &info) == 0) {
+    fprintf(stderr, "sim: %s has no autostart processes\n", path);
+    exit(1);
+  }
+  memset(&s, 0, sizeof(s));
+  s.base = info.dli_fbase;
+  if(!dl_iterate_phdr(find_segment, &s)) {
+    fprintf(stderr, "sim: %s has no writable segment\n", path);
+    exit(1);
+  }
+  f->segment = s.segment;
+  f->size = s.size;
+  f->initial = malloc(f->size);
+  memcpy(f->initial, f->segment, f->size);
+  f->resident = NULL;
+}
+
+/********************************************//**
+*  Time windows
+***********************************************/
+
+// waits for all the partitions, yielding rather than spinning since there may be more threads than cores
+static void window_barrier(int *sense) {
+  *sense = !*sense;
+  if(atomic_fetch_add(&barrier_count, 1) == num_partitions - 1) {
+    atomic_store(&barrier_count, 0);
+    atomic_store(&barrier_sense, *sense);
+  } else {
+    while(atomic_load(&barrier_sense) != *sense) {
+      sched_yield();
+    }
+  }
+}
+
+static void *run_partition(void *arg) {
+  struct sim_partition *p = arg;
+  struct sim_event *e, *next;
+  unsigned long start, horizon, window;
+  int i, sense = 0;
+
+  p->sent_time = ULONG_MAX;
+  for(window = 0;; window++) {
+    // the events sent during the window are in the inbox of their partition once everyone reached the barrier
+    p->next_time[window & 1] = p->heap_size > 0 && p->heap[0]->time < p->sent_time ? p->heap[0]->time : p->sent_time;
+    p->sent_time = ULONG_MAX;
+    window_barrier(&sense);
+    start = ULONG_MAX;
+    for(i = 0; i < num_partitions; i++) {
+      if(partitions[i].next_time[window & 1] < start) {
+        start = partitions[i].next_time[window & 1];
+      }
+    }
+    for(e = atomic_exchange_explicit(&p->inbox, NULL, memory_order_acquire); e != NULL; e = next) {
+      next = e->next;
+      heap_push(p, e);
+    }
+    if(start > end_time) {
+      break;
+    }
+    // nothing sent by another partition can happen before the horizon
+    horizon = start + sim_latency;
+    while(p->heap_size > 0 && p->heap[0]->time < horizon && p->heap[0]->time <= end_time) {
+      e = heap_pop(p);
+      sim_now = e->time;
+      // a failed node neither runs nor receives, a node whose radio is off does not receive
+      if(e->node->failure == 0 || e->time < e->node->failure
+         || (e->node->recovery != 0 && (e->time >= e->node->recovery || (e->type != SIM_PACKET && e->type != SIM_ACK)))) {
+        sim_dispatch(e);
+      }
+      free(e);
+      p->events++;
+    }
+  }
+  return NULL;
+}
+
+static void print_stats(void) {
+  unsigned long tx = 0, rx = 0, lost = 0, events = 0;
+  int i;
+  for(i = 0; i < num_nodes; i++) {
+    tx += nodes[i].tx;
+    rx += nodes[i].rx;
+    lost += nodes[i].lost;
+  }
+  for(i = 0; i < num_partitions; i++) {
+    events += partitions[i].events;
+  }
+  fprintf(stderr, "sim: %d nodes, %lu s, %d partitions, %lu events, %lu transmissions, %lu receptions, %lu losses\n",
+          num_nodes, end_time / CLOCK_SECOND, num_partitions, events, tx, rx, lost);
+}
+
+// lifetime of the network with an energy budget (-e): the first node which ran out of energy, and the
+// first one after which a node still alive could not reach the root through the nodes still alive
+static void print_lifetime(void) {
+  int *order = malloc(num_nodes * sizeof(int));
+  int *alive = malloc(num_nodes * sizeof(int));
+  int *reached = malloc(num_nodes * sizeof(int));
+  int *fifo = malloc(num_nodes * sizeof(int));
+  int num_depleted = 0, living = num_nodes, i, j, k, head, tail;
+  for(i = 0; i < num_nodes; i++) {
+    alive[i] = 1;
+    // by time of depletion
+    if(nodes[i].depleted != 0) {
+      for(j = num_depleted; j > 0 && nodes[order[j - 1]].depleted > nodes[i].depleted; j--) {
+        order[j] = order[j - 1];
+      }
+      order[j] = i;
+      num_depleted++;
+    }
+  }
+  fprintf(stderr, "sim: %d nodes out of energy", num_depleted);
+  if(num_depleted > 0) {
+    fprintf(stderr, ", the first at %lu s", nodes[order[0]].depleted / CLOCK_SECOND);
+  }
+  for(k = 0; k < num_depleted; k++) {
+    alive[order[k]] = 0;
+    living--;
+    // breadth-first search of the radio graph of the nodes alive from the root
+    memset(reached, 0, num_nodes * sizeof(int));
+    reached[0] = 1;
+    fifo[0] = 0;
+    for(head = 0, tail = 1; head < tail; head++) {
+      struct sim_node *n = &nodes[fifo[head]];
+      for(j = 0; j < n->num_neighbors; j++) {
+        if(alive[n->neighbors[j]] && !reached[n->neighbors[j]]) {
+          reached[n->neighbors[j]] = 1;
+          fifo[tail++] = n->neighbors[j];
+        }
+      }
+    }
+    if(tail < living) {
+      fprintf(stderr, ", partitioned at %lu s (%d nodes cut off)", nodes[order[k]].depleted / CLOCK_SECOND, living - tail);
+      break;
+    }
+  }
+  fprintf(stderr, "\n");
+  free(order);
+  free(alive);
+  free(reached);
+  free(fifo);
+}
+
+static void usage(void) {
+  fprintf(stderr, "usage: sim [-n nodes] [-t seconds] [-s seed] [-r range] [-l loss] [-d latency] [-b seconds]\n"
+                  "           [-p positions] [-i commands] [-j threads] [-k node:seconds[:seconds]]... [-e packets] [-v]\n");
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  const char *positions = NULL, *commands = NULL;
+  // node failures given with -k
+  int failed[MAX_NODES];
+  unsigned long failure[MAX_NODES], recovery[MAX_NODES];
+  int num_failures = 0;
+  unsigned long duration = 3600, seed = 1, boot = 1;
+  double range = 1.5, loss = 0.0;
+  struct sim_event *e;
+  int i, j, opt;
+
+  while((opt = getopt(argc, argv, "n:t:s:r:l:d:b:p:i:j:k:e:v")) != -1) {
+    switch(opt) {
+    case 'n': num_nodes = atoi(optarg); break;
+    case 't': duration = strtoul(optarg, NULL, 10); break;
+    case 's': seed = strtoul(optarg, NULL, 10); break;
+    case 'r': range = atof(optarg); break;
+    case 'l': loss = atof(optarg); break;
+    case 'd': sim_latency = strtoul(optarg, NULL, 10); break;
+    case 'b': boot = strtoul(optarg, NULL, 10); break;
+    case 'p': positions = optarg; break;
+    case 'i': commands = optarg; break;
+    case 'j': num_partitions = atoi(optarg); break;
+    case 'k':
+      recovery[num_failures] = 0;
+      if(num_failures == MAX_NODES || sscanf(optarg, "%d:%lu:%lu", &failed[num_failures], &failure[num_failures], &recovery[num_failures]) < 2
+         || failure[num_failures] == 0 || (recovery[num_failures] != 0 && recovery[num_failures] <= failure[num_failures])) {
+        usage();
+      }
+      num_failures++;
+      break;
+    case 'e': sim_energy = strtoul(optarg, NULL, 10); break;
+    case 'v': sim_verbose++; break;
+    default: usage();
+    }
+  }
+  if(num_nodes == 0) {
+    num_nodes = 9;
+  }
+  if(num_nodes < 1 || num_nodes > MAX_NODES || loss < 0 || loss > 1 || sim_latency == 0 || boot == 0 || num_partitions < 1) {
+    usage();
+  }
+  if(num_partitions > num_nodes) {
+    num_partitions = num_nodes;
+  }
+  sim_loss_threshold = (uint32_t)(loss * 4294967295.0);
+  end_time = duration * CLOCK_SECOND;
+
+  nodes = calloc(num_nodes, sizeof(struct sim_node));
+  for(i = 0; i < num_nodes; i++) {
+    nodes[i].index = i;
+  }
+  for(i = 0; i < num_failures; i++) {
+    // the root node is node 1
+    if(failed[i] < 1 || failed[i] > num_nodes) {
+      usage();
+    }
+    nodes[failed[i] - 1].failure = failure[i] * CLOCK_SECOND;
+    nodes[failed[i] - 1].recovery = recovery[i] * CLOCK_SECOND;
+  }
+  place_nodes(positions, range);
+  partition_nodes();
+
+  partitions = calloc(num_partitions, sizeof(struct sim_partition));
+  for(i = 0; i < num_partitions; i++) {
+    partitions[i].index = i;
+    atomic_init(&partitions[i].inbox, NULL);
+    load_firmware(&partitions[i].root, "./root_node.so", i);
+    load_firmware(&partitions[i].sensor, "./sensor_node.so", i);
+  }
+
+  for(i = 0; i < num_nodes; i++) {
+    struct sim_node *n = &nodes[i];
+    struct sim_partition *p = &partitions[n->partition];
+    uint32_t s = (uint32_t)(seed * 2654435761UL) ^ (uint32_t)((i + 1) * 40503UL);
+    // node i+1 has the address of the (i+1)th mote of Cooja up to 9, then the digits of i+1 in
+    // base MAX_INDEX go in u8[0] and u8[1]
+    n->addr.u8[0] = (i + 1) % MAX_INDEX;
+    n->addr.u8[1] = (i + 1) / MAX_INDEX;
+    n->firmware = i == 0 ? &p->root : &p->sensor;
+    n->state = malloc(n->firmware->size);
+    memcpy(n->state, n->firmware->initial, n->firmware->size);
+    n->random = s ? s : 1;
+    n->radio = sim_random(&n->random) | 1;
+    n->sensor = sim_random(&n->radio) | 1;
+    n->temperature = 200 + sim_random(&n->sensor) % 100;
+    n->battery = 2800 + sim_random(&n->sensor) % 200;
+    n->energy = sim_energy;
+    for(j = 0; j < SIM_MAX_FDS; j++) {
+      n->fd_file[j] = -1;
+    }
+  }
+
+  // the nodes boot within the first seconds (-b), their clocks start at their boot
+  for(i = 0; i < num_nodes; i++) {
+    sim_schedule(sim_event_new(SIM_BOOT, &nodes[i], sim_random(&nodes[i].random) % (boot * CLOCK_SECOND)));
+  }
+  if(commands != NULL) {
+    FILE *f = fopen(commands, "r");
+    // room for PACKETBUF_SIZE bytes in hexadecimal
+    char line[2 * PACKETBUF_SIZE + 32];
+    double at;
+    int offset;
+    if(f == NULL) {
+      perror(commands);
+      exit(1);
+    }
+    while(fgets(line, sizeof(line), f) != NULL) {
+      if(sscanf(line, "%lf %n", &at, &offset) != 1) {
+        continue;
+      }
+      e = sim_event_new(SIM_UART, &nodes[0], (unsigned long)(at * CLOCK_SECOND));
+      if(line[offset] == ':') {
+        unsigned int byte;
+        char *hex = line + offset + 1;
+        for(e->len = 0; e->len < PACKETBUF_SIZE && sscanf(hex, "%2x", &byte) == 1; hex += 2) {
+          e->payload[e->len++] = byte;
+        }
+      }
+      else {
+        e->len = strlen(line + offset) < PACKETBUF_SIZE ? strlen(line + offset) : PACKETBUF_SIZE;
+        memcpy(e->payload, line + offset, e->len);
+      }
+      sim_schedule(e);
+    }
+    fclose(f);
+  }
+
+  for(i = 1; i < num_partitions; i++) {
+    if(pthread_create(&partitions[i].thread, NULL, run_partition, &partitions[i]) != 0) {
+      perror("sim");
+      exit(1);
+    }
+  }
+  run_partition(&partitions[0]);
+  for(i = 1; i < num_partitions; i++) {
+    pthread_join(partitions[i].thread, NULL);
+  }
+  fflush(stdout);
+  print_stats();
+  if(sim_energy != 0) {
+    print_lifetime();
+  }
+  return 0;
+}
@@ -0,0 +1,151 @@
+/*
+ * Deterministic simulator of the sensor network. The firmwares are built
+ * as shared objects against the Contiki API of include/ and run in the
+ * simulator process: all the nodes of a partition running the same
+ * firmware share a copy of it, and the writable segment of the copy is
+ * swapped in and out of the memory of each node when the node runs.
+ */
+#ifndef SIM_H_
+#define SIM_H_
+
+#include "contiki.h"
+#include "net/rime/rime.h"
+
+// maximum number of rime connections opened by a node
+#define SIM_MAX_CONNS 8
+// maximum number of processes started by a node
+#define SIM_MAX_PROCESSES 4
+// maximum number of files and of open files of a node
+#define SIM_MAX_FILES 4
+#define SIM_MAX_FDS 4
+
+enum sim_event_type {
+  SIM_BOOT,
+  SIM_ETIMER,
+  SIM_CTIMER,
+  SIM_PROCESS,
+  SIM_PACKET,
+  SIM_ACK,
+  SIM_REXMIT,
+  SIM_UART
+};
+
+enum sim_conn_type {
+  SIM_BROADCAST,
+  SIM_UNICAST,
+  SIM_RUNICAST
+};
+
+struct sim_node;
+
+// a firmware loaded in the simulator
+struct sim_firmware {
+  const char *path;
+  void *handle;
+  // writable segment of the firmware: the memory of the resident node
+  unsigned char *segment;
+  size_t size;
+  // content of the writable segment after loading, the memory of a node at boot
+  unsigned char *initial;
+  struct sim_node *resident;
+  struct process * const *autostart;
+};
+
+struct sim_conn {
+  uint16_t channel;
+  int type;
+  void *conn;
+};
+
+// a file of the external flash of a node
+struct sim_file {
+  char name[16];
+  unsigned char *data;
+  long size;
+};
+
+struct sim_node {
+  int index;
+  int partition;
+  // number of events created by the node, orders the events of the same time
+  unsigned long seq;
+  linkaddr_t addr;
+  double x, y;
+  struct sim_firmware *firmware;
+  // memory of the node while it is not resident
+  unsigned char *state;
+  struct sim_conn conns[SIM_MAX_CONNS];
+  int num_conns;
+  struct process *processes[SIM_MAX_PROCESSES];
+  int num_processes;
+  int *neighbors;
+  int num_neighbors;
+  // random streams: random_rand, losses of the packets sent by the node, sensors
+  uint32_t random, radio, sensor;
+  int temperature;
+  int battery;
+  int (* uart_input)(unsigned char c);
+  // time at which the UART has sent the bytes written so far, in byte times
+  unsigned long uart_idle;
+  struct sim_file files[SIM_MAX_FILES];
+  // file and position of each open file descriptor, file -1 if the descriptor is free
+  int fd_file[SIM_MAX_FDS];
+  long fd_pos[SIM_MAX_FDS];
+  // time at which the node booted, the origin of its clock
+  unsigned long boot;
+  // time at which the node fails (-k), 0 if never: its events are dropped from then on,
+  // or only its packets until the recovery time when there is one: its radio is off
+  unsigned long failure, recovery;
+  // energy left in packets (-e), and time at which the node ran out of it, 0 if never
+  unsigned long energy, depleted;
+  // statistics
+  unsigned long tx, rx, lost;
+};
+
+struct sim_event {
+  unsigned long time;
+  // node which created the event and its count of events
+  int origin;
+  unsigned long seq;
+  struct sim_event *next;
+  int type;
+  struct sim_node *node;
+  // timer, process or sending node of the event
+  void *ptr;
+  void *data;
+  unsigned long generation;
+  process_event_t ev;
+  // packets
+  int conn_type;
+  uint16_t channel;
+  linkaddr_t from;
+  uint8_t seqno;
+  uint16_t len;
+  uint8_t payload[PACKETBUF_SIZE];
+};
+
+/* Engine (sim.c) */
+// time and node of the partition run by the calling thread
+extern __thread unsigned long sim_now;
+extern __thread struct sim_node *sim_current;
+extern int sim_verbose;
+// latency of the radio in ticks, a packet is lost when the random draw of the link is below the threshold
+extern unsigned long sim_latency;
+extern uint32_t sim_loss_threshold;
+// energy of a sensor node in packets sent or received (-e), 0 if unlimited; the battery
+// readings go down to SIM_BATTERY_EMPTY (BATTERY_EMPTY of sensor_node_v3.c) with it
+extern unsigned long sim_energy;
+#define SIM_BATTERY_EMPTY 2200
+
+struct sim_event *sim_event_new(int type, struct sim_node *node, unsigned long delay);
+void sim_schedule(struct sim_event *e);
+void sim_enter(struct sim_node *node);
+uint32_t sim_random(uint32_t *state);
+void sim_radio_send(int conn_type, uint16_t channel, const linkaddr_t *to, uint8_t seqno);
+void sim_spend(struct sim_node *node);
+
+/* Contiki API (contiki-sim.c) */
+void sim_boot(struct sim_node *node);
+void sim_dispatch(struct sim_event *e);
+
+#endif /* SIM_H_ */
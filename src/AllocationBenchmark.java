@@ -0,0 +1,121 @@
+/*
+ * Allocation benchmark of the hot path of the Gateway: synthetic readings of NODES nodes are framed by a RootLink
+ * into a WorkerPool and handled by the ReadingPublisher of each worker, with a time series store in a temporary directory and a sink
+ * in place of the MQTT client. After a warm-up which builds the topics and compiles the path, it measures the bytes
+ * allocated by all the threads per reading. The measure stays within the first segment of each series, since
+ * opening a segment (once every 4096 samples of a series) allocates, as do the few KB of buffers of the reader
+ * for the stream. The MQTT client is not measured: Paho allocates at every publish.
+ * Run with java AllocationBenchmark [workers]; the exit status is 1 if a reading allocates MAX_BYTES or more.
+ */
+import java.io.ByteArrayInputStream;
+import java.io.File;
+import java.lang.management.ManagementFactory;
+import java.nio.charset.StandardCharsets;
+import java.nio.file.Files;
+import java.util.ArrayList;
+import java.util.Arrays;
+import java.util.HashMap;
+import java.util.HashSet;
+import java.util.concurrent.atomic.AtomicLong;
+import org.eclipse.paho.client.mqttv3.MqttMessage;
+
+public class AllocationBenchmark {
+    public static final int NODES = 50; // two series each
+    public static final int WARMUP = 1000; // readings per series
+    public static final int MEASURED = 3000; // WARMUP + MEASURED within a segment
+    public static final double MAX_BYTES = 1.0; // bytes allocated per reading at steady state
+
+    public static void main(String[] args) throws Exception {
+        int workers = args.length > 0 ? Integer.parseInt(args[0]) : Runtime.getRuntime().availableProcessors();
+        File directory = Files.createTempDirectory("timeseries").toFile();
+        final TimeSeriesStore store = new TimeSeriesStore(directory.getPath(), Gateway.TIMESERIES_RETENTION);
+        LastValueCache cache = new LastValueCache(Gateway.CACHE_FRESHNESS);
+        HashMap<String, ArrayList<String>> groups = new HashMap<>();
+        groups.put("zone", new ArrayList<>(Arrays.asList("0.1", "0.2", "0.3", "0.4", "0.5")));
+        final HashSet<String> active = new HashSet<>(groups.keySet());
+        final long[] clock = {0, System.currentTimeMillis()};
+
+        final AtomicLong published = new AtomicLong();
+        ReadingPublisher.Sink sink = new ReadingPublisher.Sink() {
+            public void publish(String topic, MqttMessage message) {
+                published.incrementAndGet();
+            }
+        };
+        ReadingPublisher.Context context = new ReadingPublisher.Context() {
+            public long[] networkTime() {
+                return clock;
+            }
+            public HashSet<String> activeGroups() {
+                return active;
+            }
+        };
+        final AtomicLong handled = new AtomicLong();
+        WorkerPool.Handler[] handlers = new WorkerPool.Handler[workers];
+        for(int i = 0; i < workers; i++){
+            final ReadingPublisher readings = new ReadingPublisher(sink, context, groups, store, cache,
+                                                                  new SequenceTracker());
+            handlers[i] = new WorkerPool.Handler() {
+                public void handle(byte[] line, int length) throws Exception {
+                    readings.publish(line, length);
+                    handled.incrementAndGet();
+                }
+            };
+        }
+        WorkerPool pool = new WorkerPool(handlers);
+        byte[] warmup = readings(0, WARMUP);
+        byte[] measured = readings(WARMUP, MEASURED);
+
+        run(pool, warmup, handled, (long) WARMUP * NODES * 2);
+        com.sun.management.ThreadMXBean threads = (com.sun.management.ThreadMXBean) ManagementFactory.getThreadMXBean();
+        threads.setThreadAllocatedMemoryEnabled(true);
+        long[] ids = threads.getAllThreadIds();
+        long before = allocated(threads, ids);
+        long start = System.nanoTime();
+        run(pool, measured, handled, (long) (WARMUP + MEASURED) * NODES * 2);
+        long time = System.nanoTime() - start;
+        long bytes = allocated(threads, ids) - before;
+
+        long n = (long) MEASURED * NODES * 2;
+        System.out.println(workers + " workers, " + n + " readings, " + published.get() + " messages in total");
+        System.out.println(String.format("%.0f readings/s", n * 1e9 / time));
+        System.out.println(bytes + " bytes allocated, " + String.format("%.3f", (double) bytes / n) + " bytes per reading");
+        for(File series : directory.listFiles()){
+            for(File segment : series.listFiles()){
+                segment.delete();
+            }
+            series.delete();
+        }
+        directory.delete();
+        System.exit((double) bytes / n < MAX_BYTES ? 0 : 1);
+    }
+
+    // Returns the lines "i.j/Channel/value/seq/time" of the readings from..from+count-1 of each series
+    private static byte[] readings(int from, int count){
+        StringBuilder b = new StringBuilder();
+        for(int k = from; k < from + count; k++){
+            for(int node = 0; node < NODES; node++){
+                for(String channel : new String[]{"B", "T"}){
+                    b.append(node/10).append('.').append(node%10).append('/').append(channel).append('/')
+                     .append(200 + k%50).append('/').append(k == 0 ? 0 : 1 + (k-1)%255).append('/').append(k).append('\n');
+                }
+            }
+        }
+        return b.toString().getBytes(StandardCharsets.US_ASCII);
+    }
+
+    // Feeds the lines to the pool and waits until the workers handled the given total of readings
+    private static void run(WorkerPool pool, byte[] lines, AtomicLong handled, long total) throws Exception {
+        new RootLink(null, false).read(new ByteArrayInputStream(lines), pool);
+        while(handled.get() < total){
+            Thread.sleep(1);
+        }
+    }
+
+    private static long allocated(com.sun.management.ThreadMXBean threads, long[] ids){
+        long sum = 0;
+        for(long bytes : threads.getThreadAllocatedBytes(ids)){
+            sum += Math.max(bytes, 0);
+        }
+        return sum;
+    }
+}
@@ -5,26 +5,60 @@ http://courses.cs.tau.ac.il/embedded/contiki-2.3/examples/sky-shell/src/se/sics/
  */
 
 /**
- *The Gateway is run from command line with the command java Gateway /dev/ttyUSBX where ttUSBX contains the root_node code
+ *The Gateway is run from command line with the command java Gateway /dev/ttyUSBX [workers] where ttUSBX contains the root_node code
  */
 import java.io.BufferedReader;
-import java.io.BufferedWriter;
+import java.io.File;
+import java.io.FileInputStream;
+import java.io.IOException;
+import java.io.InputStream;
 import java.io.InputStreamReader;
-import java.io.OutputStreamWriter;
+import java.nio.charset.StandardCharsets;
 import java.util.ArrayList;
+import java.util.Arrays;
+import java.util.HashMap;
+import java.util.HashSet;
+import java.util.Properties;
 import java.util.Scanner;
+import java.util.TreeSet;
+import java.util.concurrent.Semaphore;
+import java.util.concurrent.TimeUnit;
 import org.eclipse.paho.client.mqttv3.MqttClient;
+import org.eclipse.paho.client.mqttv3.MqttException;
 import org.eclipse.paho.client.mqttv3.MqttMessage;
 
 public class Gateway {
     public static final String SERIALDUMP_WINDOWS = "/home/user/contiki/tools/sky/serialdump-windows.exe";
     public static final String SERIALDUMP_LINUX = "/home/user/contiki/tools/sky/serialdump-linux"; //See ex session with hardware
+    public static final String TIMESERIES_DIRECTORY = "timeseries";
+    public static final long TIMESERIES_RETENTION = 7L*24*3600*1000; // samples are kept one week
+    public static final long CACHE_FRESHNESS = 90000; // a cached value is served during 3 reporting periods
+    public static final String GROUPS_FILE = "groups.properties"; // lines "group=nodeID,nodeID,..."
+    public static final String ALL_NODES = "all"; // zone of the aggregate topics on all the nodes, not a group
+    public static final String ALERTS_FILE = "alerts.properties"; // lines "Channel=low,high", an empty bound is not checked
+    public static final int MAX_COMMAND_LENGTH = 99; // DOWNLINK_MSG_LEN of the root node, without the end of the string
+    public static final long COMMAND_TIMEOUT = 5000; // ms to wait for the acknowledgement of a command by the root node
     private Process serialDumpProcess;
+    private final boolean binary; // binary frames on the serial line, must match BINARY_SERIAL of the root node
     private ArrayList<String> topics;
     private ArrayList<String> previousTopics = new ArrayList<>();
+    private ArrayList<String> deferredTopics = new ArrayList<>();
+    private HashMap<String, ArrayList<String>> groups = new HashMap<>();
+    private volatile HashSet<String> activeGroups = new HashSet<>(); // groups with at least one subscriber
+    private volatile ArrayList<String> liveNodes = new ArrayList<>(); // nodes reachable via the root node
+    private volatile HashMap<String, Integer> demands = new HashMap<>(); // finest interval (s) asked for each request
+    private volatile long[] networkTime = null; // {network time (s, modulo 2^16), wall clock (ms)} of the last clock line
+    private volatile HashMap<String, String> aggregates = new HashMap<>(); // aggregate query asked on each channel (B or T): "epoch targets"
+    private HashMap<String, String> previousAggregates = new HashMap<>(); // aggregate query sent to the root node on each channel
+    private volatile HashMap<String, ArrayList<String>> aggregateTopics = new HashMap<>(); // topics of the results of each channel
+    private volatile HashMap<String, String> aggregateZones = new HashMap<>(); // zones covered by the query of each channel
+    private HashMap<String, String> previousAlerts = new HashMap<>(); // alert rule sent to the root node on each channel: "low/high"
+    private String serialOverflow = ""; // last "dropped peak" of the transmit buffer of the root node
+    private final Semaphore acknowledgements = new Semaphore(0); // released by each "V/version" line of the root node
     
-    public Gateway(String port)
+    public Gateway(String port, int shards, boolean binary)
     {
+        this.binary = binary;
         String fullCommand;
         String osName = System.getProperty("os.name").toLowerCase();
         if (osName.startsWith("win")) {
@@ -34,11 +68,12 @@ public class Gateway {
         }
         
         try{
+            loadGroups();
             String[] command = fullCommand.split(" ");
             serialDumpProcess = Runtime.getRuntime().exec(command);
-            final BufferedReader input = new BufferedReader(new InputStreamReader(serialDumpProcess.getInputStream()));
+            final InputStream input = serialDumpProcess.getInputStream();
             final BufferedReader err = new BufferedReader(new InputStreamReader(serialDumpProcess.getErrorStream()));
-            final BufferedWriter output = new BufferedWriter(new OutputStreamWriter(serialDumpProcess.getOutputStream()));
+            final RootLink link = new RootLink(serialDumpProcess.getOutputStream(), binary);
             
             final MqttClient gateway = new MqttClient("tcp://localhost:1883", MqttClient.generateClientId());
             gateway.connect();
@@ -46,38 +81,50 @@ public class Gateway {
             final MqttCallbackWithPrint callback = new MqttCallbackWithPrint("Publisher");
             gateway.setCallback(callback);
             gateway.subscribe("Topic");
+            gateway.subscribe("Query/#");
+            
+            final TimeSeriesStore store = new TimeSeriesStore(TIMESERIES_DIRECTORY, TIMESERIES_RETENTION);
+            final LastValueCache cache = new LastValueCache(CACHE_FRESHNESS);
+            final Topology topology = new Topology();
+            final RateController rates = new RateController(topology);
+            final SequenceTracker[] sequences = new SequenceTracker[shards];
             
             final Scanner scan = new Scanner(System.in);
             
-            /* Start thread listening on stdout */
+            /* Decodes, deduplicates, stores and publishes the lines of the root node, on the worker of their node.
+               The readings take the allocation-free path of the publisher of the worker, the other lines are split */
+            final ReadingPublisher.Sink sink = new ReadingPublisher.Sink() {
+                public void publish(String topic, MqttMessage message) throws Exception {
+                    gateway.publish(topic, message);
+                }
+            };
+            final ReadingPublisher.Context context = new ReadingPublisher.Context() {
+                public long[] networkTime() {
+                    return networkTime;
+                }
+                public HashSet<String> activeGroups() {
+                    return activeGroups;
+                }
+            };
+            WorkerPool.Handler[] handlers = new WorkerPool.Handler[shards];
+            for(int i = 0; i < shards; i++){
+                sequences[i] = new SequenceTracker();
+                final ReadingPublisher readings = new ReadingPublisher(sink, context, groups, store, cache, sequences[i]);
+                handlers[i] = new WorkerPool.Handler() {
+                    public void handle(byte[] line, int length) throws Exception {
+                        if(!readings.publish(line, length)){
+                            rootLine(new String(line, 0, length, StandardCharsets.US_ASCII), gateway, topology, rates);
+                        }
+                    }
+                };
+            }
+            final WorkerPool workers = new WorkerPool(handlers);
+            
+            /* Start thread listening on stdout: frames the messages of the root node into the shards of the workers */
             Thread readInput = new Thread(new Runnable() {
                 public void run() {
-                String line;
                 try {
-                    while ((line = input.readLine()) != null) {
-                        String[] data = line.split("/"); //Messages from nodes have the form "ID/Battery(Humidity)/value"
-                        //System.out.println("received from root: "+ line);
-                        String sensed = "wrongdata";
-                        if(data[1].equals("B")){
-                            sensed = "Battery";
-                        }
-                        else if(data[1].equals("T")){
-                            sensed = "Temperature";
-                        }
-                        String topic = data[0]+"/"+sensed; //nodeID/Battery
-                        String value = data[2]; //value
-                        MqttMessage msg = new MqttMessage();
-                        //If it receives informations about Battery or Temperature, it sends it to the subscribers
-                        if(sensed.equals("Battery") || sensed.equals("Temperature")){
-                            msg.setPayload(value.getBytes());
-                            gateway.publish(topic, msg);
-                            //System.out.println("Published to subcribers: "+line);
-                        }
-                        // else does nothing
-                        else{
-                            //System.out.println("Wrong message received: "+line);
-                        }
-                    }
+                    link.read(input, workers);
                     input.close();
                     System.out.println("Serialdump process terminated.");
                     System.exit(1);
@@ -100,14 +147,12 @@ public class Gateway {
                         }
                         //If user prints P on cmd line, the data will be received periodically from the root node
                         if(config.equals("P")){
-                            output.write("P");
-                            output.flush();
+                            link.send("P");
                             System.out.println("Data will be sent periodically");
                         }
                         //Else if user prints O on cmd line, the data will be received on change from the root node
                         else if(config.equals("O")){
-                            output.write("O");
-                            output.flush();
+                            link.send("O");
                             System.out.println("Data will be sent on change");
                         }
                         else{
@@ -125,29 +170,41 @@ public class Gateway {
                 public void run() {
                 try {
                     while(true) {
-                        topics = callback.getTopics();
+                        topics = resolve(callback.getTopics());
+                        ArrayList<String> stops = new ArrayList<>();
                         for(int i =0; i<previousTopics.size();i++){
                             String s = previousTopics.get(i);
                             if(!topics.contains(s)){
-                                String stopSend = s+"/0";
-                                output.write(stopSend);
-                                output.flush();
-                                System.out.println(stopSend + " has been sent to root node");
-                                Thread.sleep(15000);
+                                stops.add(s);
                             }
                         }
+                        sendCommands(link, stops, '0');
+                        ArrayList<String> starts = new ArrayList<>();
+                        ArrayList<String> deferred = new ArrayList<>();
                         for(int i =0; i<topics.size();i++){
                             String s = topics.get(i);
                             if(!previousTopics.contains(s)){
-                                String startSend = s+"/1";
-                                output.write(startSend);
-                                output.flush();
-                                System.out.println(startSend + " has been sent to root node");
-                                Thread.sleep(15000);
+                                //A new subscriber already got a fresh value from the broker: the node is only woken up
+                                //if the subscriber is still there at the next communication
+                                if(cache.isFresh(dataTopic(s)) && !deferredTopics.contains(s)){
+                                    deferred.add(s);
+                                    System.out.println(s + " has been served from cache");
+                                    continue;
+                                }
+                                starts.add(s);
                             }
                         }
+                        sendCommands(link, starts, '1');
+                        sendAggregates(link);
+                        sendAlerts(link);
                         previousTopics = (ArrayList<String>) topics.clone();
+                        previousTopics.removeAll(deferred);
+                        deferredTopics = deferred;
                         callback.resetTopicsCount();
+                        //Stale values are removed from the broker so that new subscribers do not get them
+                        for(String t : cache.expire()){
+                            gateway.publish(t, new byte[0], 1, true);
+                        }
                         System.out.println("New comm");
                         Thread.sleep(30000); // wait 30 seconds to be sure that all subscribers are treated in the topics filling
                     }
@@ -158,9 +215,80 @@ public class Gateway {
                 }
       }, "optimization thread to send what data has no subscriber");
             
+            /* Answers the queries on the time series store. A query is published on Query/nodeID/Channel with
+               the payload "clientName latest" or "clientName from to [step]" (ms since epoch, step for downsampling).
+               The answer is published on Reply/clientName/nodeID/Channel with one "timestamp value" line per sample */
+            Thread query = new Thread(new Runnable() {
+                public void run() {
+                try {
+                    while(true) {
+                        String[] request = callback.getQueries().take();
+                        String key = request[0].substring("Query/".length());
+                        String[] args = request[1].trim().split(" ");
+                        ArrayList<double[]> samples;
+                        try{
+                            if(args.length == 2 && args[1].equals("latest")){
+                                samples = new ArrayList<>();
+                                double[] last = store.latest(key);
+                                if(last != null){
+                                    samples.add(last);
+                                }
+                            }
+                            else if(args.length == 3 || args.length == 4){
+                                long step = (args.length == 4) ? Long.parseLong(args[3]) : 0;
+                                samples = store.range(key, Long.parseLong(args[1]), Long.parseLong(args[2]), step);
+                            }
+                            else{
+                                System.out.println("Wrong query: "+request[1]);
+                                continue;
+                            }
+                        } catch(NumberFormatException e){
+                            System.out.println("Wrong query: "+request[1]);
+                            continue;
+                        }
+                        StringBuilder reply = new StringBuilder();
+                        for(double[] sample : samples){
+                            reply.append((long) sample[0]).append(" ").append((float) sample[1]).append("\n");
+                        }
+                        gateway.publish("Reply/"+args[0]+"/"+key, new MqttMessage(reply.toString().getBytes()));
+                    }
+                } catch (Exception e) {
+                    System.out.println(e.getMessage());
+                    System.exit(1);
+                }
+                }
+      }, "time series query thread");
+            
+            /* Sets the reporting interval of each request "I<nodeID>/<channel>/<seconds>": the congested subtrees
+               back off, the others come back to the finest resolution asked by their subscribers.
+               The end-to-end delivery of each series is published on Delivery (retained) at each round */
+            Thread rateControl = new Thread(new Runnable() {
+                public void run() {
+                try {
+                    while(true) {
+                        Thread.sleep(RateController.ROUND);
+                        MqttMessage delivery = new MqttMessage(SequenceTracker.stats(sequences).getBytes());
+                        delivery.setRetained(true);
+                        gateway.publish("Delivery", delivery);
+                        if(binary){
+                            System.out.println("Frames read / corrupted on the serial line: " + link.stats());
+                        }
+                        for(String command : rates.round(demands)){
+                            command(link, command+"\n");
+                        }
+                    }
+                } catch (Exception e) {
+                    System.out.println(e.getMessage());
+                    System.exit(1);
+                }
+                }
+      }, "rate control thread");
+            
             optimization.start();
             readInput.start();
             writeOutput.start();
+            query.start();
+            rateControl.start();
             
         } catch(Exception e){
             System.out.println(e.getMessage());
@@ -169,6 +297,450 @@ public class Gateway {
     }
  
     
+    /**
+     * Handles a line of the root node itself: the reachable nodes, the edges of the routing tree,
+     * the network time, the results of the aggregate queries, the readings dropped by the nodes,
+     * the overflow of the serial line and the alerts of the nodes
+     */
+    private void rootLine(String line, MqttClient gateway, Topology topology, RateController rates) throws MqttException {
+        String[] data = line.split("/");
+        //System.out.println("received from root: "+ line);
+        //The root node periodically sends the nodes it can reach: "N/ID/ID/...", whose list goes on with "N+/ID/..."
+        if(data[0].equals("N")){
+            liveNodes = new ArrayList<>(Arrays.asList(data).subList(1, data.length));
+            return;
+        }
+        if(data[0].equals("N+")){
+            ArrayList<String> live = new ArrayList<>(liveNodes);
+            live.addAll(Arrays.asList(data).subList(1, data.length));
+            liveNodes = live;
+            return;
+        }
+        //The root node reports the edges of the routing tree "E/ID/parentID/rank/etx" and the lost nodes "X/ID".
+        //Each change is published on Topology/diff, and the whole tree retained on Topology
+        if(data[0].equals("E") || data[0].equals("X")){
+            String diff = null;
+            try{
+                if(data[0].equals("E") && data.length == 5){
+                    diff = topology.update(data[1], data[2], Integer.parseInt(data[3]), Integer.parseInt(data[4]));
+                }
+                else if(data[0].equals("X") && data.length == 2){
+                    diff = topology.remove(data[1]);
+                }
+            } catch(NumberFormatException e){
+                //System.out.println("Wrong edge received: "+line);
+            }
+            if(diff != null){
+                gateway.publish("Topology/diff", new MqttMessage(diff.getBytes()));
+                MqttMessage snapshot = new MqttMessage(topology.snapshot().getBytes());
+                snapshot.setRetained(true);
+                gateway.publish("Topology", snapshot);
+            }
+            return;
+        }
+        //The root node acknowledges each command once applied with the version of the network state: "V/version"
+        if(data[0].equals("V")){
+            acknowledgements.release();
+            return;
+        }
+        //The root node periodically sends the network time in seconds modulo 2^16: "C/seconds"
+        if(data[0].equals("C") && data.length == 2){
+            try{
+                networkTime = new long[]{Long.parseLong(data[1]), System.currentTimeMillis()};
+            } catch(NumberFormatException e){
+                //System.out.println("Wrong clock received: "+line);
+            }
+            return;
+        }
+        //The root node sends the result of each epoch of an aggregate query: "A/Channel/time/count/sum/min/max",
+        //published on the aggregate topics of the channel as "timestamp count average min max zones"
+        if(data[0].equals("A") && data.length == 7){
+            try{
+                long[] clock = networkTime;
+                long timestamp = clock == null ? System.currentTimeMillis() : ReadingPublisher.wallClock(clock, Long.parseLong(data[2]));
+                int count = Integer.parseInt(data[3]);
+                // the temperatures are in tenths of degree
+                double scale = data[1].equals("T") ? 10.0 : 1.0;
+                String result = timestamp+" "+count+" "+(Long.parseLong(data[4])/scale/count)+" "
+                              +(Integer.parseInt(data[5])/scale)+" "+(Integer.parseInt(data[6])/scale)+" "
+                              +aggregateZones.get(data[1]);
+                ArrayList<String> targets = aggregateTopics.get(data[1]);
+                for(int i = 0; targets != null && i < targets.size(); i++){
+                    MqttMessage msg = new MqttMessage(result.getBytes());
+                    msg.setRetained(true);
+                    gateway.publish(targets.get(i), msg);
+                }
+            } catch(NumberFormatException | ArithmeticException e){
+                //System.out.println("Wrong aggregate received: "+line);
+            }
+            return;
+        }
+        //The root node forwards the alerts of the nodes as soon as they arrive: "!/ID/Channel/bound/value[/time]" where
+        //bound is L (below the low bound), H (above the high bound) or N (back within the bounds), published (retained)
+        //on Alert/nodeID/Channel as "timestamp value low|high|normal"
+        if(data[0].equals("!") && (data.length == 5 || data.length == 6)){
+            try{
+                long[] clock = networkTime;
+                long timestamp = clock == null || data.length == 5 ? System.currentTimeMillis()
+                               : ReadingPublisher.wallClock(clock, Long.parseLong(data[5]));
+                String name = data[2].equals("B") ? "Battery" : "Temperature";
+                String bound = data[3].equals("L") ? "low" : data[3].equals("H") ? "high" : "normal";
+                MqttMessage msg = new MqttMessage((timestamp+" "+data[4]+" "+bound).getBytes());
+                msg.setRetained(true);
+                msg.setQos(1);
+                gateway.publish("Alert/"+data[1]+"/"+name, msg);
+                System.out.println("Alert of "+data[1]+": "+name+" "+data[4]+" "+bound);
+            } catch(NumberFormatException e){
+                //System.out.println("Wrong alert received: "+line);
+            }
+            return;
+        }
+        //The root node reports the readings dropped by a node since its last report: "L/ID/drops"
+        if(data[0].equals("L") && data.length == 3){
+            try{
+                rates.addDrops(data[1], Integer.parseInt(data[2]));
+            } catch(NumberFormatException e){
+                //System.out.println("Wrong load received: "+line);
+            }
+            return;
+        }
+        //The root node periodically sends the messages it dropped because its transmit buffer was full and the
+        //most bytes waiting in it since its boot: "U/dropped/peak", published on Serial (retained) when they change
+        if(data[0].equals("U") && data.length == 3){
+            String overflow = data[1]+" "+data[2];
+            if(!overflow.equals(serialOverflow)){
+                if(!serialOverflow.isEmpty() && !data[1].equals(serialOverflow.split(" ")[0])){
+                    System.out.println("The root node dropped messages to the gateway: "+data[1]+" since its boot");
+                }
+                serialOverflow = overflow;
+                MqttMessage msg = new MqttMessage(overflow.getBytes());
+                msg.setRetained(true);
+                gateway.publish("Serial", msg);
+            }
+            return;
+        }
+    }
+    
+    /**
+     * Resolves the topics of the subscribers into requests "nodeID/B" or "nodeID/T".
+     * Besides nodeID/Channel, the topics can be +/Channel (all the nodes reachable via the root node),
+     * nodeID/+ or nodeID/# (all the channels of a node), group/# and group/+/Channel (the nodes of a group).
+     * A topic can end with "@seconds", the reporting interval asked by the subscriber.
+     * The aggregate topics Aggregate/all/Channel (all the nodes) and Aggregate/group/Channel are resolved into
+     * one aggregate query per channel, whose epoch is the "@seconds" suffix. The alert topics are published
+     * whatever the subscribers
+     */
+    private ArrayList<String> resolve(ArrayList<String> filters) {
+        ArrayList<String> requests = new ArrayList<>();
+        HashSet<String> active = new HashSet<>();
+        HashMap<String, Integer> intervals = new HashMap<>();
+        ArrayList<String> live = liveNodes;
+        HashMap<String, TreeSet<String>> zones = new HashMap<>(); // channel -> zones of its aggregate topics (ALL_NODES or groups)
+        HashMap<String, Integer> epochs = new HashMap<>();
+        for(String filter : new ArrayList<>(filters)){
+            int interval = RateController.DEFAULT_INTERVAL;
+            int at = filter.indexOf('@');
+            if(at >= 0){
+                try{
+                    interval = Integer.parseInt(filter.substring(at+1));
+                } catch(NumberFormatException e){
+                    continue;
+                }
+                filter = filter.substring(0, at);
+            }
+            String[] tab = filter.split("/");
+            ArrayList<String> nodes = new ArrayList<>();
+            String channel;
+            if(tab[0].equals("Alert")){
+                continue;
+            }
+            if(tab[0].equals("Aggregate")){
+                if(tab.length != 3 || !(tab[1].equals(ALL_NODES) || groups.containsKey(tab[1]))){
+                    continue;
+                }
+                String zone = tab[1];
+                for(String c : new String[]{"B", "T"}){
+                    String name = c.equals("B") ? "Battery" : "Temperature";
+                    if(tab[tab.length-1].equals(name) || tab[tab.length-1].equals("+")){
+                        if(!zones.containsKey(c)){
+                            zones.put(c, new TreeSet<String>());
+                        }
+                        zones.get(c).add(zone);
+                        demand(epochs, c, interval);
+                    }
+                }
+                continue;
+            }
+            if(tab.length >= 2 && groups.containsKey(tab[0])){
+                active.add(tab[0]);
+                if(tab[1].equals("#")){
+                    nodes.addAll(groups.get(tab[0]));
+                    channel = "#";
+                }
+                else if(tab.length == 3){
+                    if(tab[1].equals("+")){
+                        nodes.addAll(groups.get(tab[0]));
+                    }
+                    else if(groups.get(tab[0]).contains(tab[1])){
+                        nodes.add(tab[1]);
+                    }
+                    channel = tab[2];
+                }
+                else{
+                    continue;
+                }
+            }
+            else if(tab.length == 2){
+                if(tab[0].equals("+")){
+                    nodes.addAll(live);
+                }
+                else{
+                    nodes.add(tab[0]);
+                }
+                channel = tab[1];
+            }
+            else{
+                continue;
+            }
+            for(String node : nodes){
+                if(channel.equals("Battery") || channel.equals("+") || channel.equals("#")){
+                    if(!requests.contains(node+"/B")){
+                        requests.add(node+"/B");
+                    }
+                    demand(intervals, node+"/B", interval);
+                }
+                if(channel.equals("Temperature") || channel.equals("+") || channel.equals("#")){
+                    if(!requests.contains(node+"/T")){
+                        requests.add(node+"/T");
+                    }
+                    demand(intervals, node+"/T", interval);
+                }
+            }
+        }
+        activeGroups = active;
+        demands = intervals;
+        // the network state has room for a single query per channel, on the union of its zones: its results
+        // are published on the topics of all the zones, with the zones they cover ("all" or "group+group")
+        HashMap<String, String> queries = new HashMap<>();
+        HashMap<String, ArrayList<String>> results = new HashMap<>();
+        HashMap<String, String> covered = new HashMap<>();
+        for(String c : zones.keySet()){
+            String name = c.equals("B") ? "Battery" : "Temperature";
+            TreeSet<String> union = new TreeSet<>();
+            if(!zones.get(c).contains(ALL_NODES)){
+                for(String zone : zones.get(c)){
+                    union.addAll(groups.get(zone));
+                }
+            }
+            ArrayList<String> topics = new ArrayList<>();
+            for(String zone : zones.get(c)){
+                topics.add("Aggregate/"+zone+"/"+name);
+            }
+            covered.put(c, union.isEmpty() ? ALL_NODES : String.join("+", zones.get(c)));
+            String targets = union.isEmpty() ? "*" : "";
+            for(String node : union){
+                targets += node+"/";
+            }
+            queries.put(c, epochs.get(c)+" "+targets);
+            results.put(c, topics);
+        }
+        aggregates = queries;
+        aggregateZones = covered;
+        aggregateTopics = results;
+        return requests;
+    }
+    
+    /**
+     * Sends to the root node the aggregate queries which changed: the previous query on the channel is
+     * stopped with "A<Channel>0/*", then the new one is sent as "A<Channel><epoch>/nodeID/nodeID/.../" by
+     * chunks of MAX_COMMAND_LENGTH characters, or "A<Channel><epoch>/*" for all the nodes
+     */
+    private void sendAggregates(RootLink link) throws IOException, InterruptedException {
+        HashMap<String, String> queries = aggregates;
+        for(String channel : new String[]{"B", "T"}){
+            String query = queries.get(channel);
+            String previous = previousAggregates.get(channel);
+            if(query == null ? previous == null : query.equals(previous)){
+                continue;
+            }
+            ArrayList<String> commands = new ArrayList<>();
+            if(previous != null){
+                commands.add("A"+channel+"0/*");
+            }
+            if(query != null){
+                String[] tab = query.split(" ");
+                String command = "A"+channel+tab[0]+"/";
+                for(String node : tab[1].split("/")){
+                    String target = node.equals("*") ? node : node+"/";
+                    if(command.length() + target.length() > MAX_COMMAND_LENGTH){
+                        commands.add(command);
+                        command = "A"+channel+tab[0]+"/";
+                    }
+                    command += target;
+                }
+                commands.add(command);
+            }
+            for(String command : commands){
+                command(link, command+"\n");
+            }
+            if(query == null){
+                previousAggregates.remove(channel);
+            }
+            else{
+                previousAggregates.put(channel, query);
+            }
+        }
+    }
+    
+    /**
+     * Sends to the root node the alert rules of ALERTS_FILE which changed, read again at each round, as
+     * "K<Channel>/<low>/<high>" with the temperature in tenths of degree and '*' for no bound. The root node
+     * disseminates the rules, and the nodes check each sample against them
+     */
+    private void sendAlerts(RootLink link) throws IOException, InterruptedException {
+        HashMap<String, String> rules = loadAlerts();
+        for(String channel : new String[]{"B", "T"}){
+            String rule = rules.containsKey(channel) ? rules.get(channel) : "*/*";
+            String previous = previousAlerts.containsKey(channel) ? previousAlerts.get(channel) : "*/*";
+            if(rule.equals(previous)){
+                continue;
+            }
+            String command = "K"+channel+"/"+rule;
+            command(link, command+"\n");
+            previousAlerts.put(channel, rule);
+        }
+    }
+    
+    /**
+     * Sends to the root node the commands to start (state '1') or stop (state '0') the given requests.
+     * A single request is sent as "nodeID/Channel/state". Several requests on the same channel are sent
+     * as multicast commands "M<Channel><state>/nodeID/nodeID/.../" of up to MAX_COMMAND_LENGTH characters, or
+     * "M<Channel><state>/*" for all the nodes reachable via the root node, which the nodes forward once per child
+     * instead of once per target
+     */
+    private void sendCommands(RootLink link, ArrayList<String> requests, char state) throws IOException, InterruptedException {
+        for(String channel : new String[]{"B", "T"}){
+            ArrayList<String> nodes = new ArrayList<>();
+            for(String request : requests){
+                String[] tab = request.split("/");
+                if(tab[1].equals(channel)){
+                    nodes.add(tab[0]);
+                }
+            }
+            ArrayList<String> live = liveNodes;
+            boolean all = nodes.size() > 1 && nodes.containsAll(live) && live.containsAll(nodes);
+            if(nodes.size() == 1){
+                command(link, nodes.get(0)+"/"+channel+"/"+state);
+            }
+            else if(all){
+                command(link, "M"+channel+state+"/*\n");
+            }
+            else if(!nodes.isEmpty()){
+                String command = "M"+channel+state+"/";
+                for(String node : nodes){
+                    if(command.length() + node.length() + 1 > MAX_COMMAND_LENGTH){
+                        command(link, command+"\n");
+                        command = "M"+channel+state+"/";
+                    }
+                    command += node+"/";
+                }
+                command(link, command+"\n");
+            }
+        }
+    }
+    
+    /**
+     * Sends a command to the root node and waits for its acknowledgement, so that the commands follow each
+     * other as fast as the root node takes them. The multicast, aggregate and alert commands only change the
+     * network state, which the nodes catch up with by dissemination whatever the number of versions.
+     * A lost acknowledgement costs COMMAND_TIMEOUT. The threads sending commands take turns
+     */
+    private synchronized void command(RootLink link, String command) throws IOException, InterruptedException {
+        acknowledgements.drainPermits();
+        link.send(command);
+        if(acknowledgements.tryAcquire(COMMAND_TIMEOUT, TimeUnit.MILLISECONDS)){
+            System.out.println(command.trim() + " has been sent to root node");
+        }
+        else{
+            System.out.println(command.trim() + " has not been acknowledged by the root node");
+        }
+    }
+    
+    // Loads the groups of nodes from GROUPS_FILE, if any
+    private void loadGroups() throws IOException {
+        File file = new File(GROUPS_FILE);
+        if(!file.exists()){
+            return;
+        }
+        Properties properties = new Properties();
+        FileInputStream in = new FileInputStream(file);
+        try{
+            properties.load(in);
+        } finally{
+            in.close();
+        }
+        for(String group : properties.stringPropertyNames()){
+            if(group.equals(ALL_NODES)){
+                System.out.println("The group name "+ALL_NODES+" is reserved for the aggregates of all the nodes");
+                continue;
+            }
+            groups.put(group, new ArrayList<>(Arrays.asList(properties.getProperty(group).trim().split("\\s*,\\s*"))));
+        }
+    }
+    
+    // Loads the alert rules "Battery=low,high" and "Temperature=low,high" of ALERTS_FILE, if any, as "low/high" per channel
+    private static HashMap<String, String> loadAlerts() throws IOException {
+        HashMap<String, String> rules = new HashMap<>();
+        File file = new File(ALERTS_FILE);
+        if(!file.exists()){
+            return rules;
+        }
+        Properties properties = new Properties();
+        FileInputStream in = new FileInputStream(file);
+        try{
+            properties.load(in);
+        } finally{
+            in.close();
+        }
+        for(String c : new String[]{"B", "T"}){
+            String name = c.equals("B") ? "Battery" : "Temperature";
+            String[] bounds = properties.getProperty(name, ",").trim().split("\\s*,\\s*", -1);
+            if(bounds.length != 2){
+                System.out.println("Wrong alert rule: "+name+"="+properties.getProperty(name));
+                continue;
+            }
+            String rule = "";
+            try{
+                for(int i = 0; i < 2; i++){
+                    // the temperatures are in tenths of degree
+                    rule += (i == 0 ? "" : "/") + (bounds[i].isEmpty() ? "*"
+                          : c.equals("T") ? String.valueOf(Math.round(Double.parseDouble(bounds[i])*10)) : String.valueOf(Integer.parseInt(bounds[i])));
+                }
+            } catch(NumberFormatException e){
+                System.out.println("Wrong alert rule: "+name+"="+properties.getProperty(name));
+                continue;
+            }
+            if(!rule.equals("*/*")){
+                rules.put(c, rule);
+            }
+        }
+        return rules;
+    }
+    
+    // Keeps the finest interval asked for a request
+    private static void demand(HashMap<String, Integer> intervals, String request, int interval) {
+        Integer previous = intervals.get(request);
+        if(previous == null || interval < previous){
+            intervals.put(request, interval);
+        }
+    }
+    
+    // Returns the topic on which the data of a request (nodeID/B or nodeID/T) is published
+    private static String dataTopic(String request) {
+        String[] tab = request.split("/");
+        return tab[0] + "/" + (tab[1].equals("B") ? "Battery" : "Temperature");
+    }
+    
     private String getMappedPortForWindows(String port) {
         if (port.startsWith("COM")) {
         port = "/dev/com" + port.substring(3);
@@ -178,11 +750,29 @@ public class Gateway {
     
     
     public static void main(String[] args) throws WrongGatewayException{
-        if(args.length != 1){
+        if(args.length < 1 || args.length > 3){
             throw new WrongGatewayException();
         }
         String port = args[0];
-        Gateway gateway = new Gateway(port);
+        // the number of workers, one per core by default, and the protocol of the root node, text by default
+        int shards = Runtime.getRuntime().availableProcessors();
+        boolean binary = false;
+        try{
+            for(int i = 1; i < args.length; i++){
+                if(args[i].equals("binary") || args[i].equals("text")){
+                    binary = args[i].equals("binary");
+                }
+                else{
+                    shards = Integer.parseInt(args[i]);
+                }
+            }
+        } catch(NumberFormatException e){
+            throw new WrongGatewayException();
+        }
+        if(shards < 1){
+            throw new WrongGatewayException();
+        }
+        Gateway gateway = new Gateway(port, shards, binary);
   }
     
 }
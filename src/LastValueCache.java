@@ -0,0 +1,67 @@
+/*
+ * Last value published by the Gateway on each topic (nodeID/Channel), with the time at which it was received.
+ * A value is fresh as long as it is younger than the freshness given at creation. The entry of a topic is
+ * updated in place, so that caching a reading allocates nothing once its topic is known.
+ */
+import java.util.ArrayList;
+import java.util.Map;
+import java.util.concurrent.ConcurrentHashMap;
+
+public class LastValueCache {
+    private final long freshness;
+    private final ConcurrentHashMap<String, Entry> entries = new ConcurrentHashMap<>();
+
+    private static class Entry {
+        volatile float value;
+        volatile long timestamp;
+    }
+
+    /**
+     * @param freshness age in ms after which a value is no longer served
+     */
+    public LastValueCache(long freshness){
+        this.freshness = freshness;
+    }
+
+    public void put(String topic, float value, long timestamp){
+        Entry e = entries.get(topic);
+        if(e == null){
+            e = new Entry();
+            Entry previous = entries.putIfAbsent(topic, e);
+            e = previous == null ? e : previous;
+        }
+        e.value = value;
+        e.timestamp = timestamp;
+    }
+
+    /**
+     * @return the last value of the topic, null if there is none or if it is not fresh anymore
+     */
+    public Float get(String topic){
+        Entry e = entries.get(topic);
+        if(e == null || System.currentTimeMillis() - e.timestamp > freshness){
+            return null;
+        }
+        return e.value;
+    }
+
+    public boolean isFresh(String topic){
+        return get(topic) != null;
+    }
+
+    /**
+     * Removes the values which are not fresh anymore
+     * @return the topics of the removed values
+     */
+    public ArrayList<String> expire(){
+        ArrayList<String> expired = new ArrayList<>();
+        long now = System.currentTimeMillis();
+        for(Map.Entry<String, Entry> e : entries.entrySet()){
+            if(now - e.getValue().timestamp > freshness){
+                entries.remove(e.getKey(), e.getValue());
+                expired.add(e.getKey());
+            }
+        }
+        return expired;
+    }
+}
@@ -4,18 +4,22 @@ We reimplemented MqttCallbackin order to print when a message has been received
 
 import java.util.ArrayList;
 import java.util.Arrays;
+import java.util.concurrent.CopyOnWriteArrayList;
+import java.util.concurrent.LinkedBlockingQueue;
 import org.eclipse.paho.client.mqttv3.MqttCallback;
 import org.eclipse.paho.client.mqttv3.MqttMessage;
 import org.eclipse.paho.client.mqttv3.IMqttDeliveryToken;
 
 public class MqttCallbackWithPrint implements MqttCallback{
 
-    private ArrayList<String> topics;
+    private CopyOnWriteArrayList<String> topics; // filled by the thread of the MQTT client, read by the Gateway
+    private LinkedBlockingQueue<String[]> queries;
     private String name;
     
     public MqttCallbackWithPrint(String name){
         this.name = name; // name = "Publisher" for the Gateway or another String for Subscribers
-        this.topics = new ArrayList<>();
+        this.topics = new CopyOnWriteArrayList<>();
+        this.queries = new LinkedBlockingQueue<>();
     }
     
     public void connectionLost(Throwable throwable) {
@@ -25,19 +29,16 @@ public class MqttCallbackWithPrint implements MqttCallback{
     
     // Modified in order to print when a message has arrived and to track the topics still used
     public void messageArrived(String topic, MqttMessage mqttMessage) throws Exception {
-        String []tab = mqttMessage.toString().split("/");
         String request;
+        //The publisher hands the queries on the time series store to the Gateway
+        if(getName().equals("Publisher") && topic.startsWith("Query/")){
+            queries.put(new String[]{topic, mqttMessage.toString()});
+        }
         //The publisher fills in the topics to always have them
-        if(getName().equals("Publisher")){
-            if(tab[1].equals("Battery")){
-            request = tab[0]+"/B";
-            }
-            else{
-                request = tab[0]+"/T";
-            }
-            if(!topics.contains(request)){ 
-                topics.add(request);
-            }
+        else if(getName().equals("Publisher")){
+            //The topics may contain wildcards, they are resolved by the Gateway
+            request = mqttMessage.toString();
+            topics.addIfAbsent(request);
         }
         
       else if(!getName().equals("Publisher")){
@@ -52,8 +53,14 @@ public class MqttCallbackWithPrint implements MqttCallback{
         topics.clear();
     }
     
+    // Queries received on Query/nodeID/Channel as {topic, payload}
+    public LinkedBlockingQueue<String[]> getQueries(){
+        return queries;
+    }
+    
+    // A copy of the topics, which keep changing while the Gateway resolves them
     public ArrayList<String> getTopics(){
-        return (ArrayList<String>) topics;
+        return new ArrayList<>(topics);
     }
     
     public String getName(){
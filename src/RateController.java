@@ -0,0 +1,84 @@
+/*
+ * Reporting intervals of the nodes, set by the Gateway per request ("nodeID/B" or "nodeID/T").
+ * At each round, the subscribers give the target interval of each request: the finest resolution
+ * they asked for, DEFAULT_INTERVAL otherwise. The requests of the subtree of a congested node, which
+ * dropped readings or whose link to its parent needs more than ETX_CONGESTED transmissions, double
+ * their interval; the other requests come back to their target by STEP seconds per round, so that
+ * the network runs close to its capacity without collapsing.
+ */
+import java.util.ArrayList;
+import java.util.HashMap;
+import java.util.HashSet;
+import java.util.Map;
+
+public class RateController {
+    public static final int DEFAULT_INTERVAL = 30; // DATA_TIME of the sensor nodes
+    public static final int MIN_INTERVAL = 10; // bounds of the intervals of the sensor nodes
+    public static final int MAX_INTERVAL = 480;
+    public static final int ETX_CONGESTED = 20; // two transmissions per reading on average
+    public static final int STEP = 10;
+    public static final int MAX_COMMANDS = 8; // per round, the backoffs first
+    public static final long ROUND = 90000; // ROUTE_TIME of the sensor nodes: one report of drops per round
+
+    private final Topology topology;
+    private final HashMap<String, Integer> drops = new HashMap<>(); // since the last round
+    private final HashMap<String, Integer> intervals = new HashMap<>(); // last interval sent to each request
+
+    public RateController(Topology topology){
+        this.topology = topology;
+    }
+
+    // Readings dropped by a node, reported by the root node
+    public synchronized void addDrops(String node, int n){
+        Integer d = drops.get(node);
+        drops.put(node, d == null ? n : d+n);
+    }
+
+    /**
+     * Computes the next interval of each request
+     * @param demands the target interval of each request
+     * @return the commands "I<nodeID>/<channel>/<seconds>" of the intervals which changed
+     */
+    public synchronized ArrayList<String> round(Map<String, Integer> demands){
+        HashSet<String> congested = new HashSet<>(drops.keySet());
+        drops.clear();
+        ArrayList<String> backoffs = new ArrayList<>();
+        ArrayList<String> others = new ArrayList<>();
+        for(Map.Entry<String, Integer> demand : demands.entrySet()){
+            String request = demand.getKey();
+            String node = request.split("/")[0];
+            int target = Math.max(MIN_INTERVAL, Math.min(MAX_INTERVAL, demand.getValue()));
+            Integer last = intervals.get(request);
+            int current = last == null ? DEFAULT_INTERVAL : last;
+            boolean backoff = false;
+            for(String hop : topology.path(node)){
+                if(congested.contains(hop) || topology.etx(hop) > ETX_CONGESTED){
+                    backoff = true;
+                    break;
+                }
+            }
+            int next;
+            if(backoff){
+                next = Math.min(MAX_INTERVAL, current*2);
+            }
+            else if(current > target){
+                next = Math.max(target, current - STEP);
+            }
+            else{
+                next = target;
+            }
+            if(next != current){
+                (backoff ? backoffs : others).add(request+"/"+next);
+            }
+        }
+        backoffs.addAll(others);
+        ArrayList<String> commands = new ArrayList<>();
+        for(int i = 0; i < backoffs.size() && i < MAX_COMMANDS; i++){
+            String[] tab = backoffs.get(i).split("/");
+            // the requests left over are computed again at the next round
+            intervals.put(tab[0]+"/"+tab[1], Integer.parseInt(tab[2]));
+            commands.add("I"+backoffs.get(i));
+        }
+        return commands;
+    }
+}
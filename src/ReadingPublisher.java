@@ -0,0 +1,222 @@
+/*
+ * Hot path of the Gateway: decodes a reading "ID/Channel/value/seq[/time]" from the bytes of its line, drops the
+ * duplicates, then publishes, caches and stores it. There is one instance per worker, with its own sequence
+ * tracker since a node always goes to the same worker, so only the store and the cache are shared. Once the topics of a node are known, the publisher itself does
+ * not allocate for a reading: the fields are parsed in place, the topics of each (node, channel) are built once in
+ * a table, and the payload buffers and the message are reused, since a publish returns once the message is
+ * delivered. The MQTT client still allocates at each publish (its wire message, token and packet), which
+ * AllocationBenchmark leaves out.
+ */
+import java.util.ArrayList;
+import java.util.HashMap;
+import java.util.HashSet;
+import java.util.Map;
+import org.eclipse.paho.client.mqttv3.MqttMessage;
+
+public class ReadingPublisher {
+    public static final int MAX_VALUE_LENGTH = 16;
+
+    // Where the messages go, the MQTT client of the Gateway
+    public interface Sink {
+        void publish(String topic, MqttMessage message) throws Exception;
+    }
+
+    // State of the Gateway read for each reading
+    public interface Context {
+        // {network time (s, modulo 2^16), wall clock (ms)} of the last clock line, null if none yet
+        long[] networkTime();
+        // groups with at least one subscriber
+        HashSet<String> activeGroups();
+    }
+
+    // Topics of a (node, channel)
+    private static class Series {
+        String topic; // nodeID/Battery
+        String[] groups; // groups of the node
+        String[] groupTopics; // group/nodeID/Battery
+    }
+
+    private final Sink sink;
+    private final Context context;
+    private final HashMap<String, ArrayList<String>> groups;
+    private final TimeSeriesStore store;
+    private final LastValueCache cache;
+    private final SequenceTracker sequences;
+    private final Series[] series = new Series[256*256*2]; // by (node, channel)
+    private final byte[][] payloads = new byte[MAX_VALUE_LENGTH+1][]; // by length
+    private final MqttMessage message = new MqttMessage();
+
+    public ReadingPublisher(Sink sink, Context context, HashMap<String, ArrayList<String>> groups, TimeSeriesStore store,
+                            LastValueCache cache, SequenceTracker sequences){
+        this.sink = sink;
+        this.context = context;
+        this.groups = groups;
+        this.store = store;
+        this.cache = cache;
+        this.sequences = sequences;
+        for(int i = 0; i <= MAX_VALUE_LENGTH; i++){
+            payloads[i] = new byte[i];
+        }
+        // retained so that a new subscriber immediately gets the last value from the broker
+        message.setRetained(true);
+    }
+
+    /**
+     * Handles a line of the root node if it is a reading. A reading whose channel or value is wrong is dropped
+     * @param line buffer holding the line
+     * @param length length of the line
+     * @return false if the line is not a reading (no node ID "i.j" before the first '/')
+     */
+    public boolean publish(byte[] line, int length) throws Exception {
+        // node ID
+        int pos = 0;
+        int a = 0, b = 0;
+        int start = pos;
+        while(pos < length && line[pos] >= '0' && line[pos] <= '9' && a < 256){
+            a = 10*a + line[pos++] - '0';
+        }
+        if(pos == start || pos == length || line[pos++] != '.'){
+            return false;
+        }
+        start = pos;
+        while(pos < length && line[pos] >= '0' && line[pos] <= '9' && b < 256){
+            b = 10*b + line[pos++] - '0';
+        }
+        if(pos == start || pos == length || line[pos++] != '/' || a > 255 || b > 255){
+            return false;
+        }
+        // channel
+        if(pos+1 >= length || (line[pos] != 'B' && line[pos] != 'T') || line[pos+1] != '/'){
+            return true;
+        }
+        int channel = line[pos] == 'B' ? 0 : 1;
+        pos += 2;
+        // value
+        int valueStart = pos;
+        while(pos < length && line[pos] != '/'){
+            pos++;
+        }
+        int valueLength = pos - valueStart;
+        if(valueLength == 0 || valueLength > MAX_VALUE_LENGTH){
+            return true;
+        }
+        Series s = series(a, b, channel);
+        //A reading carries its sequence number, and the network time at which it was taken once the nodes
+        //are synchronized: "ID/Channel/value/seq[/time]". The duplicates are dropped
+        long timestamp = System.currentTimeMillis();
+        if(pos < length){
+            pos++;
+            int seq = 0;
+            start = pos;
+            while(pos < length && line[pos] >= '0' && line[pos] <= '9' && seq < 65536){
+                seq = 10*seq + line[pos++] - '0';
+            }
+            if(pos > start && (pos == length || line[pos] == '/')){
+                if(!sequences.accept(s.topic, seq)){
+                    return true;
+                }
+                long seconds = 0;
+                start = ++pos;
+                while(pos < length && line[pos] >= '0' && line[pos] <= '9' && seconds < 65536){
+                    seconds = 10*seconds + line[pos++] - '0';
+                }
+                long[] clock = context.networkTime();
+                if(pos > start && pos == length && clock != null){
+                    timestamp = wallClock(clock, seconds);
+                }
+            }
+        }
+        float value = parseFloat(line, valueStart, valueStart + valueLength);
+        //A reading older than the last one of its series is only stored, the subscribers already have a newer value
+        if(timestamp < store.latestTimestamp(s.topic)){
+            if(!Float.isNaN(value)){
+                store.append(s.topic, timestamp, value);
+            }
+            return true;
+        }
+        byte[] payload = payloads[valueLength];
+        System.arraycopy(line, valueStart, payload, 0, valueLength);
+        message.setPayload(payload);
+        sink.publish(s.topic, message);
+        //Readings of the nodes of a group are also published on group/nodeID/Channel
+        HashSet<String> active = context.activeGroups();
+        for(int i = 0; i < s.groups.length; i++){
+            if(active.contains(s.groups[i])){
+                sink.publish(s.groupTopics[i], message);
+            }
+        }
+        if(!Float.isNaN(value)){
+            cache.put(s.topic, value, timestamp);
+            store.append(s.topic, timestamp, value);
+        }
+        return true;
+    }
+
+    // Returns the topics of a (node, channel), built at its first reading
+    private Series series(int a, int b, int channel){
+        int index = ((a << 8) | b) * 2 + channel;
+        Series s = series[index];
+        if(s == null){
+            s = new Series();
+            String node = a+"."+b;
+            s.topic = node+"/"+(channel == 0 ? "Battery" : "Temperature");
+            ArrayList<String> names = new ArrayList<>();
+            for(Map.Entry<String, ArrayList<String>> group : groups.entrySet()){
+                if(group.getValue().contains(node)){
+                    names.add(group.getKey());
+                }
+            }
+            s.groups = names.toArray(new String[names.size()]);
+            s.groupTopics = new String[s.groups.length];
+            for(int i = 0; i < s.groups.length; i++){
+                s.groupTopics[i] = s.groups[i]+"/"+s.topic;
+            }
+            series[index] = s;
+        }
+        return s;
+    }
+
+    /**
+     * Converts a network time to the clock of the gateway
+     * @param clock {network time, wall clock} of the last clock line of the root node
+     * @param seconds a network time in seconds modulo 2^16, within 9 hours of the clock line
+     * @return the wall clock time in ms
+     */
+    public static long wallClock(long[] clock, long seconds) {
+        // distance in [-2^15, 2^15) seconds
+        long d = ((seconds - clock[0]) % 65536 + 65536 + 32768) % 65536 - 32768;
+        return clock[1] + d*1000;
+    }
+
+    // Parses "[-]digits[.digits]" in place, NaN if the text is not a number
+    private static float parseFloat(byte[] text, int from, int to){
+        boolean negative = from < to && text[from] == '-';
+        int pos = negative ? from+1 : from;
+        long mantissa = 0;
+        int decimals = -1;
+        int digits = 0;
+        for(; pos < to; pos++){
+            if(text[pos] == '.' && decimals < 0){
+                decimals = 0;
+            }
+            else if(text[pos] >= '0' && text[pos] <= '9' && digits < 18){
+                mantissa = 10*mantissa + text[pos] - '0';
+                digits++;
+                if(decimals >= 0){
+                    decimals++;
+                }
+            }
+            else{
+                return Float.NaN;
+            }
+        }
+        if(digits == 0){
+            return Float.NaN;
+        }
+        double v = mantissa;
+        for(int i = 0; i < decimals; i++){
+            v /= 10;
+        }
+        return (float) (negative ? -v : v);
+    }
+}
@@ -0,0 +1,407 @@
+/*
+ * Serial link between the Gateway and the root node. In text mode, the root node sends one line per message and
+ * receives the commands as text. In binary mode (BINARY_SERIAL of the root node), both ways carry frames: records
+ * <type, length, payload> followed by the CRC-16 of the records (big endian), COBS-encoded and delimited by a 0
+ * byte, so that a frame corrupted or cut on the line is detected and dropped while the next one is still found.
+ * The root node packs the readings and its own messages in binary records (root_node_v3.c), and the Gateway sends
+ * each command as a COMMAND record carrying its text. The records read are turned back into the lines of the text
+ * protocol in a reused buffer, so that the workers handle both modes the same way, without allocating.
+ */
+import java.io.IOException;
+import java.io.InputStream;
+import java.io.OutputStream;
+import java.nio.charset.StandardCharsets;
+
+public class RootLink {
+    // record types, must match root_node_v3.c
+    public static final int REC_READING = 1;
+    public static final int REC_LOAD = 2;
+    public static final int REC_CLOCK = 3;
+    public static final int REC_AGGREGATE = 4;
+    public static final int REC_EDGE = 5;
+    public static final int REC_LOST = 6;
+    public static final int REC_NODES = 7;
+    public static final int REC_TEXT = 8;
+    public static final int REC_UART = 9;
+    public static final int REC_ALERT = 10;
+    public static final int REC_READINGS = 11; // stamped readings of READING_LENGTH bytes each
+    public static final int REC_VERSION = 12; // version of the network state, acknowledges a command
+    public static final int REC_MORE_NODES = 13; // the list of REC_NODES goes on
+    public static final int REC_COMMAND = 16;
+    public static final int FRAME_LENGTH = 256; // longer frames are dropped (FRAME_LEN of the root node is 200)
+    public static final int READING_LENGTH = 6; // <index channel|value seq time>, must match READING_LEN of the root node
+    public static final int MAX_INDEX = 10; // node index = i * MAX_INDEX + j, must match the root node up to 16
+
+    private final OutputStream out;
+    private final boolean binary;
+    private volatile long frames, corrupted;
+
+    /**
+     * @param out input of the root node, null if nothing is sent
+     * @param binary true for the binary protocol, false for the text one
+     */
+    public RootLink(OutputStream out, boolean binary){
+        this.out = out;
+        this.binary = binary;
+    }
+
+    /**
+     * Sends a command to the root node
+     * @param command the command of the text protocol, with its end of line if it has one
+     */
+    public synchronized void send(String command) throws IOException {
+        if(!binary){
+            out.write(command.getBytes(StandardCharsets.US_ASCII));
+            out.flush();
+            return;
+        }
+        byte[] text = command.trim().getBytes(StandardCharsets.US_ASCII);
+        if(text.length > 255){
+            throw new IOException("Command too long: "+command);
+        }
+        byte[] frame = new byte[text.length + 4];
+        frame[0] = (byte) REC_COMMAND;
+        frame[1] = (byte) text.length;
+        System.arraycopy(text, 0, frame, 2, text.length);
+        int crc = crc16(frame, text.length + 2);
+        frame[text.length + 2] = (byte) (crc >> 8);
+        frame[text.length + 3] = (byte) crc;
+        out.write(cobsEncode(frame, frame.length));
+        out.write(0);
+        out.flush();
+    }
+
+    /**
+     * Reads the messages of the root node until the end of the stream and submits them to the workers as lines
+     * @param in the output of the root node
+     * @param pool the workers
+     */
+    public void read(InputStream in, WorkerPool pool) throws IOException {
+        byte[] chunk = new byte[4096];
+        byte[] buffer = new byte[binary ? FRAME_LENGTH : WorkerPool.LINE_LENGTH];
+        byte[] line = new byte[WorkerPool.LINE_LENGTH];
+        int length = 0;
+        boolean overflow = false;
+        int n;
+        while((n = in.read(chunk)) > 0){
+            for(int i = 0; i < n; i++){
+                byte b = chunk[i];
+                if(b == (binary ? 0 : '\n')){
+                    if(length > 0 && !overflow){
+                        if(binary){
+                            frame(buffer, length, line, pool);
+                        }
+                        else{
+                            pool.submit(buffer, length);
+                        }
+                    }
+                    else if(overflow){
+                        corrupted++;
+                    }
+                    length = 0;
+                    overflow = false;
+                }
+                else if(binary || b != '\r'){
+                    if(length < buffer.length){
+                        buffer[length++] = b;
+                    }
+                    else{
+                        overflow = true;
+                    }
+                }
+            }
+        }
+    }
+
+    /**
+     * @return "frames corrupted" the count of frames read and of frames dropped since the start
+     */
+    public String stats(){
+        return frames + " " + corrupted;
+    }
+
+    // Checks a frame and submits each of its records as a line
+    private void frame(byte[] frame, int length, byte[] line, WorkerPool pool){
+        length = cobsDecode(frame, length);
+        if(length < 2 || crc16(frame, length - 2) != (((frame[length-2] & 0xFF) << 8) | (frame[length-1] & 0xFF))){
+            corrupted++;
+            return;
+        }
+        length -= 2;
+        // the records must cover the frame exactly
+        int i = 0;
+        while(i + 2 <= length && i + 2 + (frame[i+1] & 0xFF) <= length){
+            i += 2 + (frame[i+1] & 0xFF);
+        }
+        if(i != length){
+            corrupted++;
+            return;
+        }
+        frames++;
+        for(i = 0; i < length; i += 2 + (frame[i+1] & 0xFF)){
+            if((frame[i] & 0xFF) == REC_READINGS){
+                // one line per reading
+                for(int k = i + 2; k + READING_LENGTH <= i + 2 + (frame[i+1] & 0xFF); k += READING_LENGTH){
+                    pool.submit(line, reading(frame, k, line));
+                }
+                continue;
+            }
+            int n = line(frame[i] & 0xFF, frame, i + 2, frame[i+1] & 0xFF, line);
+            if(n > 0){
+                pool.submit(line, n);
+            }
+        }
+    }
+
+    /**
+     * Writes a reading of a REC_READINGS record as the line "i.j/Channel/value/seq/time"
+     * @return the length of the line
+     */
+    private static int reading(byte[] r, int p, byte[] line){
+        int n = number(line, 0, (r[p] & 0xFF) / MAX_INDEX);
+        line[n++] = '.';
+        n = number(line, n, (r[p] & 0xFF) % MAX_INDEX);
+        line[n++] = '/';
+        // the top bit tells the channel, the 15 others hold the signed value
+        boolean temperature = (r[p+1] & 0x80) != 0;
+        line[n++] = (byte) (temperature ? 'T' : 'B');
+        line[n++] = '/';
+        n = value(line, n, (u16(r, p+1) << 17) >> 17, temperature);
+        line[n++] = '/';
+        n = number(line, n, r[p+3] & 0xFF);
+        line[n++] = '/';
+        return number(line, n, u16(r, p+4));
+    }
+
+    /**
+     * Writes a record as the line of the text protocol
+     * @return the length of the line, 0 if the record is unknown or too short
+     */
+    private static int line(int type, byte[] r, int p, int length, byte[] line){
+        int n = 0;
+        switch(type){
+        case REC_READING: // i.j/Channel/value/seq[/time]
+            if(length < 6){
+                return 0;
+            }
+            n = node(line, n, r, p);
+            line[n++] = '/';
+            line[n++] = r[p+2];
+            line[n++] = '/';
+            n = value(line, n, s16(r, p+3), r[p+2] == 'T');
+            line[n++] = '/';
+            n = number(line, n, r[p+5] & 0xFF);
+            if(length >= 8){
+                line[n++] = '/';
+                n = number(line, n, u16(r, p+6));
+            }
+            return n;
+        case REC_LOAD: // L/i.j/drops
+            if(length < 4){
+                return 0;
+            }
+            line[n++] = 'L';
+            line[n++] = '/';
+            n = node(line, n, r, p);
+            line[n++] = '/';
+            return number(line, n, u16(r, p+2));
+        case REC_CLOCK: // C/seconds
+            if(length < 2){
+                return 0;
+            }
+            line[n++] = 'C';
+            line[n++] = '/';
+            return number(line, n, u16(r, p));
+        case REC_AGGREGATE: // A/Channel/end/count/sum/min/max
+            if(length < 13){
+                return 0;
+            }
+            line[n++] = 'A';
+            line[n++] = '/';
+            line[n++] = r[p];
+            line[n++] = '/';
+            n = number(line, n, u16(r, p+1));
+            line[n++] = '/';
+            n = number(line, n, u16(r, p+3));
+            line[n++] = '/';
+            n = number(line, n, ((r[p+5] & 0xFF) << 24) | ((r[p+6] & 0xFF) << 16) | (u16(r, p+7)));
+            line[n++] = '/';
+            n = number(line, n, s16(r, p+9));
+            line[n++] = '/';
+            return number(line, n, s16(r, p+11));
+        case REC_EDGE: // E/i.j/parent/rank/etx
+            if(length < 6){
+                return 0;
+            }
+            line[n++] = 'E';
+            line[n++] = '/';
+            n = node(line, n, r, p);
+            line[n++] = '/';
+            n = node(line, n, r, p+2);
+            line[n++] = '/';
+            n = number(line, n, r[p+4] & 0xFF);
+            line[n++] = '/';
+            return number(line, n, r[p+5] & 0xFF);
+        case REC_LOST: // X/i.j
+            if(length < 2){
+                return 0;
+            }
+            line[n++] = 'X';
+            line[n++] = '/';
+            return node(line, n, r, p);
+        case REC_NODES: // N/i.j/i.j/.../
+        case REC_MORE_NODES: // N+/i.j/.../
+            line[n++] = 'N';
+            if(type == REC_MORE_NODES){
+                line[n++] = '+';
+            }
+            line[n++] = '/';
+            for(int k = 0; k + 1 < length; k += 2){
+                n = node(line, n, r, p+k);
+                line[n++] = '/';
+            }
+            return n;
+        case REC_UART: // U/dropped/peak
+            if(length < 4){
+                return 0;
+            }
+            line[n++] = 'U';
+            line[n++] = '/';
+            n = number(line, n, u16(r, p));
+            line[n++] = '/';
+            return number(line, n, u16(r, p+2));
+        case REC_ALERT: // !/i.j/Channel/bound/value[/time]
+            if(length < 6){
+                return 0;
+            }
+            line[n++] = '!';
+            line[n++] = '/';
+            n = node(line, n, r, p);
+            line[n++] = '/';
+            line[n++] = r[p+2];
+            line[n++] = '/';
+            line[n++] = r[p+3];
+            line[n++] = '/';
+            n = value(line, n, s16(r, p+4), r[p+2] == 'T');
+            if(length >= 8){
+                line[n++] = '/';
+                n = number(line, n, u16(r, p+6));
+            }
+            return n;
+        case REC_VERSION: // V/version
+            if(length < 1){
+                return 0;
+            }
+            line[n++] = 'V';
+            line[n++] = '/';
+            return number(line, n, r[p] & 0xFF);
+        case REC_TEXT:
+            System.arraycopy(r, p, line, 0, length);
+            return length;
+        default:
+            return 0;
+        }
+    }
+
+    // Writes the node ID "i.j" of r[p], r[p+1]
+    private static int node(byte[] line, int n, byte[] r, int p){
+        n = number(line, n, r[p] & 0xFF);
+        line[n++] = '.';
+        return number(line, n, r[p+1] & 0xFF);
+    }
+
+    // Writes a value, the temperature being in tenths of degree
+    private static int value(byte[] line, int n, int value, boolean tenths){
+        if(!tenths){
+            return number(line, n, value);
+        }
+        if(value < 0){
+            line[n++] = '-';
+            value = -value;
+        }
+        n = number(line, n, value / 10);
+        line[n++] = '.';
+        line[n++] = (byte) ('0' + value % 10);
+        return n;
+    }
+
+    // Writes a number in decimal
+    private static int number(byte[] line, int n, long value){
+        if(value < 0){
+            line[n++] = '-';
+            value = -value;
+        }
+        int start = n;
+        do{
+            line[n++] = (byte) ('0' + value % 10);
+            value /= 10;
+        } while(value > 0);
+        for(int i = start, j = n-1; i < j; i++, j--){
+            byte b = line[i];
+            line[i] = line[j];
+            line[j] = b;
+        }
+        return n;
+    }
+
+    private static int u16(byte[] r, int p){
+        return ((r[p] & 0xFF) << 8) | (r[p+1] & 0xFF);
+    }
+
+    private static int s16(byte[] r, int p){
+        return (short) u16(r, p);
+    }
+
+    // CRC-16 of Contiki (lib/crc16.c), from 0
+    public static int crc16(byte[] data, int length){
+        int acc = 0;
+        for(int i = 0; i < length; i++){
+            acc ^= data[i] & 0xFF;
+            acc = ((acc >> 8) | (acc << 8)) & 0xFFFF;
+            acc ^= (acc & 0xFF00) << 4;
+            acc &= 0xFFFF;
+            acc ^= (acc >> 8) >> 4;
+            acc ^= (acc & 0xFF00) >> 5;
+        }
+        return acc;
+    }
+
+    // COBS encoding, without the delimiter
+    private static byte[] cobsEncode(byte[] in, int length){
+        byte[] out = new byte[length + length / 254 + 2];
+        int code = 1, codePos = 0, n = 1;
+        for(int i = 0; i < length; i++){
+            if(in[i] != 0){
+                out[n++] = in[i];
+                code++;
+            }
+            if(in[i] == 0 || code == 0xFF){
+                out[codePos] = (byte) code;
+                codePos = n++;
+                code = 1;
+            }
+        }
+        out[codePos] = (byte) code;
+        byte[] frame = new byte[n];
+        System.arraycopy(out, 0, frame, 0, n);
+        return frame;
+    }
+
+    // COBS decoding in place, returns the decoded length or -1 if the frame is wrong
+    private static int cobsDecode(byte[] buf, int length){
+        int in = 0, out = 0;
+        while(in < length){
+            int code = buf[in++] & 0xFF;
+            if(code == 0 || in + code - 1 > length){
+                return -1;
+            }
+            for(int i = 1; i < code; i++){
+                buf[out++] = buf[in++];
+            }
+            if(code < 0xFF && in < length){
+                buf[out++] = 0;
+            }
+        }
+        return out;
+    }
+}
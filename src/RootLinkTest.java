@@ -0,0 +1,81 @@
+/*
+ * Round trip of the binary protocol of the serial line: the frames written by the root node of the simulator
+ * (make BINARY_SERIAL=1) are read by a RootLink into a WorkerPool, and the readings, alerts and aggregate results
+ * it submits must be the lines that the text root node wrote in the same run (same nodes, duration, seed and
+ * commands, encoded as frames for the binary root). The topology lines are paced by the serial line, so they are
+ * not compared. Run with java RootLinkTest [frames lines], testdata/root_binary.out and testdata/root_text.out
+ * by default; the exit status is 1 if the lines differ.
+ */
+import java.io.FileInputStream;
+import java.io.InputStream;
+import java.nio.charset.StandardCharsets;
+import java.nio.file.Files;
+import java.nio.file.Paths;
+import java.util.ArrayList;
+import java.util.Collections;
+import java.util.List;
+
+public class RootLinkTest {
+    private static final String END = "end of the frames";
+
+    public static void main(String[] args) throws Exception {
+        String frames = args.length == 2 ? args[0] : "testdata/root_binary.out";
+        String text = args.length == 2 ? args[1] : "testdata/root_text.out";
+
+        // a single worker, which gets the lines in the order of the frames
+        final ArrayList<String> decoded = new ArrayList<>();
+        WorkerPool pool = new WorkerPool(new WorkerPool.Handler[]{new WorkerPool.Handler() {
+            public void handle(byte[] line, int length) {
+                synchronized(decoded){
+                    decoded.add(new String(line, 0, length, StandardCharsets.US_ASCII));
+                    decoded.notifyAll();
+                }
+            }
+        }});
+        RootLink link = new RootLink(null, true);
+        InputStream in = new FileInputStream(frames);
+        try{
+            link.read(in, pool);
+        } finally{
+            in.close();
+        }
+        byte[] end = END.getBytes(StandardCharsets.US_ASCII);
+        pool.submit(end, end.length);
+        synchronized(decoded){
+            while(decoded.isEmpty() || !decoded.get(decoded.size()-1).equals(END)){
+                decoded.wait();
+            }
+            decoded.remove(decoded.size()-1);
+        }
+
+        List<String> got = compared(decoded);
+        List<String> expected = compared(Files.readAllLines(Paths.get(text), StandardCharsets.US_ASCII));
+        String[] stats = link.stats().split(" ");
+        System.out.println(stats[0] + " frames, " + stats[1] + " corrupted, " + decoded.size() + " lines, "
+                           + got.size() + " compared, " + expected.size() + " expected");
+        int differences = 0;
+        for(String line : got){
+            if(!expected.remove(line)){
+                System.out.println("unexpected: " + line);
+                differences++;
+            }
+        }
+        for(String line : expected){
+            System.out.println("missing: " + line);
+            differences++;
+        }
+        System.exit(differences == 0 && got.size() > 0 && stats[1].equals("0") ? 0 : 1);
+    }
+
+    // Returns the readings "i.j/...", the alerts "!/..." and the aggregate results "A/..." of the lines, sorted
+    private static List<String> compared(List<String> lines){
+        ArrayList<String> kept = new ArrayList<>();
+        for(String line : lines){
+            if(line.matches("[0-9]+\\.[0-9]+/.*") || line.startsWith("!/") || line.startsWith("A/")){
+                kept.add(line);
+            }
+        }
+        Collections.sort(kept);
+        return kept;
+    }
+}
@@ -0,0 +1,112 @@
+/*
+ * End-to-end delivery of the readings, per series ("nodeID/Channel"). Each node numbers the readings
+ * of each channel from 1 to 255, then 1 again; a sliding window of the last WINDOW numbers tells a new
+ * reading from a duplicate (sent again by a relay after a parent switch) and from a late one. A number
+ * missing from the window counts as lost until it arrives; a late reading counts as reordered, by how
+ * far behind the highest number it was. The first reading after a boot has the number 0, which starts
+ * the window again. If that reading is lost, a number far behind the window also means a reboot.
+ * The Gateway has one tracker per worker: the readings of a node all go to the same worker, so the lock of a
+ * tracker is only shared with the thread collecting the stats.
+ */
+import java.util.Map;
+import java.util.TreeMap;
+
+public class SequenceTracker {
+    public static final int MODULO = 255; // the sequence numbers of the nodes are 8 bits, 0 marks a boot
+    public static final int WINDOW = 64;
+
+    private final TreeMap<String, Series> series = new TreeMap<>();
+
+    private static class Series {
+        int highest;
+        long seen; // bit k: highest-k was received
+        boolean booted; // the boot reading 0 is still in the window
+        long received, lost, duplicates, reordered;
+        int maxDepth;
+    }
+
+    /**
+     * Records a reading
+     * @param key "nodeID/Channel"
+     * @param seq the sequence number of the reading
+     * @return false if the reading is a duplicate, which must not be published
+     */
+    public synchronized boolean accept(String key, int seq){
+        Series s = series.get(key);
+        if(s == null){
+            s = new Series();
+            s.highest = seq;
+            s.seen = 1;
+            s.booted = seq == 0;
+            s.received = 1;
+            series.put(key, s);
+            return true;
+        }
+        // distance from the highest number, in [-MODULO/2, MODULO/2]: 0 comes before 1 like 255 does
+        int d = ((seq - s.highest) % MODULO + MODULO + MODULO/2) % MODULO - MODULO/2;
+        if(seq == 0 && !(s.booted && d > -WINDOW && d <= 0)){
+            // the node rebooted, unless this is the boot reading sent again by a relay
+            s.highest = 0;
+            s.seen = 1;
+            s.booted = true;
+        }
+        else if(d > 0){
+            s.seen = d >= WINDOW ? 0 : s.seen << d;
+            s.seen |= 1;
+            s.lost += d-1;
+            s.highest = seq;
+            s.booted &= seq < WINDOW;
+        }
+        else if(d > -WINDOW){
+            if((s.seen & (1L << -d)) != 0){
+                s.duplicates++;
+                return false;
+            }
+            s.seen |= 1L << -d;
+            s.lost--;
+            s.reordered++;
+            s.maxDepth = Math.max(s.maxDepth, -d);
+        }
+        else{
+            // the node rebooted: its numbers start again
+            s.highest = seq;
+            s.seen = 1;
+            s.booted = false;
+        }
+        s.received++;
+        return true;
+    }
+
+    /**
+     * @return one "nodeID/Channel received lost duplicates reordered maxDepth ratio" line per series,
+     *         the ratio being the delivered part of the readings sent (received / (received + lost))
+     */
+    public String stats(){
+        return stats(new SequenceTracker[]{this});
+    }
+
+    /**
+     * @param trackers trackers of different series, one per worker
+     * @return the lines of stats() of all their series, in the order of the keys
+     */
+    public static String stats(SequenceTracker[] trackers){
+        TreeMap<String, String> lines = new TreeMap<>();
+        for(SequenceTracker tracker : trackers){
+            tracker.collect(lines);
+        }
+        StringBuilder b = new StringBuilder();
+        for(String line : lines.values()){
+            b.append(line);
+        }
+        return b.toString();
+    }
+
+    // Adds the line of each series, by key
+    private synchronized void collect(TreeMap<String, String> lines){
+        for(Map.Entry<String, Series> entry : series.entrySet()){
+            Series s = entry.getValue();
+            lines.put(entry.getKey(), entry.getKey()+" "+s.received+" "+s.lost+" "+s.duplicates+" "+s.reordered+" "
+                      +s.maxDepth+" "+String.format("%.3f", (double) s.received / (s.received + s.lost))+"\n");
+        }
+    }
+}
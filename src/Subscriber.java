@@ -12,10 +12,8 @@ public class Subscriber {
         if(args.length < 2){
             throw new WrongSubscriberException(1);
         }
-        String[] test;
         for(int i = 1; i<args.length;i++){
-            test = args[i].split("/");
-            if(!test[1].equals("Battery") && !test[1].equals("Temperature")){
+            if(!isValidTopic(args[i])){
                 throw new WrongSubscriberException(2);
             }
             for(int j = 1; j<args.length; j++){
@@ -34,7 +32,7 @@ public class Subscriber {
         subscriber.connect();
 
         for(int i = 1; i<args.length;i++){
-            subscriber.subscribe(args[i]);
+            subscriber.subscribe(topic(args[i]));
         }
         try {
             while (true) {
@@ -53,5 +51,34 @@ public class Subscriber {
             System.exit(1);
         }
     }
+    
+    /**
+     * Valid topics are nodeID/Channel, +/Channel (all the nodes), nodeID/+ or nodeID/# (all the channels of a node),
+     * group/# and group/nodeID/Channel where nodeID and Channel can be + (the nodes of a group defined in the Gateway).
+     * Aggregate/all/Channel and Aggregate/group/Channel are the results of the aggregate queries on all the nodes or on a group.
+     * Alert/nodeID/Channel are the alerts of a node, published by the Gateway on the rules of its alerts file.
+     * A topic can end with "@seconds" to ask the Gateway for a reporting interval (the epoch of an aggregate query)
+     */
+    private static boolean isValidTopic(String arg) {
+        String topic = topic(arg);
+        if(!topic.equals(arg) && !arg.substring(topic.length()+1).matches("[0-9]+")){
+            return false;
+        }
+        String[] test = topic.split("/");
+        if(test.length == 2){
+            return test[1].equals("Battery") || test[1].equals("Temperature") || test[1].equals("+") || test[1].equals("#");
+        }
+        if(test.length == 3){
+            return !test[0].equals("+") && !test[0].equals("#") && !test[1].equals("#")
+                && (test[2].equals("Battery") || test[2].equals("Temperature") || test[2].equals("+"));
+        }
+        return false;
+    }
+    
+    // Returns the topic of an argument "topic" or "topic@seconds"
+    private static String topic(String arg) {
+        int at = arg.indexOf('@');
+        return at >= 0 ? arg.substring(0, at) : arg;
+    }
 
 }
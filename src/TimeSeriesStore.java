@@ -0,0 +1,313 @@
+/*
+ * Append-only time series store of the Gateway, indexed by "nodeID/Channel".
+ * Each series is a directory of fixed-size segment files which are memory-mapped.
+ * A segment has a columnar layout: a header (magic number, number of samples),
+ * then the column of timestamps (long, ms since epoch) and the column of values (float).
+ * Segments are named after their first timestamp, so that the retention policy only has to delete files.
+ */
+import java.io.File;
+import java.io.IOException;
+import java.io.RandomAccessFile;
+import java.nio.MappedByteBuffer;
+import java.nio.channels.FileChannel;
+import java.util.ArrayList;
+import java.util.Arrays;
+import java.util.concurrent.ConcurrentHashMap;
+
+public class TimeSeriesStore {
+    private static final int MAGIC = 0x54535331; // "TSS1"
+    private static final int HEADER = 8; // magic number + number of samples
+    public static final int SEGMENT_SAMPLES = 4096;
+    private static final int SEGMENT_SIZE = HEADER + SEGMENT_SAMPLES * (8 + 4);
+    private static final String EXTENSION = ".seg";
+
+    private final File directory;
+    private final long retention;
+    private final ConcurrentHashMap<String, Series> series = new ConcurrentHashMap<>();
+
+    // State of a series: the segment currently appended to and its last sample.
+    // The methods lock the series, so that the workers of different nodes do not wait for each other
+    private static class Series {
+        File dir;
+        MappedByteBuffer segment;
+        long start;
+        int count;
+        long lastTimestamp;
+        float lastValue;
+    }
+
+    /**
+     * @param directory where the series are stored, created if needed
+     * @param retention age in ms after which the samples are deleted
+     */
+    public TimeSeriesStore(String directory, long retention) throws IOException {
+        this.directory = new File(directory);
+        this.retention = retention;
+        if(!this.directory.isDirectory() && !this.directory.mkdirs()){
+            throw new IOException("Cannot create time series directory "+directory);
+        }
+        // reopen the series of a previous run
+        File[] dirs = this.directory.listFiles();
+        for(File dir : dirs){
+            if(!dir.isDirectory()){
+                continue;
+            }
+            long[] segments = segments(dir);
+            // the newest segments may be empty or torn by a crash: they hold no sample and are deleted,
+            // and the series goes on in the newest valid one
+            int last = segments.length-1;
+            while(last >= 0 && sampleCount(new File(dir, segments[last] + EXTENSION)) <= 0){
+                new File(dir, segments[last] + EXTENSION).delete();
+                last--;
+            }
+            if(last < 0){
+                continue;
+            }
+            Series s = new Series();
+            s.dir = dir;
+            s.start = segments[last];
+            s.segment = map(new File(dir, segments[last] + EXTENSION), FileChannel.MapMode.READ_WRITE);
+            s.count = s.segment.getInt(4);
+            s.lastTimestamp = s.segment.getLong(timestampIndex(s.count-1));
+            s.lastValue = s.segment.getFloat(valueIndex(s.count-1));
+            series.put(dir.getName().replace('_', '/'), s);
+        }
+    }
+
+    // Returns the number of samples of a segment file, read from its header without mapping it,
+    // or -1 if the file is not a complete segment of this store
+    private static int sampleCount(File file) throws IOException {
+        RandomAccessFile raf = new RandomAccessFile(file, "r");
+        try{
+            if(raf.length() < SEGMENT_SIZE || raf.readInt() != MAGIC){
+                return -1;
+            }
+            int count = raf.readInt();
+            return count >= 0 && count <= SEGMENT_SAMPLES ? count : -1;
+        } finally{
+            raf.close();
+        }
+    }
+
+    // Returns the series of a key, created empty at its first use
+    private Series open(String key) {
+        Series s = series.get(key);
+        if(s == null){
+            s = new Series();
+            s.dir = new File(directory, key.replace('/', '_'));
+            Series previous = series.putIfAbsent(key, s);
+            if(previous != null){
+                s = previous;
+            }
+        }
+        return s;
+    }
+
+    /**
+     * Appends a sample to a series. A sample older than the last one, delayed in the network, is
+     * inserted in order into the current segment; it is dropped if it is older than the first
+     * sample of the segment or if the segment is full
+     * @param key "nodeID/Channel"
+     */
+    public void append(String key, long timestamp, float value) throws IOException {
+        Series s = open(key);
+        synchronized(s){
+            append(s, timestamp, value);
+        }
+    }
+
+    private void append(Series s, long timestamp, float value) throws IOException {
+        if(s.segment == null && !s.dir.isDirectory() && !s.dir.mkdirs()){
+            throw new IOException("Cannot create series directory "+s.dir);
+        }
+        if(s.segment != null && s.count > 0 && timestamp < s.lastTimestamp){
+            insert(s, timestamp, value);
+            return;
+        }
+        if(s.segment == null || s.count == SEGMENT_SAMPLES){
+            s.segment = map(new File(s.dir, timestamp + EXTENSION), FileChannel.MapMode.READ_WRITE);
+            s.segment.putInt(0, MAGIC);
+            s.segment.putInt(4, 0);
+            s.start = timestamp;
+            s.count = 0;
+            applyRetention(s.dir, timestamp);
+        }
+        s.segment.putLong(timestampIndex(s.count), timestamp);
+        s.segment.putFloat(valueIndex(s.count), value);
+        // the sample only becomes visible once both columns are written
+        s.count++;
+        s.segment.putInt(4, s.count);
+        s.lastTimestamp = timestamp;
+        s.lastValue = value;
+    }
+
+    // Inserts a late sample into the current segment of a series, after the samples of the same timestamp
+    private void insert(Series s, long timestamp, float value) {
+        if(s.count == SEGMENT_SAMPLES || timestamp < s.segment.getLong(timestampIndex(0))){
+            return;
+        }
+        int low = 0, high = s.count;
+        while(low < high){
+            int mid = (low + high) >>> 1;
+            if(s.segment.getLong(timestampIndex(mid)) <= timestamp){
+                low = mid + 1;
+            }
+            else{
+                high = mid;
+            }
+        }
+        for(int i = s.count; i > low; i--){
+            s.segment.putLong(timestampIndex(i), s.segment.getLong(timestampIndex(i-1)));
+            s.segment.putFloat(valueIndex(i), s.segment.getFloat(valueIndex(i-1)));
+        }
+        s.segment.putLong(timestampIndex(low), timestamp);
+        s.segment.putFloat(valueIndex(low), value);
+        s.count++;
+        s.segment.putInt(4, s.count);
+    }
+
+    /**
+     * @return {timestamp, value} of the last sample of a series, null if the series is empty
+     */
+    public double[] latest(String key) {
+        Series s = series.get(key);
+        if(s == null){
+            return null;
+        }
+        synchronized(s){
+            return s.segment == null ? null : new double[]{s.lastTimestamp, s.lastValue};
+        }
+    }
+
+    /**
+     * @return the timestamp of the last sample of a series, Long.MIN_VALUE if the series is empty.
+     *         Unlike latest, allocates nothing
+     */
+    public long latestTimestamp(String key) {
+        Series s = series.get(key);
+        if(s == null){
+            return Long.MIN_VALUE;
+        }
+        synchronized(s){
+            return s.segment == null ? Long.MIN_VALUE : s.lastTimestamp;
+        }
+    }
+
+    /**
+     * Returns the samples of a series in [from, to]. If step is positive, the samples are
+     * downsampled: one {bucket start, average value} per non-empty bucket of step ms
+     */
+    public ArrayList<double[]> range(String key, long from, long to, long step) throws IOException {
+        ArrayList<double[]> samples = new ArrayList<>();
+        Series s = series.get(key);
+        if(s == null){
+            return samples;
+        }
+        synchronized(s){
+            range(s, from, to, step, samples);
+        }
+        return samples;
+    }
+
+    private void range(Series s, long from, long to, long step, ArrayList<double[]> samples) throws IOException {
+        long[] segments = segments(s.dir);
+        long bucket = -1;
+        double sum = 0;
+        int n = 0;
+        for(int i = 0; i < segments.length && segments[i] <= to; i++){
+            // the samples of a segment are older than the first sample of the next one
+            if(i+1 < segments.length && segments[i+1] < from){
+                continue;
+            }
+            MappedByteBuffer segment;
+            int count;
+            if(s.segment != null && segments[i] == s.start){
+                segment = s.segment;
+                count = s.count;
+            }
+            else{
+                count = sampleCount(new File(s.dir, segments[i] + EXTENSION));
+                if(count <= 0){
+                    continue;
+                }
+                segment = map(new File(s.dir, segments[i] + EXTENSION), FileChannel.MapMode.READ_ONLY);
+            }
+            for(int j = 0; j < count; j++){
+                long timestamp = segment.getLong(timestampIndex(j));
+                if(timestamp < from || timestamp > to){
+                    continue;
+                }
+                float value = segment.getFloat(valueIndex(j));
+                if(step <= 0){
+                    samples.add(new double[]{timestamp, value});
+                    continue;
+                }
+                long b = from + ((timestamp - from) / step) * step;
+                if(b != bucket && n > 0){
+                    samples.add(new double[]{bucket, sum/n});
+                    sum = 0;
+                    n = 0;
+                }
+                bucket = b;
+                sum += value;
+                n++;
+            }
+        }
+        if(n > 0){
+            samples.add(new double[]{bucket, sum/n});
+        }
+    }
+
+    // Deletes the segments whose samples are all older than the retention
+    private void applyRetention(File dir, long now) {
+        long[] segments = segments(dir);
+        for(int i = 0; i+1 < segments.length; i++){
+            if(segments[i+1] < now - retention){
+                new File(dir, segments[i] + EXTENSION).delete();
+            }
+        }
+    }
+
+    // Returns the first timestamps of the segments of a series, in increasing order
+    private static long[] segments(File dir) {
+        File[] files = dir.listFiles();
+        if(files == null){
+            return new long[0];
+        }
+        ArrayList<Long> starts = new ArrayList<>();
+        for(File f : files){
+            String name = f.getName();
+            if(name.endsWith(EXTENSION)){
+                try{
+                    starts.add(Long.parseLong(name.substring(0, name.length() - EXTENSION.length())));
+                } catch(NumberFormatException e){
+                    // not a segment
+                }
+            }
+        }
+        long[] result = new long[starts.size()];
+        for(int i = 0; i < result.length; i++){
+            result[i] = starts.get(i);
+        }
+        Arrays.sort(result);
+        return result;
+    }
+
+    private static MappedByteBuffer map(File file, FileChannel.MapMode mode) throws IOException {
+        RandomAccessFile raf = new RandomAccessFile(file, mode == FileChannel.MapMode.READ_ONLY ? "r" : "rw");
+        try{
+            // the mapping stays valid once the file is closed
+            return raf.getChannel().map(mode, 0, SEGMENT_SIZE);
+        } finally{
+            raf.close();
+        }
+    }
+
+    private static int timestampIndex(int sample) {
+        return HEADER + sample * 8;
+    }
+
+    private static int valueIndex(int sample) {
+        return HEADER + SEGMENT_SAMPLES * 8 + sample * 4;
+    }
+}
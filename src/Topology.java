@@ -0,0 +1,101 @@
+/*
+ * Routing tree of the network as reported by the root node: the parent of each node, its rank
+ * and the ETX of the link to its parent (expected number of transmissions, in tenths).
+ * Each change increments the version, so that a consumer of the diffs can detect a missed one
+ * and fall back to the last snapshot.
+ */
+import java.util.ArrayList;
+import java.util.HashMap;
+import java.util.Map;
+import java.util.TreeMap;
+
+public class Topology {
+    private final TreeMap<String, Edge> edges = new TreeMap<>();
+    private long version = 0;
+
+    private static class Edge {
+        final String parent;
+        final int rank;
+        final int etx;
+
+        Edge(String parent, int rank, int etx){
+            this.parent = parent;
+            this.rank = rank;
+            this.etx = etx;
+        }
+    }
+
+    /**
+     * Records the edge between a node and its parent
+     * @return the diff "version +nodeID parentID rank etx", null if the edge did not change
+     */
+    public synchronized String update(String node, String parent, int rank, int etx){
+        Edge e = edges.get(node);
+        if(e != null && e.parent.equals(parent) && e.rank == rank && e.etx == etx){
+            return null;
+        }
+        edges.put(node, new Edge(parent, rank, etx));
+        version++;
+        return version+" +"+node+" "+parent+" "+rank+" "+etx;
+    }
+
+    /**
+     * Removes a node which is not reported by the root node anymore
+     * @return the diff "version -nodeID", null if the node was unknown
+     */
+    public synchronized String remove(String node){
+        if(edges.remove(node) == null){
+            return null;
+        }
+        version++;
+        return version+" -"+node;
+    }
+
+    /**
+     * @return the ETX of the link of a node to its parent in tenths, 0 if the node is unknown
+     */
+    public synchronized int etx(String node){
+        Edge e = edges.get(node);
+        return e == null ? 0 : e.etx;
+    }
+
+    /**
+     * @return the node and its ancestors up to the child of the root node, empty if the node is unknown
+     */
+    public synchronized ArrayList<String> path(String node){
+        ArrayList<String> path = new ArrayList<>();
+        // the length bound stops at a loop left by outdated reports
+        while(edges.containsKey(node) && path.size() < edges.size()){
+            path.add(node);
+            node = edges.get(node).parent;
+        }
+        return path;
+    }
+
+    /**
+     * @return the version on the first line, then one "nodeID parentID rank etx descendants" line per node
+     */
+    public synchronized String snapshot(){
+        // number of descendants of each node: every node counts once for each of its ancestors
+        HashMap<String, Integer> descendants = new HashMap<>();
+        for(String node : edges.keySet()){
+            String ancestor = edges.get(node).parent;
+            // the depth bound stops at a loop left by outdated reports
+            for(int depth = 0; ancestor != null && depth < edges.size(); depth++){
+                Integer n = descendants.get(ancestor);
+                descendants.put(ancestor, n == null ? 1 : n+1);
+                Edge e = edges.get(ancestor);
+                ancestor = e == null ? null : e.parent;
+            }
+        }
+        StringBuilder s = new StringBuilder();
+        s.append(version).append("\n");
+        for(Map.Entry<String, Edge> entry : edges.entrySet()){
+            Edge e = entry.getValue();
+            Integer n = descendants.get(entry.getKey());
+            s.append(entry.getKey()).append(" ").append(e.parent).append(" ").append(e.rank).append(" ")
+             .append(e.etx).append(" ").append(n == null ? 0 : n).append("\n");
+        }
+        return s.toString();
+    }
+}
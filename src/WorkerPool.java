@@ -0,0 +1,100 @@
+/*
+ * Workers of the Gateway, fed by the thread reading the serial line (RootLink). The lines are sharded by node ID: the
+ * readings of a node are always handled by the same worker, in order, while different nodes are decoded,
+ * deduplicated, stored and published in parallel. The lines of the root node itself (N, E, X, C, A, L) all
+ * go to the first shard, so that they keep their order. Each shard is a ring buffer of preallocated line
+ * slots between the reader and its worker, which handles a line in place before freeing its slot: no line
+ * is ever allocated. The reader waits when the worker falls behind, the serial line buffering the data meanwhile.
+ */
+import java.util.concurrent.locks.LockSupport;
+
+public class WorkerPool {
+    public static final int CAPACITY = 1024; // lines waiting per shard
+    public static final int LINE_LENGTH = 1024; // longer lines are dropped
+
+    public interface Handler {
+        /**
+         * @param line buffer holding the line, without its end of line, only valid during the call
+         * @param length length of the line
+         */
+        void handle(byte[] line, int length) throws Exception;
+    }
+
+    // Ring buffer of one reader and one worker: the reader writes the slot tail, the worker reads the slot head
+    private static class Shard {
+        final byte[][] lines = new byte[CAPACITY][LINE_LENGTH];
+        final int[] lengths = new int[CAPACITY];
+        volatile long head, tail;
+        volatile boolean sleeping; // the worker is parked on an empty ring
+        Thread worker;
+    }
+
+    private final Shard[] shards;
+
+    /**
+     * Starts the workers
+     * @param handlers one per shard, called by its worker for each of its lines
+     */
+    public WorkerPool(final Handler[] handlers){
+        shards = new Shard[handlers.length];
+        for(int i = 0; i < handlers.length; i++){
+            final Shard shard = new Shard();
+            final Handler handler = handlers[i];
+            shards[i] = shard;
+            shard.worker = new Thread(new Runnable() {
+                public void run() {
+                try {
+                    while(true) {
+                        long head = shard.head;
+                        while(head == shard.tail){
+                            // the reader checks the flag after publishing a line, and we check the ring after setting it
+                            shard.sleeping = true;
+                            if(head == shard.tail){
+                                LockSupport.park(this);
+                            }
+                            shard.sleeping = false;
+                        }
+                        int slot = (int) (head % CAPACITY);
+                        handler.handle(shard.lines[slot], shard.lengths[slot]);
+                        shard.head = head+1;
+                    }
+                } catch (Exception e) {
+                    System.out.println(e.getMessage());
+                    System.exit(1);
+                }
+                }
+            }, "worker thread "+i);
+            shard.worker.start();
+        }
+    }
+
+    // Copies a line into the next slot of its shard, waits while the shard is full
+    public void submit(byte[] line, int length){
+        Shard shard = shards[shard(line, length)];
+        long tail = shard.tail;
+        while(tail - shard.head == CAPACITY){
+            LockSupport.parkNanos(100000);
+        }
+        int slot = (int) (tail % CAPACITY);
+        System.arraycopy(line, 0, shard.lines[slot], 0, length);
+        shard.lengths[slot] = length;
+        shard.tail = tail+1;
+        if(shard.sleeping){
+            LockSupport.unpark(shard.worker);
+        }
+    }
+
+    /**
+     * @return the shard of a line: the hash of the node ID "i.j" before the first '/' for a reading,
+     *         0 for the lines of the root node
+     */
+    private int shard(byte[] line, int length){
+        int hash = 0;
+        boolean node = false;
+        for(int i = 0; i < length && line[i] != '/'; i++){
+            node |= line[i] == '.';
+            hash = 31*hash + line[i];
+        }
+        return node ? (hash & Integer.MAX_VALUE) % shards.length : 0;
+    }
+}
@@ -11,7 +11,7 @@
 public class WrongGatewayException extends Exception{
     
     public WrongGatewayException(){
-        System.out.println("Please enter one port as argument (example : /dev/ttyUSB0)");
+        System.out.println("Please enter one port and optionally the number of workers and the protocol (text or binary) as arguments (example : /dev/ttyUSB0 4 binary)");
     }
     
 }
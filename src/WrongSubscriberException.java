@@ -11,6 +11,7 @@ class WrongSubscriberException extends Exception{
       else if(flag == 2){
           //Wrong topic field
           System.out.println("Available Topics : \"Battery\" and \"Temperature\"");
+          System.out.println("Wildcards : \"+/Topic\", \"nodeID/+\", \"group/#\", \"group/+/Topic\"");
       }
       else if(flag == 3){
           System.out.println("You subscribed more than once to the same topic");
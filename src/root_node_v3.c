@@ -2,36 +2,197 @@
 #include "dev/leds.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include "net/rime/rime.h"
 #include "random.h"
 #include <string.h>
 #include "sys/timer.h"
+#include "sys/ctimer.h"
 #include "uart0.h"
+#include "lib/trickle-timer.h"
+#include "lib/crc16.h"
 #include "dev/cc2420/cc2420.h"
 
 
 PROCESS(root_node_process, "Root node");
-AUTOSTART_PROCESSES(&root_node_process);
+PROCESS(uart_tx_process, "UART transmit");
+AUTOSTART_PROCESSES(&root_node_process, &uart_tx_process);
 
 /********************************************//*
 *  MACRO DEFINITIONS
 ***********************************************/
 
-// maximum number of supported children nodes
+// the nodes are <i.j>, the two bytes of their address, i and j below MAX_INDEX (see sensor_node_v3.c)
 #define MIN_INDEX 0
+#ifndef MAX_INDEX
 #define MAX_INDEX 10
+#endif
+// longest id of a node <i.j> in the messages
+#define INDEX_DIGITS (MAX_INDEX > 100 ? 3 : (MAX_INDEX > 10 ? 2 : 1))
+#define ID_LEN (2 * INDEX_DIGITS + 1)
 // number of retransmissions in reliable unicast
 #define RETRANSMISSION 5
-// duration after which a node is considered as disconnected
-#define TIME_OUT 45
+// the sensor nodes send their DIO and DAO messages every BEACON_PERIOD iterations of their main loop,
+// which must be the same as in sensor_node_v3.c
+#ifndef BEACON_PERIOD
+#define BEACON_PERIOD 1
+#endif
+// duration after which a node is considered as disconnected: two beacons may be missed,
+// a gap of up to 36 s per iteration between the beacons
+#define TIME_OUT (45 * BEACON_PERIOD)
 
 #define NUM_HISTORY_ENTRIES 10
+// maximum number of commands waiting to be sent to the children nodes
+#define NUM_DOWNLINK_ENTRIES 4
+// maximum length of a command in the downlink queue
+#define DOWNLINK_MSG_LEN 100
 
+// uplink operating mode: 0 -> CSMA | 1 -> scheduled slots (see sensor_node_v3.c)
+#ifndef SCHEDULED_MODE
+#define SCHEDULED_MODE 0
+#endif
+// slotframe parameters, must match the ones of the sensor nodes
+#define MAX_DEPTH 5
+#define SLOT_TICKS 4
+#define SLOTFRAME_LENGTH (MAX_INDEX * MAX_INDEX * MAX_DEPTH)
 
-static char gateway_msg[9];
-static char broadcast_msg[4];
+// trickle parameters of the dissemination of the network state (see sensor_node_v3.c)
+#define TRICKLE_IMIN CLOCK_SECOND
+#define TRICKLE_IMAX 8
+#define TRICKLE_K 2
+// maximum length of a page of the network state <V version config [page] / subscriptions / aggregates / epochs>
+#define STATE_MSG_LEN 120
+// nodes of a page, must match the sensor nodes
+#define STATE_PAGE_NODES 100
+#define STATE_PAGES ((MAX_INDEX * MAX_INDEX + STATE_PAGE_NODES - 1) / STATE_PAGE_NODES)
+// two bits per node (bit 0 -> battery, bit 1 -> temperature)
+#define PAGE_BYTES (STATE_PAGE_NODES / 4)
+#define SUBSCRIPTION_BYTES (STATE_PAGES * PAGE_BYTES)
+// maximum length of the alert rules <K version / battery low / battery high / temperature low / temperature high>
+#define RULES_MSG_LEN 40
 
+// aggregate queries, must match the ones of the sensor nodes: the root
+// emits the result of an epoch AGG_DEPTH * AGG_SLOT after its end
+#if SCHEDULED_MODE
+#define AGG_DEPTH MAX_DEPTH
+#define AGG_SLOT (2 * SLOTFRAME_LENGTH * SLOT_TICKS)
+#else
+#define AGG_DEPTH 8
+#define AGG_SLOT CLOCK_SECOND
+#endif
+// an epoch outlasts the climb of its partials, a node holding one epoch at a time
+#define MIN_EPOCH ((AGG_DEPTH * AGG_SLOT) / CLOCK_SECOND + 2)
+#define MAX_EPOCH 400
+
+// downlink routing state: 0 -> one entry per descendant | 1 -> one Bloom filter per child (see sensor_node_v3.c)
+#ifndef BLOOM_MODE
+#define BLOOM_MODE 0
+#endif
+// Bloom filter parameters, must match the ones of the sensor nodes
+#define BLOOM_BITS 128
+#define BLOOM_BYTES (BLOOM_BITS / 8)
+#define BLOOM_HASHES 3
+#define MAX_CHILDREN 8
+
+// downlink commands: 0 -> routed hop by hop | 1 -> source routed by the root (see sensor_node_v3.c)
+#ifndef SOURCE_ROUTING
+#define SOURCE_ROUTING 0
+#endif
+// the hops left of a source route are a single digit
+#define MAX_PATH 9
+// number of iterations of the main loop after which an unrefreshed parent is forgotten
+#define ROUTE_MAX_AGE 25
+#define NO_PARENT 0xFFFF
+// number of iterations of the main loop between two dumps of the whole topology to the gateway
+#define TOPOLOGY_DUMP 10
+
+// link to the gateway: 0 -> text lines | 1 -> binary records in COBS frames with a CRC-16
+#ifndef BINARY_SERIAL
+#define BINARY_SERIAL 0
+#endif
+// maximum length of the records of a frame, before its CRC-16
+#define FRAME_LEN 200
+// the records of a burst share a frame, sent FRAME_DELAY after its first record, or once the
+// serial line is free if it is still busy then
+#define FRAME_DELAY (CLOCK_SECOND / 8)
+// types of the records <type length payload>, numbers in big endian, must match RootLink.java
+#define REC_READING 1    // <i j channel value(int16, tenths for the temperature) seq [time(uint16)]>
+#define REC_LOAD 2       // <i j drops(uint16)>
+#define REC_CLOCK 3      // <seconds(uint16)>
+#define REC_AGGREGATE 4  // <channel end(uint16) count(uint16) sum(int32) min(int16) max(int16)>
+#define REC_EDGE 5       // <i j parent i parent j rank etx>
+#define REC_LOST 6       // <i j>
+#define REC_NODES 7      // <i j>...
+#define REC_TEXT 8       // a line of the text protocol
+#define REC_UART 9       // <dropped(uint16) peak(uint16)>
+#define REC_ALERT 10     // <i j channel bound value(int16, tenths for the temperature) [time(uint16)]>
+#define REC_READINGS 11  // <index channel|value seq time(uint16)>... stamped readings, READING_LEN bytes each:
+                         // index = i * MAX_INDEX + j, the top bit of the value set for the temperature
+#define READING_LEN 6
+#define REC_VERSION 12   // <version> of the network state, acknowledges a command of the gateway
+#define REC_MORE_NODES 13 // <i j>... the list of REC_NODES goes on
+#define REC_COMMAND 16   // a command of the gateway, in the text protocol
+
+// the messages to the gateway wait in a ring buffer sent in the background by uart_tx_process,
+// so that the radio callbacks never wait for the serial line; a message which does not fit is dropped
+#define TX_BUF_LEN 1024
+// bytes given at once to the UART driver when it is idle, within its own TX buffer
+// (UART0_CONF_TX_WITH_INTERRUPT) so that uart0_writeb never waits
+#define TX_CHUNK 64
+// the list of the reachable nodes is cut in lines <N/i.j/i.j/...> then <N+/i.j/...> which fit in
+// half of the buffer, or in records of a frame
+#if BINARY_SERIAL
+#define NODES_PER_LINE ((FRAME_LEN - 2) / 2)
+#else
+#define NODES_PER_LINE ((TX_BUF_LEN / 2 - 4) / (ID_LEN + 1))
+#endif
+// longest line of the text protocol, a line of the list of the reachable nodes
+#define TX_LINE_LEN (4 + NODES_PER_LINE * (ID_LEN + 1))
+
+// single node command of the gateway <F ID / channel / state>
+static char gateway_msg[ID_LEN + 6];
+// command received from the gateway until the end of the line: multicast
+// <M channel state / targets> or reporting interval <I ID / channel / seconds>
+static char line_msg[DOWNLINK_MSG_LEN];
+#if !BINARY_SERIAL
+// number of characters of the line command received so far, 0 if none
+static int line_len = 0;
+#endif
+static char broadcast_msg[32];
+#if SOURCE_ROUTING
+// source routed command <S number of hops left / next hops / command>
+static char source_msg[DOWNLINK_MSG_LEN];
+#endif
+
+#if !BINARY_SERIAL
 static int counter = 1;
+#endif
+// messages to the gateway, written at the head and sent from the tail
+static uint8_t tx_buf[TX_BUF_LEN];
+static uint16_t tx_head = 0;
+static uint16_t tx_tail = 0;
+// messages dropped because the buffer was full, and most bytes waiting, since the boot
+static uint16_t tx_dropped = 0;
+static uint16_t tx_peak = 0;
+#if BINARY_SERIAL
+// records of the frame being built for the gateway, and room for its CRC-16
+static uint8_t frame[FRAME_LEN + 2];
+static int frame_len = 0;
+// start of the REC_READINGS record ending the frame, -1 if the frame ends with another record
+static int readings_record = -1;
+static struct ctimer frame_timer;
+// the frame waits for the serial line: it is sent when the transmit buffer is empty
+static int frame_due = 0;
+// frame received from the gateway until its zero delimiter, decoded in place
+static uint8_t rx_frame[DOWNLINK_MSG_LEN + 8];
+static int rx_len = 0;
+#endif
+// iterations of the main loop since the last dump of the topology
+static int topology_loops = 0;
+// next node of the topology dump in progress, -1 if none
+static int topology_next = -1;
+// next node of the list of the reachable nodes in progress, -1 if none
+static int nodes_next = -1;
 
 
 struct history_entry {
@@ -42,6 +203,17 @@ struct history_entry {
 LIST(history_table);
 MEMB(history_mem, struct history_entry, NUM_HISTORY_ENTRIES);
 
+// commands waiting to be sent to the children nodes
+struct downlink_entry {
+  struct downlink_entry *next;
+  linkaddr_t to;
+  char msg[DOWNLINK_MSG_LEN];
+};
+LIST(downlink_queue);
+MEMB(downlink_mem, struct downlink_entry, NUM_DOWNLINK_ENTRIES);
+// the entry currently being transmitted via runicast
+static struct downlink_entry *downlink_inflight = NULL;
+
 
 /********************************************//**
 *  CONSTANT DEFINITIONS
@@ -53,8 +225,17 @@ static const int rank = 0;
 *  RIME ADDRESSES
 ***********************************************/
 
+#if BLOOM_MODE
+// a direct child and the Bloom filter of its subtree (itself included)
+struct child_entry {
+  linkaddr_t addr;
+  uint8_t filter[BLOOM_BYTES];
+};
+static struct child_entry children[MAX_CHILDREN];
+#else
 // list of all children nodes
 static linkaddr_t children_nodes[MAX_INDEX][MAX_INDEX];
+#endif
 // reference to this node
 static linkaddr_t this_node;
 
@@ -62,8 +243,17 @@ static linkaddr_t this_node;
 *  TIMERS
 ***********************************************/
 
+#if BLOOM_MODE
+// a timer associated to each direct child
+static struct timer children_timer[MAX_CHILDREN];
+#else
 // a timer associated to each child node
 static struct timer children_timer[MAX_INDEX][MAX_INDEX];
+#endif
+// a timer per page that paces the broadcasts of the network state
+static struct trickle_timer state_timer[STATE_PAGES];
+// the same for the alert rules, started with the first rule
+static struct trickle_timer rules_timer;
 
 /********************************************//**
 *  Other global variables
@@ -71,22 +261,1005 @@ static struct timer children_timer[MAX_INDEX][MAX_INDEX];
 
 // the current configuration
 static char config = 'P';
+// the subscriptions of all the nodes, disseminated with the configuration
+static uint8_t subscriptions[SUBSCRIPTION_BYTES];
+// the members of the aggregate queries, in the layout of the subscriptions
+static uint8_t aggregation[SUBSCRIPTION_BYTES];
+// version of the network state, incremented at each change
+static uint8_t state_version = 0;
+// the pages of the network state and their versions, incremented when the page changes
+static char state_msg[STATE_PAGES][STATE_MSG_LEN];
+static uint8_t page_version[STATE_PAGES];
+// the alert rule of the battery (0) and the temperature (1) <low / high>, '*' for no bound
+static char alert_rules[2][14] = {"*/*", "*/*"};
+// version of the alert rules, only valid once there is a rule
+static uint8_t rules_version = 0;
+static int has_rules = 0;
+static char rules_msg[RULES_MSG_LEN];
+// parent of each node as reported by the node (index i * MAX_INDEX + j), and the age of the report
+static uint16_t parents[MAX_INDEX * MAX_INDEX];
+static uint8_t route_age[MAX_INDEX * MAX_INDEX];
+// rank of each node and ETX of the link to its parent in tenths, as reported by the node
+static uint8_t ranks[MAX_INDEX * MAX_INDEX];
+static uint8_t etx[MAX_INDEX * MAX_INDEX];
+#if SCHEDULED_MODE
+// local time at which the current slotframe started, the root is the
+// reference of the slotframe for the whole network
+static clock_time_t slotframe_start = 0;
+#endif
+
+// aggregate of the current epoch of the aggregate query on a channel
+struct aggregate {
+  // duration of an epoch in seconds, 0 if there is no query on the channel
+  int epoch;
+  // number of the epoch modulo 256, and its end in network time (ticks)
+  uint8_t number;
+  unsigned long end;
+  int count;
+  long sum;
+  int min;
+  int max;
+  // set to the emission of the result after the end of the epoch
+  struct ctimer timer;
+};
+// the aggregate queries on the battery (0) and the temperature (1)
+static struct aggregate aggregates[2];
 
 /********************************************//**
 *  Structures for broadcast / (r)unicast
 ***********************************************/
 
 static struct broadcast_conn broadcast;
+static struct broadcast_conn dissemination;
 static struct unicast_conn unicast;
 static struct runicast_conn runicast;
 
-static int index1 = 0;
-static int index2 = 0;
-
 /********************************************//**
 *  Function definitions
 ***********************************************/
 
+/**
+* Reads the id of a node at the start of a message, each index in decimal
+* @ param  msg   : the message <i.j...>
+* @ param  i, j  : the indices of the node
+* @ return the length of the id, 0 if the message does not start with a valid id
+*/
+static int parse_id(const char *msg, int *i, int *j) {
+  int n = 0, k;
+  for(k = 0; k < 2; k++) {
+    int index = 0, start = n;
+    while(msg[n] >= '0' && msg[n] <= '9' && n - start < INDEX_DIGITS) {
+      index = index * 10 + msg[n++] - '0';
+    }
+    if(n == start || index >= MAX_INDEX || (k == 0 && msg[n++] != '.')) {
+      return 0;
+    }
+    *(k == 0 ? i : j) = index;
+  }
+  return n;
+}
+
+/**
+* @ param  msg  : a message of a node <ID/type...>
+* @ return the type of the message, 0 if it does not start with the id of a node
+*/
+static char message_type(const char *msg) {
+  int i, j, n = parse_id(msg, &i, &j);
+  return n > 0 && msg[n] == '/' ? msg[n + 1] : 0;
+}
+
+#if SCHEDULED_MODE
+/**
+* Returns the number of clock ticks elapsed since the start of the current
+* slotframe. The start of the slotframe is moved forward so that it never
+* lags more than one slotframe behind the clock
+* @ param  /
+* @ return the elapsed ticks in the current slotframe
+*/
+static clock_time_t slotframe_elapsed(void) {
+  clock_time_t now = clock_time();
+  while((clock_time_t)(now - slotframe_start) >= SLOTFRAME_LENGTH * SLOT_TICKS) {
+    slotframe_start += SLOTFRAME_LENGTH * SLOT_TICKS;
+  }
+  return now - slotframe_start;
+}
+#endif
+
+/**
+* Sends the oldest command of the downlink queue if runicast is not busy
+* @ param  /
+* @ return /
+*/
+static void runicast_drain(void) {
+  struct downlink_entry *d = list_head(downlink_queue);
+  if(d != NULL && downlink_inflight == NULL && !runicast_is_transmitting(&runicast)) {
+    downlink_inflight = d;
+    packetbuf_clear();
+    packetbuf_copyfrom(d->msg, strlen(d->msg) + 1);
+    runicast_send(&runicast, &d->to, RETRANSMISSION);
+  }
+}
+
+/**
+* Queues a command for transmission to a child node.
+* The command is dropped if the queue is full
+* @ param  to   : the child node
+* @ param  msg  : the command
+* @ return 1 if the command was queued, 0 otherwise
+*/
+static int send_downlink(const linkaddr_t *to, const char *msg) {
+  struct downlink_entry *e = memb_alloc(&downlink_mem);
+  if(e == NULL) {
+    return 0;
+  }
+  linkaddr_copy(&e->to, to);
+  strncpy(e->msg, msg, DOWNLINK_MSG_LEN - 1);
+  e->msg[DOWNLINK_MSG_LEN - 1] = '\0';
+  list_add(downlink_queue, e);
+  runicast_drain();
+  return 1;
+}
+
+#if BLOOM_MODE
+/**
+* Checks if a node may be in a Bloom filter (see sensor_node_v3.c for the
+* hash functions)
+* @ param  filter  : the filter
+* @ param  index   : the index of the node (i * MAX_INDEX + j)
+* @ return 1 if the node may be in the filter, 0 if it is not
+*/
+static int bloom_contains(const uint8_t *filter, int index) {
+  uint32_t h = (uint32_t)(index + 1) * 2654435761UL;
+  int k;
+  for(k = 0; k < BLOOM_HASHES; k++) {
+    int bit = (h >> (7 * k)) & (BLOOM_BITS - 1);
+    if((filter[bit / 8] & (1 << (bit % 8))) == 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/**
+* Records the Bloom filter advertised by a child in its DAO. A new child
+* takes a free entry, it is ignored if there is none
+* @ param  from  : the child
+* @ param  hex   : the filter in hexadecimal
+* @ return /
+*/
+static void add_child(const linkaddr_t *from, const char *hex) {
+  int i, k, slot = -1;
+  for(i = 0; i < MAX_CHILDREN; i++) {
+    if(linkaddr_cmp(&children[i].addr, from) != 0) {
+      slot = i;
+      break;
+    }
+    if(slot < 0 && linkaddr_cmp(&children[i].addr, &linkaddr_null) != 0) {
+      slot = i;
+    }
+  }
+  if(slot < 0) {
+    return;
+  }
+  linkaddr_copy(&children[slot].addr, from);
+  for(k = 0; k < BLOOM_BYTES && hex[2 * k] != '\0' && hex[2 * k + 1] != '\0'; k++) {
+    char byte[3] = {hex[2 * k], hex[2 * k + 1], '\0'};
+    children[slot].filter[k] = strtol(byte, NULL, 16);
+  }
+  timer_restart(&children_timer[slot]);
+}
+#endif
+
+/**
+* Checks if a node can be reached through one of our children. In Bloom
+* mode, the answer may be a false positive
+* @ param  i, j  : the indices of the node
+* @ return 1 if the node is in our subtree, 0 otherwise
+*/
+static int in_subtree(int i, int j) {
+#if BLOOM_MODE
+  int c;
+  for(c = 0; c < MAX_CHILDREN; c++) {
+    if(linkaddr_cmp(&children[c].addr, &linkaddr_null) == 0 && bloom_contains(children[c].filter, i * MAX_INDEX + j)) {
+      return 1;
+    }
+  }
+  return 0;
+#else
+  return linkaddr_cmp(&(children_nodes[i][j]), &linkaddr_null) == 0;
+#endif
+}
+
+/**
+* Forwards a command to the child leading to its target node. In Bloom
+* mode, the command is sent to every child whose filter matches, the
+* wrong subtrees drop it (see sensor_node_v3.c)
+* @ param  i, j  : the indices of the target node
+* @ param  msg   : the command
+* @ return /
+*/
+static void route_downlink(int i, int j, const char *msg) {
+#if BLOOM_MODE
+  int c;
+  for(c = 0; c < MAX_CHILDREN; c++) {
+    if(linkaddr_cmp(&children[c].addr, &linkaddr_null) == 0 && bloom_contains(children[c].filter, i * MAX_INDEX + j)) {
+      send_downlink(&children[c].addr, msg);
+    }
+  }
+#else
+  if(in_subtree(i, j)) {
+    send_downlink(&children_nodes[i][j], msg);
+  }
+#endif
+}
+
+// Returns the number of bytes waiting to be sent to the gateway
+static int tx_used(void) {
+  return (tx_head - tx_tail + TX_BUF_LEN) % TX_BUF_LEN;
+}
+
+/**
+* Queues a message for the gateway, sent in the background by uart_tx_process.
+* A message which does not fit in the buffer is dropped whole and counted
+* @ param  msg, len  : the message
+* @ return /
+*/
+static void uart_send(const uint8_t *msg, int len) {
+  int used = tx_used();
+  int i;
+  // one byte stays free, so that a full buffer is not seen as empty
+  if(used + len >= TX_BUF_LEN) {
+    tx_dropped++;
+    return;
+  }
+  for(i = 0; i < len; i++) {
+    tx_buf[tx_head] = msg[i];
+    tx_head = (tx_head + 1) % TX_BUF_LEN;
+  }
+  if(used + len > tx_peak) {
+    tx_peak = used + len;
+  }
+  process_poll(&uart_tx_process);
+}
+
+#if !BINARY_SERIAL
+/**
+* Formats a message for the gateway like printf and queues it
+* @ param  fmt  : the format of the message
+* @ return /
+*/
+static void uart_printf(const char *fmt, ...) {
+  static char line[TX_LINE_LEN + 1];
+  va_list ap;
+  int n;
+  va_start(ap, fmt);
+  n = vsnprintf(line, sizeof(line), fmt, ap);
+  va_end(ap);
+  // a truncated line would be misread, it is dropped as well
+  if(n < 0 || n >= (int) sizeof(line)) {
+    tx_dropped++;
+    return;
+  }
+  uart_send((uint8_t *) line, n);
+}
+#else
+/**
+* COBS encodes a frame: the zero bytes are replaced by the distance to the
+* next one, so that a zero byte only delimits the frames
+* @ param  in, len  : the frame
+* @ param  out      : the encoded frame, of up to len + len / 254 + 1 bytes
+* @ return the length of the encoded frame
+*/
+static int cobs_encode(const uint8_t *in, int len, uint8_t *out) {
+  int code_pos = 0, o = 1, i;
+  uint8_t code = 1;
+  for(i = 0; i < len; i++) {
+    if(in[i] != 0) {
+      out[o++] = in[i];
+      code++;
+    }
+    if(in[i] == 0 || code == 0xFF) {
+      out[code_pos] = code;
+      code_pos = o++;
+      code = 1;
+    }
+  }
+  out[code_pos] = code;
+  return o;
+}
+
+/**
+* COBS decodes a frame in place
+* @ param  buf, len  : the encoded frame, without its delimiter
+* @ return the length of the frame, -1 if the encoding is wrong
+*/
+static int cobs_decode(uint8_t *buf, int len) {
+  int i = 0, o = 0, k;
+  while(i < len) {
+    uint8_t code = buf[i++];
+    if(code == 0 || i + code - 1 > len) {
+      return -1;
+    }
+    for(k = 1; k < code; k++) {
+      buf[o++] = buf[i++];
+    }
+    if(code < 0xFF && i < len) {
+      buf[o++] = 0;
+    }
+  }
+  return o;
+}
+
+/**
+* Queues the frame being built for the gateway with its CRC-16, COBS encoded
+* and followed by a zero byte
+* @ param  ptr  : unused
+* @ return /
+*/
+static void frame_flush(void *ptr) {
+  static uint8_t out[FRAME_LEN + 2 + (FRAME_LEN + 2) / 254 + 2];
+  int n;
+  ctimer_stop(&frame_timer);
+  if(frame_len == 0) {
+    return;
+  }
+  uint16_t crc = crc16_data(frame, frame_len, 0);
+  frame[frame_len] = crc >> 8;
+  frame[frame_len + 1] = crc & 0xFF;
+  n = cobs_encode(frame, frame_len + 2, out);
+  out[n++] = 0;
+  uart_send(out, n);
+  frame_len = 0;
+  readings_record = -1;
+  frame_due = 0;
+}
+
+/**
+* Sends the frame FRAME_DELAY after its first record if the serial line is
+* free. Otherwise the records keep joining the frame until the line is free
+* or the frame is full, so that the frames grow with the load
+* @ param  ptr  : unused
+* @ return /
+*/
+static void frame_timeout(void *ptr) {
+  if(tx_used() > 0) {
+    frame_due = 1;
+  }
+  else {
+    frame_flush(NULL);
+  }
+}
+
+/**
+* Adds a record to the frame being built, which is sent when it is full or
+* FRAME_DELAY after its first record (see frame_timeout)
+* @ param  type          : the type of the record
+* @ param  payload, len  : the content of the record, up to FRAME_LEN - 2 bytes
+* @ return /
+*/
+static void frame_record(uint8_t type, const uint8_t *payload, int len) {
+  if(len > FRAME_LEN - 2) {
+    return;
+  }
+  if(frame_len + 2 + len > FRAME_LEN) {
+    frame_flush(NULL);
+  }
+  readings_record = type == REC_READINGS ? frame_len : -1;
+  frame[frame_len++] = type;
+  frame[frame_len++] = len;
+  memcpy(&frame[frame_len], payload, len);
+  frame_len += len;
+  if(ctimer_expired(&frame_timer) && frame_due == 0) {
+    ctimer_set(&frame_timer, FRAME_DELAY, frame_timeout, NULL);
+  }
+}
+
+/**
+* Adds a stamped reading to the frame, appended to the REC_READINGS record
+* ending the frame if there is one, so that a burst of readings shares a
+* single record header
+* @ param  r  : the reading, READING_LEN bytes
+* @ return /
+*/
+static void frame_reading(const uint8_t *r) {
+  if(readings_record >= 0 && frame_len + READING_LEN <= FRAME_LEN) {
+    memcpy(&frame[frame_len], r, READING_LEN);
+    frame_len += READING_LEN;
+    frame[readings_record + 1] += READING_LEN;
+  }
+  else {
+    frame_record(REC_READINGS, r, READING_LEN);
+  }
+}
+
+// Writes a 16 bits number in big endian
+static void put16(uint8_t *p, uint16_t v) {
+  p[0] = v >> 8;
+  p[1] = v & 0xFF;
+}
+#endif
+
+/**
+* Sends an edge of the topology to the gateway <E/ID/parent ID/rank/ETX>
+* @ param  index  : the index of the node
+* @ return /
+*/
+static void print_edge(int index) {
+#if BINARY_SERIAL
+  uint8_t r[6] = {index / MAX_INDEX, index % MAX_INDEX, parents[index] / MAX_INDEX, parents[index] % MAX_INDEX,
+                  ranks[index], etx[index]};
+  frame_record(REC_EDGE, r, sizeof(r));
+#else
+  uart_printf("E/%d.%d/%d.%d/%d/%d\n", index / MAX_INDEX, index % MAX_INDEX,
+              parents[index] / MAX_INDEX, parents[index] % MAX_INDEX, ranks[index], etx[index]);
+#endif
+}
+
+/**
+* Sends to the gateway the readings a node dropped since its last report <L/ID/drops>
+* @ param  index  : the index of the node
+* @ param  drops  : the number of readings
+* @ return /
+*/
+static void print_load(int index, int drops) {
+#if BINARY_SERIAL
+  uint8_t r[4] = {index / MAX_INDEX, index % MAX_INDEX};
+  put16(&r[2], drops);
+  frame_record(REC_LOAD, r, sizeof(r));
+#else
+  uart_printf("L/%d.%d/%d\n", index / MAX_INDEX, index % MAX_INDEX, drops);
+#endif
+}
+
+/**
+* Sends a reading to the gateway <ID/channel/value/seq[/time]>. In binary
+* mode, the temperature (<degrees.tenth>) goes in tenths, a stamped reading
+* joins the readings of its burst, and a message which is not a reading goes
+* as a line of text
+* @ param  msg  : the message of the node
+* @ return /
+*/
+static void print_reading(const char *msg) {
+#if BINARY_SERIAL
+  int i, j, value, tenth = 0, n = 0, k = 0;
+  unsigned int seq, time;
+  char channel = 0;
+  uint8_t r[8];
+  if(sscanf(msg, "%d.%d/%c/%n", &i, &j, &channel, &k) == 3 && k > 0) {
+    if(channel == 'T') {
+      n = sscanf(&msg[k], "%d.%1d/%u/%u", &value, &tenth, &seq, &time) - 1;
+      value = value < 0 ? value * 10 - tenth : value * 10 + tenth;
+    }
+    else {
+      n = sscanf(&msg[k], "%d/%u/%u", &value, &seq, &time);
+    }
+  }
+  if(n >= 2 && i >= 0 && i < MAX_INDEX && j >= 0 && j < MAX_INDEX && (channel == 'B' || channel == 'T')) {
+    if(n == 3 && value >= -0x4000 && value < 0x4000 && MAX_INDEX * MAX_INDEX <= 256) {
+      // stamped: 6 bytes in the record of the burst, while the index of a node fits in a byte
+      r[0] = i * MAX_INDEX + j;
+      put16(&r[1], (value & 0x7FFF) | (channel == 'T' ? 0x8000 : 0));
+      r[3] = seq;
+      put16(&r[4], time);
+      frame_reading(r);
+      return;
+    }
+    r[0] = i;
+    r[1] = j;
+    r[2] = channel;
+    put16(&r[3], value);
+    r[5] = seq;
+    put16(&r[6], time);
+    frame_record(REC_READING, r, n == 3 ? 8 : 6);
+  }
+  else {
+    frame_record(REC_TEXT, (const uint8_t *) msg, strlen(msg));
+  }
+#else
+  uart_printf("%s\n", msg);
+#endif
+}
+
+/**
+* Sends an alert of a node to the gateway at once <!/ID/channel/bound/value[/time]>.
+* In binary mode, the temperature goes in tenths, and an alert which cannot
+* be parsed goes as the line of the text protocol
+* @ param  msg  : the alert of the node <ID/!channel/bound/value[/time]>
+* @ return /
+*/
+static void print_alert(const char *msg) {
+#if BINARY_SERIAL
+  int i, j, value, tenth = 0, n = 0, k = 0;
+  unsigned int time;
+  char channel = 0, bound = 0;
+  uint8_t r[8];
+  if(sscanf(msg, "%d.%d/!%c/%c/%n", &i, &j, &channel, &bound, &k) == 4 && k > 0) {
+    if(channel == 'T') {
+      n = sscanf(&msg[k], "%d.%1d/%u", &value, &tenth, &time) - 1;
+      value = value < 0 ? value * 10 - tenth : value * 10 + tenth;
+    }
+    else {
+      n = sscanf(&msg[k], "%d/%u", &value, &time);
+    }
+  }
+  if(n >= 1 && i >= 0 && i < MAX_INDEX && j >= 0 && j < MAX_INDEX && (channel == 'B' || channel == 'T')) {
+    r[0] = i;
+    r[1] = j;
+    r[2] = channel;
+    r[3] = bound;
+    put16(&r[4], value);
+    put16(&r[6], time);
+    frame_record(REC_ALERT, r, n == 2 ? 8 : 6);
+  }
+  else {
+    // the line of the text protocol
+    static char line[FRAME_LEN - 2];
+    int m = strchr(msg, '/') - msg + 1;
+    int len = snprintf(line, sizeof(line), "!/%.*s%s", m, msg, &msg[m + 1]);
+    frame_record(REC_TEXT, (const uint8_t *) line, len < (int) sizeof(line) ? len : (int) sizeof(line) - 1);
+  }
+  // an alert does not wait for the end of the burst
+  frame_flush(NULL);
+#else
+  // the id and its '/', then the alert after the '!'
+  int n = strchr(msg, '/') - msg + 1;
+  uart_printf("!/%.*s%s\n", n, msg, &msg[n + 1]);
+#endif
+}
+
+/**
+* Acknowledges a command of the gateway once it is applied, with the version
+* of the network state <V/version>, so that the gateway sends the next one
+* @ param  /
+* @ return /
+*/
+static void print_version(void) {
+#if BINARY_SERIAL
+  frame_record(REC_VERSION, &state_version, 1);
+#else
+  uart_printf("V/%u\n", state_version);
+#endif
+}
+
+/**
+* @ param  index  : the index of a node
+* @ return 1 if the node is in the list of the reachable nodes: in our subtree, and not ourselves
+*/
+static int listed(int index) {
+  int i = index / MAX_INDEX, j = index % MAX_INDEX;
+  return in_subtree(i, j) && !(i == this_node.u8[0] && j == this_node.u8[1]);
+}
+
+/**
+* Sends the list of the nodes reachable via the root to the gateway
+* <N/i.j/i.j/...>, whose lines go on with <N+/i.j/...> in a large network.
+* The lines after the first one wait while the buffer of the serial line is
+* half full, and go on at the next iterations of the main loop. In Bloom
+* mode, the list may contain nodes that do not exist (false positives)
+* @ param  /
+* @ return /
+*/
+static void print_nodes(void) {
+#if BINARY_SERIAL
+  static uint8_t nodes[2 * NODES_PER_LINE];
+#else
+  static char nodes[TX_LINE_LEN + 1];
+#endif
+  int n, count, first = nodes_next < 0;
+  if(first) {
+    nodes_next = 0;
+  }
+  while(nodes_next < MAX_INDEX * MAX_INDEX && (first || tx_used() < TX_BUF_LEN / 2)) {
+#if BINARY_SERIAL
+    n = 0;
+#else
+    n = sprintf(nodes, first ? "N/" : "N+/");
+#endif
+    for(count = 0; nodes_next < MAX_INDEX * MAX_INDEX && count < NODES_PER_LINE; nodes_next++) {
+      if(listed(nodes_next)) {
+#if BINARY_SERIAL
+        nodes[n++] = nodes_next / MAX_INDEX;
+        nodes[n++] = nodes_next % MAX_INDEX;
+#else
+        n += sprintf(&nodes[n], "%d.%d/", nodes_next / MAX_INDEX, nodes_next % MAX_INDEX);
+#endif
+        count++;
+      }
+    }
+#if BINARY_SERIAL
+    frame_record(first ? REC_NODES : REC_MORE_NODES, nodes, n);
+#else
+    nodes[n++] = '\n';
+    uart_send((uint8_t *) nodes, n);
+#endif
+    first = 0;
+    // the next line starts with a node
+    while(nodes_next < MAX_INDEX * MAX_INDEX && !listed(nodes_next)) {
+      nodes_next++;
+    }
+  }
+  if(nodes_next >= MAX_INDEX * MAX_INDEX) {
+    nodes_next = -1;
+  }
+}
+
+/**
+* Records the parent reported by a node <ID/R/parent ID/rank/ETX/drops>.
+* The gateway is only told about the changes, the refreshes are silent,
+* and about the readings the node dropped since its last report
+* @ param  msg  : the report
+* @ return /
+*/
+static void record_route(const char *msg) {
+  int i, j, pi, pj, n = parse_id(msg, &i, &j);
+  // the parent id follows <ID/R/>
+  int m = n > 0 ? parse_id(&msg[n + 3], &pi, &pj) : 0;
+  if(m > 0 && msg[n + 3 + m] == '/') {
+    int index = i * MAX_INDEX + j;
+    int parent = pi * MAX_INDEX + pj;
+    const char *f = &msg[n + 4 + m];
+    int r = atoi(f);
+    const char *e = strchr(f, '/');
+    int x = e != NULL ? atoi(e + 1) : 0;
+    const char *d = e != NULL ? strchr(e + 1, '/') : NULL;
+    // the load of the node for the rate controller of the gateway <L/ID/drops>
+    if(d != NULL && atoi(d + 1) > 0) {
+      print_load(index, atoi(d + 1));
+    }
+    route_age[index] = 0;
+    if(parents[index] != parent || ranks[index] != r || etx[index] != x) {
+      parents[index] = parent;
+      ranks[index] = r;
+      etx[index] = x;
+      print_edge(index);
+    }
+  }
+}
+
+#if SOURCE_ROUTING
+
+/**
+* Sends a command along the path of parents from the root to its target.
+* The path is written in the command so that the relays do not need any
+* routing state: each relay pops the next hop
+* @ param  i, j  : the indices of the target node
+* @ param  msg   : the command
+* @ return 1 if the command was sent, 0 if the path is unknown
+*/
+static int source_route(int i, int j, const char *msg) {
+  uint16_t path[MAX_PATH + 1];
+  int self = this_node.u8[0] * MAX_INDEX + this_node.u8[1];
+  int node = i * MAX_INDEX + j;
+  int hops = 0;
+  int k;
+  // walk up from the target to the root, a loop ends when the path is too long
+  while(node != self) {
+    if(hops > MAX_PATH || parents[node] == NO_PARENT) {
+      return 0;
+    }
+    path[hops++] = node;
+    node = parents[node];
+  }
+  if(hops == 0) {
+    return 0;
+  }
+  // path[hops - 1] is our child, it receives the hops after it, one character '0' + index for i and j
+  char *p = source_msg;
+  *p++ = 'S';
+  *p++ = '0' + hops - 1;
+  for(k = hops - 2; k >= 0; k--) {
+    *p++ = '0' + path[k] / MAX_INDEX;
+    *p++ = '0' + path[k] % MAX_INDEX;
+  }
+  strncpy(p, msg, DOWNLINK_MSG_LEN - (p - source_msg) - 1);
+  source_msg[DOWNLINK_MSG_LEN - 1] = '\0';
+  linkaddr_t next;
+  next.u8[0] = path[hops - 1] / MAX_INDEX;
+  next.u8[1] = path[hops - 1] % MAX_INDEX;
+  return send_downlink(&next, source_msg);
+}
+#endif
+
+/**
+* Checks if a node is one of the targets of a multicast command
+* @ param  targets  : the list of targets <i.j/i.j/...> or * for all the nodes
+* @ param  i, j     : the indices of the node
+* @ return 1 if the node is a target, 0 otherwise
+*/
+static int multicast_match(const char *targets, int i, int j) {
+  int ti, tj, n;
+  if(targets[0] == '*') {
+    return 1;
+  }
+  while((n = parse_id(targets, &ti, &tj)) > 0) {
+    if(ti == i && tj == j) {
+      return 1;
+    }
+    if(targets[n] != '/') {
+      break;
+    }
+    targets += n + 1;
+  }
+  return 0;
+}
+
+/**
+* Sets the subscription of a node to a channel in the network state, or
+* its membership of an aggregate query. The change is not disseminated
+* until the version is incremented
+* @ param  table    : subscriptions or aggregation
+* @ param  index    : the index of the node in the children_nodes array
+* @ param  channel  : B for battery | T for temperature
+* @ param  state    : 0 -> no subscriber | 1 -> subscriber
+* @ return /
+*/
+static void set_subscription(uint8_t *table, int index, char channel, char state) {
+  uint8_t bit = (channel == 'B' ? 1 : 2) << (2 * (index % 4));
+  if(state == '1') {
+    table[index / 4] |= bit;
+  }
+  else {
+    table[index / 4] &= ~bit;
+  }
+}
+
+/**
+* Writes a page of the network state, and spreads it at once with the next
+* version of the page if it changed
+* @ param  p      : the page
+* @ param  force  : 1 -> the page is spread even if it did not change
+* @ return /
+*/
+static void disseminate_page(int p, int force) {
+  static char page[STATE_MSG_LEN];
+  const char *previous = &state_msg[p][1];
+  int i;
+  // the number of the page follows the configuration when there are several pages
+#if STATE_PAGES > 1
+  sprintf(page, "%c%d/", config, p);
+#else
+  sprintf(page, "%c/", config);
+#endif
+  for(i = p * PAGE_BYTES; i < (p + 1) * PAGE_BYTES; i++) {
+    sprintf(&page[strlen(page)], "%02x", subscriptions[i]);
+  }
+  strcat(page, "/");
+  for(i = p * PAGE_BYTES; i < (p + 1) * PAGE_BYTES; i++) {
+    sprintf(&page[strlen(page)], "%02x", aggregation[i]);
+  }
+  sprintf(&page[strlen(page)], "/%d/%d", aggregates[0].epoch, aggregates[1].epoch);
+  // the version is left out of the comparison
+  while(*previous >= '0' && *previous <= '9') {
+    previous++;
+  }
+  if(force || state_msg[p][0] == '\0' || strcmp(previous, page) != 0) {
+    page_version[p]++;
+    snprintf(state_msg[p], STATE_MSG_LEN, "V%u%s", page_version[p], page);
+    trickle_timer_inconsistency(&state_timer[p]);
+  }
+}
+
+/**
+* Increments the version of the network state and spreads the pages which
+* changed at once
+* @ param  /
+* @ return /
+*/
+static void disseminate(void) {
+  int p;
+  state_version++;
+  for(p = 0; p < STATE_PAGES; p++) {
+    disseminate_page(p, 0);
+  }
+}
+
+static void state_broadcast(void *ptr, uint8_t suppress);
+
+/**
+* Increments the version of the alert rules and spreads them at once, on
+* the channel of the network state. The rules are not part of the network
+* state, which has no room left for them
+* @ param  /
+* @ return /
+*/
+static void disseminate_rules(void) {
+  rules_version++;
+  sprintf(rules_msg, "K%u/%s/%s", rules_version, alert_rules[0], alert_rules[1]);
+  if(has_rules == 0) {
+    has_rules = 1;
+    trickle_timer_config(&rules_timer, TRICKLE_IMIN, TRICKLE_IMAX, TRICKLE_K);
+    trickle_timer_set(&rules_timer, state_broadcast, rules_msg);
+  }
+  else {
+    trickle_timer_inconsistency(&rules_timer);
+  }
+}
+
+/**
+* Sends a command of the gateway to its target node
+* @ param  i, j  : the indices of the target node
+* @ param  msg   : the command
+* @ return /
+*/
+static void send_command(int i, int j, const char *msg) {
+#if SOURCE_ROUTING
+  // fall back on the children tables while the path is unknown
+  if(source_route(i, j, msg) == 0) {
+    route_downlink(i, j, msg);
+  }
+#else
+  route_downlink(i, j, msg);
+#endif
+}
+
+/**
+* Forwards a reporting interval set by the gateway to its target node.
+* The intervals are not part of the network state, the gateway sends
+* them again when they change
+* @ param  message  : the interval command <I ID / channel / seconds>
+* @ return /
+*/
+static void interval_command(const char *message) {
+  int i, j, n = parse_id(&message[1], &i, &j);
+  if(n > 0 && message[1 + n] == '/' && message[2 + n] != '\0' && message[3 + n] == '/' && message[4 + n] != '\0') {
+    send_command(i, j, message);
+  }
+}
+
+/**
+* Applies a multicast command of the gateway to the network state and
+* disseminates it
+* @ param  message  : the multicast command <M channel state / targets>
+* @ return /
+*/
+static void multicast_subscription(const char *message) {
+  int i, j;
+  for(i = 0; i < MAX_INDEX; i++) {
+    for(j = 0; j < MAX_INDEX; j++) {
+      if(multicast_match(&message[4], i, j)) {
+        set_subscription(subscriptions, i * MAX_INDEX + j, message[1], message[2]);
+      }
+    }
+  }
+  disseminate();
+}
+
+/**
+* Applies an aggregate query of the gateway to the network state and
+* disseminates it. A positive epoch adds the targets to the query on the
+* channel, 0 removes them; the query stops with its last member
+* @ param  message  : the aggregate command <A channel epoch / targets>
+* @ return /
+*/
+static void aggregate_command(const char *message) {
+  const char *targets = strchr(message, '/');
+  int seconds = atoi(&message[2]);
+  int c = message[1] == 'B' ? 0 : 1;
+  int i, j, members = 0;
+  if(targets == NULL || (message[1] != 'B' && message[1] != 'T')) {
+    return;
+  }
+  for(i = 0; i < MAX_INDEX; i++) {
+    for(j = 0; j < MAX_INDEX; j++) {
+      if(multicast_match(targets + 1, i, j)) {
+        set_subscription(aggregation, i * MAX_INDEX + j, message[1], seconds > 0 ? '1' : '0');
+      }
+    }
+  }
+  if(seconds > 0) {
+    aggregates[c].epoch = seconds < MIN_EPOCH ? MIN_EPOCH : (seconds > MAX_EPOCH ? MAX_EPOCH : seconds);
+  }
+  for(i = 0; i < SUBSCRIPTION_BYTES; i++) {
+    members |= aggregation[i] & (c == 0 ? 0x55 : 0xAA);
+  }
+  if(members == 0) {
+    aggregates[c].epoch = 0;
+    ctimer_stop(&aggregates[c].timer);
+  }
+  disseminate();
+}
+
+/**
+* Applies an alert rule of the gateway and disseminates the rules. The
+* bounds are in the units of the readings, tenths of a degree for the
+* temperature, '*' for no bound
+* @ param  message  : the alert rule <K channel / low / high>
+* @ return /
+*/
+static void alert_command(const char *message) {
+  const char *rule = &message[3];
+  int n = strlen(rule), slashes = 0, i;
+  if((message[1] != 'B' && message[1] != 'T') || message[2] != '/' || n < 3 || n >= (int) sizeof(alert_rules[0])) {
+    return;
+  }
+  for(i = 0; i < n; i++) {
+    if(rule[i] == '/') {
+      slashes++;
+    }
+    else if(rule[i] != '*' && rule[i] != '-' && (rule[i] < '0' || rule[i] > '9')) {
+      return;
+    }
+  }
+  char *rules = alert_rules[message[1] == 'B' ? 0 : 1];
+  if(slashes == 1 && strcmp(rule, rules) != 0) {
+    strcpy(rules, rule);
+    disseminate_rules();
+  }
+}
+
+static void aggregate_callback(void *ptr);
+
+/**
+* Starts the aggregate of the next epoch whose emission is ahead. Our
+* clock is the network time
+* @ param  a  : the aggregate
+* @ return /
+*/
+static void aggregate_schedule(struct aggregate *a) {
+  unsigned long now = clock_seconds() * CLOCK_SECOND + clock_time() % CLOCK_SECOND;
+  unsigned long length = (unsigned long) a->epoch * CLOCK_SECOND;
+  unsigned long offset = (unsigned long) AGG_DEPTH * AGG_SLOT;
+  unsigned long m = now >= offset ? (now - offset) / length + 1 : 1;
+  a->number = (uint8_t)(m - 1);
+  a->end = m * length;
+  a->count = 0;
+  a->sum = 0;
+  ctimer_set(&a->timer, a->end + offset - now, aggregate_callback, a);
+}
+
+/**
+* Sends the result of an epoch to the gateway, timestamped with the end
+* of the epoch <A/channel/seconds modulo 2^16/count/sum/min/max>
+* @ param  ptr  : the aggregate
+* @ return /
+*/
+static void aggregate_callback(void *ptr) {
+  struct aggregate *a = ptr;
+  if(a->count > 0) {
+#if BINARY_SERIAL
+    uint8_t r[13] = {a == &aggregates[0] ? 'B' : 'T'};
+    put16(&r[1], (a->end / CLOCK_SECOND) & 0xFFFF);
+    put16(&r[3], a->count);
+    put16(&r[5], a->sum >> 16);
+    put16(&r[7], a->sum & 0xFFFF);
+    put16(&r[9], a->min);
+    put16(&r[11], a->max);
+    frame_record(REC_AGGREGATE, r, sizeof(r));
+#else
+    uart_printf("A/%c/%u/%d/%ld/%d/%d\n", a == &aggregates[0] ? 'B' : 'T', (unsigned int)((a->end / CLOCK_SECOND) & 0xFFFF),
+                a->count, a->sum, a->min, a->max);
+#endif
+  }
+  aggregate_schedule(a);
+}
+
+/**
+* Merges the partial aggregate of a child node into the current epoch
+* @ param  msg  : the partial aggregate <ID/A/channel/epoch/count/sum/min/max>
+* @ return /
+*/
+static void aggregate_partial(const char *msg) {
+  // the fields after the id <A/channel/...>
+  const char *field = strchr(msg, '/');
+  struct aggregate *a = &aggregates[field[3] == 'B' ? 0 : 1];
+  unsigned int number;
+  int count, min, max;
+  long sum;
+  // a partial arriving after the result of its epoch is dropped
+  if(a->epoch == 0 || ctimer_expired(&a->timer)
+     || sscanf(&field[5], "%u/%d/%ld/%d/%d", &number, &count, &sum, &min, &max) != 5 || number != a->number) {
+    return;
+  }
+  if(a->count == 0 || min < a->min) {
+    a->min = min;
+  }
+  if(a->count == 0 || max > a->max) {
+    a->max = max;
+  }
+  a->count += count;
+  a->sum += sum;
+}
+
 /**
 * This function is called upon a received runicast packet. Reliable unicast
 * is only used to send sensor data. Upon reception of such a packet, is has
@@ -121,7 +1294,32 @@ static void runicast_recv(struct runicast_conn *c, const linkaddr_t *from, uint8
     e->seq = seqno;
   }
 
-  printf("%s\n", (char *) packetbuf_dataptr());
+  // the reports of the parents feed the routing state and the topology of the gateway <ID/R/parent ID/rank/ETX/drops>
+  char *message = (char *)packetbuf_dataptr();
+  char type = message_type(message);
+  if(type == 'R') {
+    record_route(message);
+    return;
+  }
+  // the partial aggregates of the children are merged into one result per epoch <ID/A/...>
+  if(type == 'A') {
+    aggregate_partial(message);
+    return;
+  }
+  // the alerts of the nodes <ID/!...>
+  if(type == '!') {
+    print_alert(message);
+    return;
+  }
+
+  // a cluster head packs several readings in a packet <reading\nreading...> (CLUSTER_MODE)
+  char *next;
+  while((next = strchr(message, '\n')) != NULL) {
+    *next = '\0';
+    print_reading(message);
+    message = next + 1;
+  }
+  print_reading(message);
 }
 
 /**
@@ -138,9 +1336,9 @@ static void unicast_recv(struct unicast_conn *c, const linkaddr_t *from)
 
   // get the indices of the sending node
   int index1 = from-> u8[0];
-  int index2 = from-> u8[0];
+  int index2 = from-> u8[1];
   // no valid address
-  if(index1 < MIN_INDEX || index1 > MAX_INDEX || index2 < MIN_INDEX || index2 > MAX_INDEX) {
+  if(index1 < MIN_INDEX || index1 >= MAX_INDEX || index2 < MIN_INDEX || index2 >= MAX_INDEX) {
     return;
   }
   // extract the message
@@ -148,6 +1346,15 @@ static void unicast_recv(struct unicast_conn *c, const linkaddr_t *from)
   // used as counter variable in for loops
   const char delim[2] = "/";
   char *token = strtok(message, delim);
+#if BLOOM_MODE
+  // we received an ALIVE message with the Bloom filter of the subtree of the child <B/filter>
+  if(strcmp(token, "B") == 0) {
+    token = strtok(NULL, delim);
+    if(token != NULL) {
+      add_child(from, token);
+    }
+  }
+#else
   // we received an ALIVE message
   if(strcmp(token, "A") == 0) {
     // get the address of the sending node
@@ -166,17 +1373,138 @@ static void unicast_recv(struct unicast_conn *c, const linkaddr_t *from)
     token = strtok(NULL, delim);
     while(token != NULL) {
       // we can reach the child nodes of the new node
-      index1 = token[0] - '0';
-      index2 = token[2] - '0';
-      children_nodes[index1][index2] = child_node;
+      if(parse_id(token, &index1, &index2) > 0) {
+        children_nodes[index1][index2] = child_node;
+        timer_restart(&(children_timer[index1][index2]));
+      }
       token = strtok(NULL, delim);
-      timer_restart(&(children_timer[index1][index2]));
     }
   }
+#endif
+}
+
+/**
+* Applies a single node command of the gateway <ID/channel/state>: the
+* network state is kept up to date for its next versions, and the command
+* is sent to the node
+* @ param  cmd  : the command
+* @ return 1 if the command was applied, 0 if it is wrong
+*/
+static int node_command(const char *cmd) {
+  int i, j, n = parse_id(cmd, &i, &j);
+  if(n == 0 || cmd[n] != '/' || cmd[n + 1] < 64 || cmd[n + 1] > 122 || cmd[n + 2] != '/'
+     || cmd[n + 3] < '0' || cmd[n + 3] > '9' || cmd[n + 4] != '\0') {
+    return 0;
+  }
+  // the command may already be in place, received in gateway_msg
+  memmove(&gateway_msg[1], cmd, n + 5);
+  set_subscription(subscriptions, i * MAX_INDEX + j, cmd[n + 1], cmd[n + 3]);
+  send_command(i, j, gateway_msg);
+  return 1;
 }
 
+#if BINARY_SERIAL
+/**
+* Applies a command of the gateway, in the text protocol: configuration
+* <P> or <O>, single node command <ID/channel/state>, multicast, interval,
+* aggregate or alert command
+* @ param  cmd  : the command
+* @ return /
+*/
+static void gateway_command(const char *cmd) {
+  if(strcmp(cmd, "P") == 0 || strcmp(cmd, "O") == 0) {
+    config = cmd[0];
+    disseminate();
+  }
+  else if(cmd[0] == 'M') {
+    multicast_subscription(cmd);
+  }
+  else if(cmd[0] == 'A') {
+    aggregate_command(cmd);
+  }
+  else if(cmd[0] == 'I') {
+    interval_command(cmd);
+  }
+  else if(cmd[0] == 'K') {
+    alert_command(cmd);
+  }
+  else {
+    node_command(cmd);
+  }
+}
+
+/**
+* Receives the frames of the gateway: a frame whose encoding, CRC-16 or
+* records are wrong is dropped as a whole
+* @ param  c  : the received byte
+* @ return 0
+*/
+static int uart_rx_callback(unsigned char c){
+  int n, i;
+  if(c != 0) {
+    // a frame too long is dropped at its delimiter
+    if(rx_len <= (int) sizeof(rx_frame)) {
+      if(rx_len < (int) sizeof(rx_frame)) {
+        rx_frame[rx_len] = c;
+      }
+      rx_len++;
+    }
+    return 0;
+  }
+  n = rx_len <= (int) sizeof(rx_frame) ? cobs_decode(rx_frame, rx_len) : -1;
+  rx_len = 0;
+  if(n < 2 || crc16_data(rx_frame, n - 2, 0) != ((rx_frame[n - 2] << 8) | rx_frame[n - 1])) {
+    return 0;
+  }
+  n -= 2;
+  // the records must cover the frame exactly
+  for(i = 0; i < n && i + 2 + rx_frame[i + 1] <= n; i += 2 + rx_frame[i + 1]);
+  if(i != n) {
+    return 0;
+  }
+  for(i = 0; i < n; i += 2 + rx_frame[i + 1]) {
+    if(rx_frame[i] == REC_COMMAND && rx_frame[i + 1] < DOWNLINK_MSG_LEN) {
+      memcpy(line_msg, &rx_frame[i + 2], rx_frame[i + 1]);
+      line_msg[rx_frame[i + 1]] = '\0';
+      gateway_command(line_msg);
+      print_version();
+    }
+  }
+  return 0;
+}
+#else
 static int uart_rx_callback(unsigned char c){
 
+  // a multicast, interval, aggregate or alert command is received until the end of the line
+  if(line_len > 0) {
+    if(c == '\n') {
+      line_msg[line_len] = '\0';
+      line_len = 0;
+      if(line_msg[0] == 'M') {
+        multicast_subscription(line_msg);
+      }
+      else if(line_msg[0] == 'A') {
+        aggregate_command(line_msg);
+      }
+      else if(line_msg[0] == 'K') {
+        alert_command(line_msg);
+      }
+      else {
+        interval_command(line_msg);
+      }
+      print_version();
+    }
+    else if(c > 32 && line_len < DOWNLINK_MSG_LEN - 1) {
+      line_msg[line_len] = c;
+      line_len++;
+    }
+    else if(c > 32) {
+      // too many targets -> drop the command
+      line_len = 0;
+    }
+    return 0;
+  }
+
   // ignore non valid character
   if(c > 32) {
 
@@ -184,65 +1512,196 @@ static int uart_rx_callback(unsigned char c){
     if(counter == 1) {
       if(c == 'P') {
         config = 'P';
+        disseminate();
+        print_version();
       }
       else if (c == 'O') {
         config = 'O';
+        disseminate();
+        print_version();
       }
-      // character is a digit
+      else if (c == 'M' || c == 'I' || c == 'A' || c == 'K') {
+        line_msg[0] = c;
+        line_len = 1;
+      }
+      // character is a digit, the start of a single node command <ID/channel/state>
       else if (c >= 48 && c <= 57) {
         gateway_msg[counter] = c;
-        index1 = c - '0';
         counter++;
       }
     }
-    else {
-      // character is a .
-      if(counter == 2 && c == 46) {
-        gateway_msg[counter] = c
-        counter++;
-      }
-      else if(counter == 3 && (c >= 48 && c <= 57)) {
-        gateway_msg[counter] = c;
-        index2 = c - '0';
-        counter++;
-      }
-      else if(counter == 4 && c == '/') {
-        gateway_msg[counter] = c;
-        counter++;
-      }
-      else if(counter == 5 && (c >= 64 && c <= 122)) {
-        gateway_msg[counter] = c;
-        counter++;
-      }
-      else if(counter == 6 && c == '/') {
-        gateway_msg[counter] = c;
-        counter++;
-      }
-      else if(counter == 7 && c (c >= 48 && c <= 57)) {
-        gateway_msg[counter] = c;
-        counter++;
-      }
-      else {
-        counter = 1; 
-      }
-
-      if(counter > 8) {
+    else if(counter < (int) sizeof(gateway_msg) - 1 && (c == '.' || c == '/' || (c >= 48 && c <= 57) || (c >= 64 && c <= 122))) {
+      gateway_msg[counter] = c;
+      counter++;
+      gateway_msg[counter] = '\0';
+      // the command ends with the digit of the state, after the second '/'
+      if(c >= 48 && c <= 57 && gateway_msg[counter - 2] == '/' && strchr(&gateway_msg[1], '/') != &gateway_msg[counter - 2]) {
         counter = 1;
-        // send the message to the node
-        packetbuf_clear();
-        packetbuf_copyfrom(gateway_msg, strlen(gateway_msg));
-        runicast_send(&runicast, &children_nodes[index1][index2], RETRANSMISSION);
+        if(node_command(&gateway_msg[1])) {
+          print_version();
+        }
       }
     }
+    else {
+      counter = 1;
+    }
   }
   return 0;
 }
+#endif
 
 
 static void broadcast_recv(struct broadcast_conn *c, const linkaddr_t *from) {
   //printf("broadcast message received from %d.%d -> %s\n", from->u8[0], from->u8[1], (char *)packetbuf_dataptr());
 }
 
+/**
+* This function is called upon received alert rules. As for the network
+* state, newer rules can only come from before a reboot of the root, in
+* which case we recover them and continue from their version
+* @ param  message  : the rules <K version / battery low / battery high / temperature low / temperature high>
+* @ return /
+*/
+static void rules_recv(const char *message) {
+  uint8_t version = atoi(&message[1]);
+  if(has_rules != 0 && version == rules_version) {
+    trickle_timer_consistency(&rules_timer);
+    return;
+  }
+  if(has_rules == 0 || (int8_t)(version - rules_version) > 0) {
+    const char *field = strchr(message, '/');
+    int i;
+    for(i = 0; i < 2 && field != NULL; i++) {
+      const char *high = strchr(field + 1, '/');
+      const char *end = high != NULL ? strchr(high + 1, '/') : NULL;
+      int n = end != NULL ? end - (field + 1) : (int) strlen(field + 1);
+      if(high != NULL && n < (int) sizeof(alert_rules[i])) {
+        memcpy(alert_rules[i], field + 1, n);
+        alert_rules[i][n] = '\0';
+      }
+      field = end;
+    }
+    rules_version = version;
+    disseminate_rules();
+  }
+  else {
+    trickle_timer_inconsistency(&rules_timer);
+  }
+}
+
+/**
+* This function is called upon a received page of the network state. The
+* root is the source of the state: a node with another version of the page
+* gets ours. A newer version can only come from before a reboot of the
+* root, in which case we recover the page and continue from its version
+* @ param  c     : the broadcast structure
+* @ param  from  : the address of the broadcasting node
+* @ return /
+*/
+static void dissemination_recv(struct broadcast_conn *c, const linkaddr_t *from) {
+  char *message = (char *)packetbuf_dataptr();
+  if(message[0] == 'K') {
+    rules_recv(message);
+    return;
+  }
+  if(message[0] != 'V') {
+    return;
+  }
+  uint8_t version = atoi(&message[1]);
+  const char *field = &message[1];
+  while(*field >= '0' && *field <= '9') {
+    field++;
+  }
+  // the number of the page follows the configuration
+  int p = *field != '\0' ? atoi(field + 1) : 0;
+  if(p < 0 || p >= STATE_PAGES) {
+    return;
+  }
+  if(version == page_version[p]) {
+    trickle_timer_consistency(&state_timer[p]);
+    return;
+  }
+  if((int8_t)(version - page_version[p]) > 0) {
+    config = *field;
+    const char *table = strchr(message, '/');
+    int i;
+    for(i = 0; table != NULL && i < PAGE_BYTES; i++) {
+      char byte[3] = {table[1 + 2 * i], table[2 + 2 * i], '\0'};
+      subscriptions[p * PAGE_BYTES + i] = strtol(byte, NULL, 16);
+    }
+    // the aggregate queries follow, their aggregates restart at the next iteration of the main loop
+    const char *members = table != NULL ? strchr(table + 1, '/') : NULL;
+    for(i = 0; members != NULL && i < PAGE_BYTES; i++) {
+      char byte[3] = {members[1 + 2 * i], members[2 + 2 * i], '\0'};
+      aggregation[p * PAGE_BYTES + i] = strtol(byte, NULL, 16);
+    }
+    const char *epoch = members != NULL ? strchr(members + 1, '/') : NULL;
+    for(i = 0; epoch != NULL && i < 2; i++) {
+      aggregates[i].epoch = atoi(epoch + 1);
+      ctimer_stop(&aggregates[i].timer);
+      epoch = strchr(epoch + 1, '/');
+    }
+    page_version[p] = version;
+    disseminate_page(p, 1);
+    state_version = page_version[p];
+  }
+  else {
+    trickle_timer_inconsistency(&state_timer[p]);
+  }
+}
+
+/**
+* This function is called by the trickle timer when the network state
+* or the alert rules should be broadcast
+* @ param  ptr       : the message
+* @ param  suppress  : TRICKLE_TIMER_TX_SUPPRESS if enough neighbors sent the same message
+* @ return /
+*/
+static void state_broadcast(void *ptr, uint8_t suppress) {
+  const char *msg = ptr;
+  if(suppress == TRICKLE_TIMER_TX_SUPPRESS) {
+    return;
+  }
+  packetbuf_clear();
+  packetbuf_copyfrom(msg, strlen(msg) + 1);
+  broadcast_send(&dissemination);
+}
+
+/**
+* This function is called when a child node acknowledged a runicast
+* packet. The command is removed from the downlink queue and the next
+* one is sent
+* @ param  c                : the runicast structure
+* @ param  to               : the address of the receiving node
+* @ param  retransmissions  : the number of retransmissions
+* @ return /
+*/
+static void sent_runicast(struct runicast_conn *c, const linkaddr_t *to, uint8_t retransmissions) {
+  if(downlink_inflight != NULL) {
+    list_remove(downlink_queue, downlink_inflight);
+    memb_free(&downlink_mem, downlink_inflight);
+    downlink_inflight = NULL;
+  }
+  runicast_drain();
+}
+
+/**
+* This function is called when a runicast packet was not acknowledged
+* after RETRANSMISSION attempts. The command is dropped
+* @ param  c                : the runicast structure
+* @ param  to               : the address of the receiving node
+* @ param  retransmissions  : the number of retransmissions
+* @ return /
+*/
+static void timedout_runicast(struct runicast_conn *c, const linkaddr_t *to, uint8_t retransmissions) {
+  if(downlink_inflight != NULL) {
+    list_remove(downlink_queue, downlink_inflight);
+    memb_free(&downlink_mem, downlink_inflight);
+    downlink_inflight = NULL;
+  }
+  runicast_drain();
+}
+
 
 /********************************************//**
 *  Broadcast / (R)unicast constructs
@@ -250,7 +1709,8 @@ static void broadcast_recv(struct broadcast_conn *c, const linkaddr_t *from) {
 
 static const struct unicast_callbacks unicast_call = {unicast_recv};
 static const struct broadcast_callbacks broadcast_call = {broadcast_recv};
-static const struct runicast_callbacks runicast_call = {runicast_recv};
+static const struct broadcast_callbacks dissemination_call = {dissemination_recv};
+static const struct runicast_callbacks runicast_call = {runicast_recv, sent_runicast, timedout_runicast};
 
 /********************************************//**
 *  MAIN THREAD
@@ -262,6 +1722,7 @@ PROCESS_THREAD(root_node_process, ev, data)
   static struct etimer et;
 
   PROCESS_EXITHANDLER(broadcast_close(&broadcast));
+  PROCESS_EXITHANDLER(broadcast_close(&dissemination));
   PROCESS_EXITHANDLER(unicast_close(&unicast));
   PROCESS_EXITHANDLER(runicast_close(&runicast));
 
@@ -270,15 +1731,23 @@ PROCESS_THREAD(root_node_process, ev, data)
   clock_init();
 
   // initialize all the timers
-  int i, j;
+  int i;
+#if BLOOM_MODE
+  for(i=0;i < MAX_CHILDREN ; i++) {
+    timer_set(&(children_timer[i]), TIME_OUT*CLOCK_SECOND);
+  }
+#else
+  int j;
   for(i=0;i < MAX_INDEX ; i++) {
     for(j=0; j < MAX_INDEX; j++)
     timer_set(&(children_timer[i][j]), TIME_OUT*CLOCK_SECOND);
   }
+#endif
 
   // set our id
   this_node.u8[0] = linkaddr_node_addr.u8[0];
   this_node.u8[1] = linkaddr_node_addr.u8[1];
+  memset(parents, NO_PARENT, sizeof(parents));
 
   // Set up an identified best-effort broadcast connection
   broadcast_open(&broadcast, 129, &broadcast_call);
@@ -286,6 +1755,13 @@ PROCESS_THREAD(root_node_process, ev, data)
   unicast_open(&unicast, 136, &unicast_call);
   // Set up an identified reliable unicast connection
   runicast_open(&runicast, 144, &runicast_call);
+  // Set up the broadcast connection of the network state
+  broadcast_open(&dissemination, 130, &dissemination_call);
+  for(i = 0; i < STATE_PAGES; i++) {
+    trickle_timer_config(&state_timer[i], TRICKLE_IMIN, TRICKLE_IMAX, TRICKLE_K);
+    trickle_timer_set(&state_timer[i], state_broadcast, state_msg[i]);
+  }
+  disseminate();
 
   gateway_msg[0] = 'F';
 
@@ -293,6 +1769,9 @@ PROCESS_THREAD(root_node_process, ev, data)
   uart0_init(BAUD2UBR(115200));
   uart0_set_input(uart_rx_callback);
 
+#if SCHEDULED_MODE
+  slotframe_start = clock_time();
+#endif
 
   // Main loop
   while(1) {
@@ -301,14 +1780,81 @@ PROCESS_THREAD(root_node_process, ev, data)
     etimer_set(&et, CLOCK_SECOND * 6 + random_rand() % (CLOCK_SECOND * 6));
     PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&et));
 
-    // create the broadcast message
-    sprintf(broadcast_msg, "O%d%c", rank, config);
+    // create the broadcast message, the root prints the readings at once and advertises an empty queue.
+    // Our clock is the network time, in ticks <O rank config queue @time>
+    unsigned long now = clock_seconds() * CLOCK_SECOND + clock_time() % CLOCK_SECOND;
+#if SCHEDULED_MODE
+    // in scheduled mode, the message also carries our position in the slotframe
+    sprintf(broadcast_msg, "O%d%c0@%lu/%u", rank, config, now, (unsigned int) slotframe_elapsed());
+#else
+    sprintf(broadcast_msg, "O%d%c0@%lu", rank, config, now);
+#endif
     // send the broadcast message
     packetbuf_clear();
     packetbuf_copyfrom(broadcast_msg, strlen(broadcast_msg));
     broadcast_send(&broadcast);
+    // the gateway maps the network time of the readings to its clock <C/seconds modulo 2^16>
+#if BINARY_SERIAL
+    uint8_t clock_record[2];
+    put16(clock_record, (now / CLOCK_SECOND) & 0xFFFF);
+    frame_record(REC_CLOCK, clock_record, sizeof(clock_record));
+#else
+    uart_printf("C/%u\n", (unsigned int)((now / CLOCK_SECOND) & 0xFFFF));
+#endif
+    // the gateway watches the overflow of the buffer of the serial line <U/messages dropped/peak bytes>
+#if BINARY_SERIAL
+    uint8_t uart_record[4];
+    put16(uart_record, tx_dropped);
+    put16(&uart_record[2], tx_peak);
+    frame_record(REC_UART, uart_record, sizeof(uart_record));
+#else
+    uart_printf("U/%u/%u\n", tx_dropped, tx_peak);
+#endif
+
+    // start the aggregate queries
+    for(i = 0; i < 2; i++) {
+      if(aggregates[i].epoch != 0 && ctimer_expired(&aggregates[i].timer)) {
+        aggregate_schedule(&aggregates[i]);
+      }
+    }
+
+    // forget the parents which are not reported any more
+    for(i=0;i<MAX_INDEX*MAX_INDEX;i++){
+      if(parents[i] != NO_PARENT && ++route_age[i] > ROUTE_MAX_AGE) {
+        parents[i] = NO_PARENT;
+#if BINARY_SERIAL
+        uint8_t lost[2] = {i / MAX_INDEX, i % MAX_INDEX};
+        frame_record(REC_LOST, lost, sizeof(lost));
+#else
+        uart_printf("X/%d.%d\n", i / MAX_INDEX, i % MAX_INDEX);
+#endif
+      }
+    }
+    // dump the whole topology from time to time, so that a gateway started late catches up.
+    // The dump stops while the buffer of the serial line is half full, and goes on at the next iterations
+    if(topology_next < 0 && ++topology_loops >= TOPOLOGY_DUMP) {
+      topology_loops = 0;
+      topology_next = 0;
+    }
+    for(; topology_next >= 0 && topology_next < MAX_INDEX*MAX_INDEX && tx_used() < TX_BUF_LEN / 2; topology_next++){
+      if(parents[topology_next] != NO_PARENT) {
+        print_edge(topology_next);
+      }
+    }
+    if(topology_next >= MAX_INDEX*MAX_INDEX) {
+      topology_next = -1;
+    }
 
     // check if a child disconnected
+#if BLOOM_MODE
+    for(i=0;i<MAX_CHILDREN;i++){
+      // remove the child node and its subtree
+      if(timer_expired(&(children_timer[i])) && linkaddr_cmp(&(children[i].addr), &linkaddr_null) == 0){
+        children[i].addr = linkaddr_null;
+        memset(children[i].filter, 0, BLOOM_BYTES);
+      }
+    }
+#else
     for(i=0;i<MAX_INDEX;i++){
       for(j=0;j<MAX_INDEX;j++) {
         // remove the child node
@@ -317,6 +1863,46 @@ PROCESS_THREAD(root_node_process, ev, data)
           }
         }
       }
+#endif
+
+    // send the list of the nodes reachable via the root to the gateway
+    print_nodes();
+  }
+
+  PROCESS_END();
+}
+/*---------------------------------------------------------------------------*/
+/**
+* Sends the messages queued for the gateway in the background: a chunk is
+* given to the UART driver each time it is idle
+*/
+PROCESS_THREAD(uart_tx_process, ev, data)
+{
+  static struct etimer tx_timer;
+  static int n;
+
+  PROCESS_BEGIN();
+
+  while(1) {
+    PROCESS_WAIT_EVENT_UNTIL(ev == PROCESS_EVENT_POLL);
+    while(tx_tail != tx_head) {
+      // the driver is still sending the previous chunk
+      if(uart0_active()) {
+        etimer_set(&tx_timer, 1);
+        PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&tx_timer));
+        continue;
+      }
+      for(n = 0; n < TX_CHUNK && tx_tail != tx_head; n++) {
+        uart0_writeb(tx_buf[tx_tail]);
+        tx_tail = (tx_tail + 1) % TX_BUF_LEN;
+      }
+    }
+#if BINARY_SERIAL
+    // the frame which waited for the line goes now
+    if(frame_due) {
+      frame_flush(NULL);
+    }
+#endif
   }
 
   PROCESS_END();
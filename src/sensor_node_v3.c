@@ -7,6 +7,8 @@
 #include "random.h"
 #include <string.h>
 #include "sys/timer.h"
+#include "sys/ctimer.h"
+#include "lib/trickle-timer.h"
 #include <limits.h>
 #include "dev/temperature-sensor.h"
 #include "dev/battery-sensor.h"
@@ -18,16 +20,188 @@ AUTOSTART_PROCESSES(&sensor_node_process);
 *  MACRO DEFINITIONS
 ***********************************************/
 
+// the nodes are <i.j>, the two bytes of their address, i and j below MAX_INDEX
 #define MIN_INDEX 0
+#ifndef MAX_INDEX
 #define MAX_INDEX 10
+#endif
+// longest id of a node <i.j> in the messages
+#define INDEX_DIGITS (MAX_INDEX > 100 ? 3 : (MAX_INDEX > 10 ? 2 : 1))
+#define ID_LEN (2 * INDEX_DIGITS + 1)
 // number of retransmissions in reliable unicast
 #define RETRANSMISSION 5
-// duration after which a node is considered as disconnected
-#define TIME_OUT 45
+// the DIO and DAO messages go every BEACON_PERIOD iterations of the main loop (6 to 12 s each): the relays
+// next to the root hear the DIO of all their neighbors, which costs them more than their own readings
+#ifndef BEACON_PERIOD
+#define BEACON_PERIOD 1
+#endif
+// duration after which a node is considered as disconnected: two beacons may be missed,
+// a gap of up to 36 s per iteration between the beacons
+#define TIME_OUT (45 * BEACON_PERIOD)
+// number of neighbors kept as backup parents
+#define NUM_NEIGHBORS 4
+// number of consecutive runicast timeouts after which the parent node is considered as lost
+#define MAX_TIMEOUTS 2
+// retransmissions of the readings: a reading which times out is not lost when a backup
+// parent takes over, so that the parent can be given up after a few seconds
+#define UPLINK_RETRANSMISSION 1
+// a rank from which a node has no route to the root: advertised by a node which lost its
+// parent (poisoning), or reached by counting up around a loop
+#define MAX_RANK 32
+// hops a reading may travel, a reading caught in a loop is dropped when they run out
+#define MAX_HOPS MAX_RANK
+// bytes after the end of a reading in a runicast packet: rank of the sender, hops left, flags
+#define UPLINK_TRAILER 3
+// flag of a reading which already went down the ranks once
+#define RANK_ERROR 0x01
+// minimum duration between two DIO messages triggered by a rank inconsistency
+#define DIO_GAP (CLOCK_SECOND * 2)
+
+// readings kept while the node has no parent: 0 -> in RAM | 1 -> in a file of the external flash (CFS)
+#ifndef STORE_CFS
+#define STORE_CFS 0
+#endif
+// capacity of the store in readings, the oldest one is overwritten when it is full
+#if STORE_CFS
+#define NUM_STORED_ENTRIES 256
+// file of the external flash holding the store
+#define STORE_FILE "store"
+#include "cfs/cfs.h"
+#else
+#define NUM_STORED_ENTRIES 16
+#endif
+// readings moved from the store to the uplink queue every STORE_DRAIN_TIME once we have a parent
+#define STORE_BATCH 2
+#define STORE_DRAIN_TIME CLOCK_SECOND
 // duration after which the node sends data -> when config = periodically
 #define DATA_TIME 30
+// bounds of the reporting intervals set by the gateway, in seconds. The main
+// loop wakes up every 6 to 12 seconds and a 16 bits clock_time_t holds 511 s
+#define MIN_DATA_TIME 10
+#define MAX_DATA_TIME 480
 
 #define NUM_HISTORY_ENTRIES 10
+// maximum number of readings waiting to be sent to the parent node
+#define NUM_UPLINK_ENTRIES 8
+// occupancy of the uplink queue of the parent (advertised in its DIO) from which it is congested
+#define CONGESTION_THRESHOLD (NUM_UPLINK_ENTRIES / 2)
+// gap between two packets sent to a congested parent, per reading in its queue
+#define PACE_TICKS (CLOCK_SECOND / 8)
+// maximum length of a reading in the uplink queue
+#define UPLINK_MSG_LEN 32
+// maximum number of commands waiting to be sent to the children nodes
+#define NUM_DOWNLINK_ENTRIES 4
+// maximum length of a command in the downlink queue
+#define DOWNLINK_MSG_LEN 100
+
+// uplink operating mode: 0 -> CSMA (send as soon as possible) | 1 -> scheduled slots, which only gate the
+// first transmission of a reading: retransmissions, ACKs, control and downlink traffic still use plain CSMA
+#ifndef SCHEDULED_MODE
+#define SCHEDULED_MODE 0
+#endif
+// maximum depth of the collection tree covered by the slot schedule
+#define MAX_DEPTH 5
+// duration of one slot in clock ticks
+#define SLOT_TICKS 4
+// one cell per (origin node, rank of the forwarder) pair
+#define SLOTFRAME_LENGTH (MAX_INDEX * MAX_INDEX * MAX_DEPTH)
+
+// trickle parameters of the dissemination of the network state:
+// smallest interval in clock ticks, number of doublings, redundancy constant
+#define TRICKLE_IMIN CLOCK_SECOND
+#define TRICKLE_IMAX 8
+#define TRICKLE_K 2
+// maximum length of a page of the network state <V version config [page] / subscriptions / aggregates / epochs>
+#define STATE_MSG_LEN 120
+// a page holds the subscriptions of STATE_PAGE_NODES nodes, a larger network has several pages,
+// each with its own version and trickle timer
+#define STATE_PAGE_NODES 100
+#define STATE_PAGES ((MAX_INDEX * MAX_INDEX + STATE_PAGE_NODES - 1) / STATE_PAGE_NODES)
+
+// a node of rank r sends the partial aggregate of an epoch AGG_SLOT * (AGG_DEPTH - r) after its end,
+// the partials of its children being merged by then
+#if SCHEDULED_MODE
+// a partial waits up to a slotframe for its cell, and climbs one rank per slotframe
+#define AGG_DEPTH MAX_DEPTH
+#define AGG_SLOT (2 * SLOTFRAME_LENGTH * SLOT_TICKS)
+#else
+#define AGG_DEPTH 8
+#define AGG_SLOT CLOCK_SECOND
+#endif
+// bounds of the epochs of the aggregate queries in seconds (set by the root node): an epoch outlasts
+// the climb of its partials, since a node holds one epoch at a time, and a 16 bits clock_time_t holds 511 s
+#define MIN_EPOCH ((AGG_DEPTH * AGG_SLOT) / CLOCK_SECOND + 2)
+#define MAX_EPOCH 400
+
+// downlink routing state: 0 -> one entry per descendant | 1 -> one Bloom filter per child
+#ifndef BLOOM_MODE
+#define BLOOM_MODE 0
+#endif
+// size of the Bloom filter of a subtree and number of hash functions
+#define BLOOM_BITS 128
+#define BLOOM_BYTES (BLOOM_BITS / 8)
+#define BLOOM_HASHES 3
+// maximum number of direct children in Bloom mode
+#define MAX_CHILDREN 8
+
+// downlink commands: 0 -> routed hop by hop with the children tables | 1 -> source routed by the root
+#ifndef SOURCE_ROUTING
+#define SOURCE_ROUTING 0
+#endif
+// period of the reports of our parent node to the root, in seconds
+#define ROUTE_TIME 90
+
+// parent selection: 0 -> shortest hop count | 1 -> lowest path cost, which adds up
+// the hops and the energy the relays lost, so that the traffic avoids the depleted nodes
+#ifndef ENERGY_ROUTING
+#define ENERGY_ROUTING 0
+#endif
+// raw readings of battery_sensor of a full and of an empty battery
+#define BATTERY_FULL 3000
+#define BATTERY_EMPTY 2200
+// the residual energy counts in levels, so that the noise of the readings does not move the routes
+#define ENERGY_LEVELS 8
+// cost of a hop through a full relay, and per level its battery lost: an empty relay costs 5 hops
+#define HOP_COST 10
+#define ENERGY_WEIGHT 5
+// a neighbor becomes our parent only if its path is cheaper than the one of our parent by more than this
+#define COST_HYSTERESIS 10
+
+// hierarchy: 0 -> flat tree | 1 -> two tiers, the cluster heads elected each round form the backbone
+// of the tree and pack the readings of their members, which keep no routing state and relay nothing
+#ifndef CLUSTER_MODE
+#define CLUSTER_MODE 0
+#endif
+#if CLUSTER_MODE
+#if SCHEDULED_MODE
+#error "CLUSTER_MODE needs the CSMA uplink, a packet of several readings has no cell"
+#endif
+// the tiers come from the path costs (see ENERGY_ROUTING)
+#undef ENERGY_ROUTING
+#define ENERGY_ROUTING 1
+// a cluster head holds the readings of its members until they fill packets
+#undef NUM_UPLINK_ENTRIES
+#define NUM_UPLINK_ENTRIES 12
+#endif
+// duration of a round of the election, in seconds of network time
+#define CLUSTER_ROUND 300
+// share of cluster heads in percent: a node is a head once in a cycle of 100 / CLUSTER_SHARE rounds
+#define CLUSTER_SHARE 20
+#define CLUSTER_CYCLE (100 / CLUSTER_SHARE)
+// extra cost of a hop through a member, so that a node picks a cluster head as parent when it hears one
+#define MEMBER_COST 60
+// a cluster head holds its oldest reading up to PACK_DELAY seconds, or until PACK_READINGS of them fill a packet
+#define PACK_DELAY 3
+#define PACK_READINGS 3
+// maximum length of a packet of readings <reading\nreading...>
+#define PACK_LEN 100
+
+// alert rules of the gateway, disseminated like the network state <K version / battery low / battery high /
+// temperature low / temperature high>, '*' for no bound; the channels with a rule are sampled every ALERT_SAMPLE
+#define RULES_MSG_LEN 40
+#define ALERT_SAMPLE (CLOCK_SECOND * 2)
+// an alert clears once the value is back ALERT_HYSTERESIS inside its bound (raw units, tenths of a degree)
+#define ALERT_HYSTERESIS 5
 
 #define DEBUG DEBUG_FULL
 
@@ -35,8 +209,17 @@ AUTOSTART_PROCESSES(&sensor_node_process);
 *  RIME ADDRESSES
 ***********************************************/
 
+#if BLOOM_MODE
+// a direct child and the Bloom filter of its subtree (itself included)
+struct child_entry {
+  linkaddr_t addr;
+  uint8_t filter[BLOOM_BYTES];
+};
+static struct child_entry children[MAX_CHILDREN];
+#else
 // array of all the child nodes
 static linkaddr_t children_nodes[MAX_INDEX][MAX_INDEX];
+#endif
 // reference to the parent node
 static linkaddr_t parent_node;
 // reference to this node
@@ -47,12 +230,42 @@ static linkaddr_t this_node;
 *  TIMERS
 ***********************************************/
 
+#if BLOOM_MODE
+// a timer associated to each direct child
+static struct timer children_timer[MAX_CHILDREN];
+#else
 // a timer associated to each child node
 static struct timer children_timer[MAX_INDEX][MAX_INDEX];
+#endif
 // a timer associated to the parent node
 static struct timer parent_timer;
 // a timer associated to the transmission of data
 static struct timer data_timer;
+// the battery readings have their own period, the temperature ones restart data_timer
+static struct timer battery_timer;
+// reporting intervals of the battery and temperature readings in seconds, set by the gateway
+static int battery_interval = DATA_TIME;
+static int temp_interval = DATA_TIME;
+// a timer associated to the reports of our parent node to the root
+static struct timer route_timer;
+// restarted at each DIO message, rate-limits the triggered ones
+static struct timer dio_timer;
+// iterations of the main loop until the next periodic DIO and DAO messages (BEACON_PERIOD)
+static int beacon = 0;
+// network time minus local time in ticks, taken from the DIO messages of our parent node
+static long time_offset = 0;
+// 1 once we follow the network time of the root node, 0 otherwise
+static int time_synced = 0;
+#if SCHEDULED_MODE
+// a timer that wakes the node up at its next uplink cell
+static struct ctimer cell_timer;
+#endif
+// a timer per page that paces the broadcasts of the network state
+static struct trickle_timer state_timer[STATE_PAGES];
+// the same for the alert rules, started with the first rules received
+static struct trickle_timer rules_timer;
+// a timer that samples the channels which have an alert rule
+static struct ctimer alert_timer;
 
 
 /********************************************//**
@@ -60,6 +273,7 @@ static struct timer data_timer;
 ***********************************************/
 
 static struct broadcast_conn broadcast;
+static struct broadcast_conn dissemination;
 static struct unicast_conn unicast;
 static struct runicast_conn runicast;
 
@@ -80,12 +294,69 @@ static int prev_bat = 0;
 // is there a subscriber for a given channel?: 0 -> no subscriber | 1 -> subscriber
 static int temp_subscriber = 0;
 static int bat_subscriber = 0;
+// the last pages of the network state received: configuration and subscriptions of all the nodes
+static char state_msg[STATE_PAGES][STATE_MSG_LEN];
+// version of each page of the network state, only valid once the page was received
+static uint8_t state_version[STATE_PAGES];
+static int has_state[STATE_PAGES];
+// the last alert rules received and their version, only valid once rules were received
+static char rules_msg[RULES_MSG_LEN];
+static uint8_t rules_version = 0;
+static int has_rules = 0;
+// bounds of the alerts on the battery (0) and the temperature (1), INT_MIN / INT_MAX for none
+static int alert_low[2] = {INT_MIN, INT_MIN};
+static int alert_high[2] = {INT_MAX, INT_MAX};
+// the bound crossed on each channel: L -> below its low bound | H -> above its high bound | N -> none
+static char alert_state[2] = {'N', 'N'};
+static char alert_msg[UPLINK_MSG_LEN];
 
 static char alive_msg[500];
-static char battery_msg[10];
-static char temp_msg[10];
-static char broadcast_msg[4];
-static char tmp[5];
+static char battery_msg[UPLINK_MSG_LEN];
+static char temp_msg[UPLINK_MSG_LEN];
+// sequence number of the next reading of each channel, the gateway detects the lost, duplicate and late readings.
+// 0 is only used by the first reading after a boot: it tells the gateway that the node starts its numbers again
+static uint8_t battery_seq = 0;
+static uint8_t temp_seq = 0;
+static char broadcast_msg[32];
+#if !BLOOM_MODE
+static char tmp[ID_LEN + 2];
+#endif
+// report of our parent node to the root <ID/R/parent ID/rank/link ETX/drops>, sent again as soon as the parent changes
+static char route_msg[UPLINK_MSG_LEN];
+static int route_changed = 0;
+// expected number of transmissions to our parent node in tenths (10 -> no retransmission)
+static int link_etx = 10;
+// readings dropped (queue full or timed out) since the last report to the root
+static int uplink_drops = 0;
+// occupancy of the uplink queue of our parent node, as advertised in its last DIO
+static int parent_queue = 0;
+// cost of the path of our parent node to the root, as advertised in its last DIO (ENERGY_ROUTING)
+static int parent_cost = 0;
+// consecutive runicast timeouts of the readings sent to our parent node
+static int parent_timeouts = 0;
+#if CLUSTER_MODE
+// 1 if we are a cluster head, as every node until the first election
+static int cluster_head = 1;
+// the round of our last election, and the cycle in which we were a head last
+static unsigned long cluster_round = 0;
+static unsigned long head_cycle = ULONG_MAX;
+// 1 if we heard a cluster head with a route during the round
+static int heard_head = 0;
+// wakes a cluster head up when the oldest of its held readings is due
+static struct ctimer pack_timer;
+#endif
+
+// a neighbor heard in a DIO, a backup parent as long as its timer runs
+struct neighbor_entry {
+  linkaddr_t addr;
+  int rank;
+  // cost of its path to the root (ENERGY_ROUTING)
+  int cost;
+  struct timer timer;
+};
+static struct neighbor_entry neighbors[NUM_NEIGHBORS];
+// while it runs, no reading is sent to our congested parent node
+static struct ctimer pace_timer;
 
 
 
@@ -97,10 +368,705 @@ struct history_entry {
 LIST(history_table);
 MEMB(history_mem, struct history_entry, NUM_HISTORY_ENTRIES);
 
+// readings and alerts (own and forwarded) waiting to be sent to the parent node
+struct uplink_entry {
+  struct uplink_entry *next;
+  char msg[UPLINK_MSG_LEN];
+  // hops left and flags, sent after the reading (see UPLINK_TRAILER)
+  uint8_t hops;
+  uint8_t flags;
+  // time at which the reading was taken, in seconds of our clock
+  unsigned long created;
+};
+LIST(uplink_queue);
+MEMB(uplink_mem, struct uplink_entry, NUM_UPLINK_ENTRIES);
+// the entry currently being transmitted via runicast
+static struct uplink_entry *uplink_inflight = NULL;
+// number of entries sent in its packet, the next ones of the queue share it in CLUSTER_MODE
+static int uplink_batch = 0;
+
+// a reading kept while the node has no parent node
+struct stored_reading {
+  char msg[UPLINK_MSG_LEN];
+  unsigned long created;
+  uint8_t hops;
+  uint8_t flags;
+};
+#if !STORE_CFS
+static struct stored_reading stored[NUM_STORED_ENTRIES];
+#endif
+// the store is a ring of NUM_STORED_ENTRIES slots, in RAM or in STORE_FILE
+static int stored_first = 0;
+static int stored_count = 0;
+static struct ctimer store_timer;
+
+// commands waiting to be forwarded to the children nodes
+struct downlink_entry {
+  struct downlink_entry *next;
+  linkaddr_t to;
+  char msg[DOWNLINK_MSG_LEN];
+};
+LIST(downlink_queue);
+MEMB(downlink_mem, struct downlink_entry, NUM_DOWNLINK_ENTRIES);
+// the entry currently being transmitted via runicast
+static struct downlink_entry *downlink_inflight = NULL;
+
+// partial aggregate of the current epoch of the aggregate query on a channel
+struct aggregate {
+  // duration of an epoch in seconds, 0 if there is no query on the channel
+  int epoch;
+  // 1 if our readings are part of the query, 0 if we only merge the partials of our subtree
+  int member;
+  // number of the epoch, modulo 256
+  uint8_t number;
+  int count;
+  long sum;
+  int min;
+  int max;
+  // set to our slot after the end of the epoch
+  struct ctimer timer;
+};
+// the aggregate queries on the battery (0) and the temperature (1)
+static struct aggregate aggregates[2];
+
+#if SCHEDULED_MODE
+// local time at which the current slotframe started
+static clock_time_t slotframe_start = 0;
+#endif
+
 /********************************************//**
 *  Function definitions
 ***********************************************/
 
+/**
+* Reads the id of a node at the start of a message, each index in decimal
+* @ param  msg   : the message <i.j...>
+* @ param  i, j  : the indices of the node
+* @ return the length of the id, 0 if the message does not start with a valid id
+*/
+static int parse_id(const char *msg, int *i, int *j) {
+  int n = 0, k;
+  for(k = 0; k < 2; k++) {
+    int index = 0, start = n;
+    while(msg[n] >= '0' && msg[n] <= '9' && n - start < INDEX_DIGITS) {
+      index = index * 10 + msg[n++] - '0';
+    }
+    if(n == start || index >= MAX_INDEX || (k == 0 && msg[n++] != '.')) {
+      return 0;
+    }
+    *(k == 0 ? i : j) = index;
+  }
+  return n;
+}
+
+/**
+* @ param  msg  : a message of a node <ID/type...>
+* @ return the type of the message, 0 if it does not start with the id of a node
+*/
+static char message_type(const char *msg) {
+  int i, j, n = parse_id(msg, &i, &j);
+  return n > 0 && msg[n] == '/' ? msg[n + 1] : 0;
+}
+
+#if SCHEDULED_MODE
+/**
+* Returns the index of the node that produced a reading, the reading
+* starting with the id of the sensor node <i.j/...>
+* @ param  msg  : the reading
+* @ return the index of the origin node in the children_nodes array, -1 if the id is wrong
+*/
+static int uplink_origin(const char *msg) {
+  int i, j;
+  return parse_id(msg, &i, &j) > 0 ? i * MAX_INDEX + j : -1;
+}
+#endif
+
+/**
+* Returns the local time in ticks: clock_time() wraps after 511 seconds,
+* so the ticks of the current second are added to clock_seconds()
+* @ param  /
+* @ return the ticks since boot
+*/
+static unsigned long local_time(void) {
+  return clock_seconds() * CLOCK_SECOND + clock_time() % CLOCK_SECOND;
+}
+
+/**
+* @ param  msg  : a message of the uplink queue
+* @ return 1 if the message is a reading <ID/channel/data/seq[/time]>, 0 for the other reports
+*/
+static int is_reading(const char *msg) {
+  char type = message_type(msg);
+  return type == 'B' || type == 'T';
+}
+
+/**
+* @ param  msg  : a message of the uplink queue
+* @ return 1 if the message is an alert <ID/!channel/bound/value[/time]>, 0 otherwise
+*/
+static int is_alert(const char *msg) {
+  return message_type(msg) == '!';
+}
+
+/**
+* @ param  msg  : a reading
+* @ return 1 if the reading carries the network time at which it was taken, 0 otherwise
+*/
+static int is_stamped(const char *msg) {
+  int fields = 0;
+  for(; *msg != '\0'; msg++) {
+    fields += *msg == '/';
+  }
+  return fields >= 4;
+}
+
+/**
+* Writes the message of an entry of the uplink queue as it is sent
+* @ param  e    : the entry
+* @ param  out  : where to write it, UPLINK_MSG_LEN + 8 bytes
+* @ return the length of the message, without its '\0'
+*/
+static int uplink_format(struct uplink_entry *e, char *out) {
+  // the first synchronized node which handles a reading or an alert stamps it with the
+  // network time at which it got it, in seconds modulo 2^16 <ID/channel/data/seq/time>
+  if(time_synced != 0 && (is_reading(e->msg) || is_alert(e->msg)) && !is_stamped(e->msg)) {
+    unsigned long taken = (e->created * CLOCK_SECOND + time_offset) / CLOCK_SECOND;
+    return sprintf(out, "%s/%u", e->msg, (unsigned int)(taken & 0xFFFF));
+  }
+  strcpy(out, e->msg);
+  return strlen(out);
+}
+
+/**
+* Sends an entry of the uplink queue to the parent node via runicast.
+* The entry stays in the queue until runicast reports it as sent or
+* timed out. In CLUSTER_MODE, the readings which follow it in the queue
+* share its packet <reading\nreading...>
+* @ param  e  : the entry to send
+* @ return /
+*/
+static void uplink_send_entry(struct uplink_entry *e) {
+#if CLUSTER_MODE
+  char packet[PACK_LEN + UPLINK_TRAILER];
+#else
+  char packet[UPLINK_MSG_LEN + 8 + UPLINK_TRAILER];
+#endif
+  int len = uplink_format(e, packet);
+  uint8_t hops = e->hops;
+  uint8_t flags = e->flags;
+  uplink_batch = 1;
+#if CLUSTER_MODE
+  struct uplink_entry *n;
+  for(n = e->next; n != NULL && is_reading(e->msg) && is_reading(n->msg) && len + UPLINK_MSG_LEN + 9 < PACK_LEN; n = n->next) {
+    packet[len++] = '\n';
+    len += uplink_format(n, &packet[len]);
+    // the packet goes as far as its most travelled reading
+    hops = n->hops < hops ? n->hops : hops;
+    flags |= n->flags;
+    uplink_batch++;
+  }
+#endif
+  len++;
+  packet[len] = this_rank < MAX_RANK ? this_rank : MAX_RANK;
+  packet[len + 1] = hops;
+  packet[len + 2] = flags;
+  uplink_inflight = e;
+  packetbuf_clear();
+  packetbuf_copyfrom(packet, len + UPLINK_TRAILER);
+  runicast_send(&runicast, &parent_node, UPLINK_RETRANSMISSION);
+}
+
+#if CLUSTER_MODE
+static void pace_callback(void *ptr);
+
+/**
+* Checks whether a cluster head holds its readings, so that the ones of
+* its members share their packets: until PACK_READINGS entries are queued
+* or the oldest reading waited PACK_DELAY seconds
+* @ param  e  : the oldest entry of the uplink queue
+* @ return 1 if the readings wait, 0 otherwise
+*/
+static int pack_wait(struct uplink_entry *e) {
+  unsigned long age = clock_seconds() - e->created;
+  if(cluster_head == 0 || !is_reading(e->msg) || list_length(uplink_queue) >= PACK_READINGS || age >= PACK_DELAY) {
+    return 0;
+  }
+  ctimer_set(&pack_timer, (PACK_DELAY - age) * CLOCK_SECOND, pace_callback, NULL);
+  return 1;
+}
+#endif
+
+/**
+* Sends the oldest command of the downlink queue, or else the oldest
+* reading of the uplink queue, if runicast is not busy. In scheduled
+* mode, readings are only sent in the cells of the node (see cell_callback).
+* An alert does not wait for the pacing towards a congested parent node
+* @ param  /
+* @ return /
+*/
+static void runicast_drain(void) {
+  if(uplink_inflight != NULL || downlink_inflight != NULL || runicast_is_transmitting(&runicast)) {
+    return;
+  }
+  struct downlink_entry *d = list_head(downlink_queue);
+  if(d != NULL) {
+    downlink_inflight = d;
+    packetbuf_clear();
+    packetbuf_copyfrom(d->msg, strlen(d->msg) + 1);
+    runicast_send(&runicast, &d->to, RETRANSMISSION);
+    return;
+  }
+#if !SCHEDULED_MODE
+  struct uplink_entry *e = list_head(uplink_queue);
+#if CLUSTER_MODE
+  if(e != NULL && pack_wait(e) != 0) {
+    return;
+  }
+#endif
+  if(e != NULL && has_parent != 0 && (ctimer_expired(&pace_timer) || is_alert(e->msg))) {
+    uplink_send_entry(e);
+  }
+#endif
+}
+
+/**
+* Called when the pacing gap towards our congested parent node is over,
+* or when the readings held by a cluster head are due (CLUSTER_MODE)
+* @ param  ptr  : /
+* @ return /
+*/
+static void pace_callback(void *ptr) {
+  runicast_drain();
+}
+
+/**
+* Checks whether our own readings must wait: the parent node is congested
+* and our queue is already half full with the readings of the subtree,
+* which have travelled further than ours
+* @ param  /
+* @ return 1 if our own readings must wait, 0 otherwise
+*/
+static int hold_readings(void) {
+  return parent_queue >= CONGESTION_THRESHOLD && list_length(uplink_queue) >= NUM_UPLINK_ENTRIES / 2;
+}
+
+/**
+* @ param  e  : an entry of the uplink queue
+* @ return 1 if the entry is part of the packet in flight, 0 otherwise
+*/
+static int uplink_in_flight(struct uplink_entry *e) {
+  struct uplink_entry *f = uplink_inflight;
+  int i;
+  for(i = 0; i < uplink_batch && f != NULL; i++, f = f->next) {
+    if(f == e) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+* Queues a reading for transmission to the parent node.
+* The reading is dropped if the queue is full. An alert is queued
+* ahead of the readings, behind the packet in flight and the older
+* alerts, and takes the entry of the newest reading or report if the queue is full
+* @ param  msg      : the reading with format <ID/channel/data/seq>
+* @ param  hops     : the hops left to the reading
+* @ param  flags    : the flags of the reading (RANK_ERROR)
+* @ param  created  : the time at which the reading was taken
+* @ return 1 if the reading was queued, 0 otherwise
+*/
+static int enqueue_uplink(const char *msg, uint8_t hops, uint8_t flags, unsigned long created) {
+  struct uplink_entry *e = memb_alloc(&uplink_mem);
+  struct uplink_entry *r, *prev = NULL;
+  if(e == NULL && is_alert(msg)) {
+    for(r = list_head(uplink_queue); r != NULL; r = r->next) {
+      if(!is_alert(r->msg) && !uplink_in_flight(r)) {
+        e = r;
+      }
+    }
+    if(e != NULL) {
+      list_remove(uplink_queue, e);
+      uplink_drops++;
+    }
+  }
+  if(e == NULL) {
+    uplink_drops++;
+    return 0;
+  }
+  strncpy(e->msg, msg, UPLINK_MSG_LEN - 1);
+  e->msg[UPLINK_MSG_LEN - 1] = '\0';
+  e->hops = hops;
+  e->flags = flags;
+  e->created = created;
+  if(is_alert(msg)) {
+    for(r = list_head(uplink_queue); r != NULL && (is_alert(r->msg) || uplink_in_flight(r)); r = r->next) {
+      prev = r;
+    }
+    list_insert(uplink_queue, prev, e);
+  }
+  else {
+    list_add(uplink_queue, e);
+  }
+  runicast_drain();
+  return 1;
+}
+
+/**
+* Reads or writes a slot of the store
+* @ param  slot   : the index of the slot
+* @ param  r      : the reading to write, or where to read the slot
+* @ param  write  : 1 -> write | 0 -> read
+* @ return /
+*/
+static void store_slot(int slot, struct stored_reading *r, int write) {
+#if STORE_CFS
+  int fd = cfs_open(STORE_FILE, CFS_READ | CFS_WRITE);
+  if(fd < 0 || cfs_seek(fd, (cfs_offset_t) slot * sizeof(struct stored_reading), CFS_SEEK_SET) < 0) {
+    r->msg[0] = '\0';
+  }
+  else if(write) {
+    cfs_write(fd, r, sizeof(struct stored_reading));
+  }
+  else if(cfs_read(fd, r, sizeof(struct stored_reading)) != sizeof(struct stored_reading)) {
+    r->msg[0] = '\0';
+  }
+  if(fd >= 0) {
+    cfs_close(fd);
+  }
+#else
+  if(write) {
+    stored[slot] = *r;
+  }
+  else {
+    *r = stored[slot];
+  }
+#endif
+}
+
+/**
+* Keeps a reading in the store while we have no parent node. When the
+* store is full, the oldest reading is overwritten
+* @ param  msg      : the reading with format <ID/channel/data/seq>
+* @ param  hops     : the hops left to the reading
+* @ param  flags    : the flags of the reading
+* @ param  created  : the time at which the reading was taken
+* @ return /
+*/
+static void store_reading(const char *msg, uint8_t hops, uint8_t flags, unsigned long created) {
+  struct stored_reading r;
+  strncpy(r.msg, msg, UPLINK_MSG_LEN - 1);
+  r.msg[UPLINK_MSG_LEN - 1] = '\0';
+  r.hops = hops;
+  r.flags = flags;
+  r.created = created;
+  if(stored_count == NUM_STORED_ENTRIES) {
+    stored_first = (stored_first + 1) % NUM_STORED_ENTRIES;
+    stored_count--;
+    uplink_drops++;
+  }
+  store_slot((stored_first + stored_count) % NUM_STORED_ENTRIES, &r, 1);
+  stored_count++;
+}
+
+/**
+* Moves the oldest readings of the store to the uplink queue, by batches
+* of STORE_BATCH every STORE_DRAIN_TIME and only while the queue is less
+* than half full, so that the fresh readings still get through
+* @ param  ptr  : /
+* @ return /
+*/
+static void store_drain(void *ptr) {
+  struct stored_reading r;
+  int n;
+  for(n = 0; n < STORE_BATCH && stored_count > 0 && has_parent != 0 && list_length(uplink_queue) < NUM_UPLINK_ENTRIES / 2; n++) {
+    store_slot(stored_first, &r, 0);
+    if(r.msg[0] != '\0' && enqueue_uplink(r.msg, r.hops, r.flags, r.created) == 0) {
+      break;
+    }
+    stored_first = (stored_first + 1) % NUM_STORED_ENTRIES;
+    stored_count--;
+  }
+  if(stored_count > 0 && has_parent != 0) {
+    ctimer_set(&store_timer, STORE_DRAIN_TIME, store_drain, NULL);
+  }
+}
+
+/**
+* Queues a forwarded reading for transmission to the parent node, or keeps
+* it in the store while we have no parent node. The reports other than
+* readings and alerts are dropped then, they will be sent again
+* @ param  msg    : the reading with format <ID/channel/data/seq[/time]>
+* @ param  hops   : the hops left to the reading
+* @ param  flags  : the flags of the reading (RANK_ERROR)
+* @ return 1 if the reading was queued or stored, 0 otherwise
+*/
+static int forward_uplink(const char *msg, uint8_t hops, uint8_t flags) {
+  unsigned long created = clock_seconds();
+  if(has_parent == 0) {
+    if(is_reading(msg) || is_alert(msg)) {
+      store_reading(msg, hops, flags, created);
+      return 1;
+    }
+    return 0;
+  }
+  return enqueue_uplink(msg, hops, flags, created);
+}
+
+/**
+* Queues one of our readings for transmission to the parent node.
+* The reading is dropped if the queue is full
+* @ param  msg  : the reading with format <ID/channel/data/seq>
+* @ return 1 if the reading was queued, 0 otherwise
+*/
+static int send_uplink(const char *msg) {
+  return forward_uplink(msg, MAX_HOPS, 0);
+}
+
+/**
+* Queues a command for transmission to a child node.
+* The command is dropped if the queue is full
+* @ param  to   : the child node
+* @ param  msg  : the command
+* @ return 1 if the command was queued, 0 otherwise
+*/
+static int send_downlink(const linkaddr_t *to, const char *msg) {
+  struct downlink_entry *e = memb_alloc(&downlink_mem);
+  if(e == NULL) {
+    return 0;
+  }
+  linkaddr_copy(&e->to, to);
+  strncpy(e->msg, msg, DOWNLINK_MSG_LEN - 1);
+  e->msg[DOWNLINK_MSG_LEN - 1] = '\0';
+  list_add(downlink_queue, e);
+  runicast_drain();
+  return 1;
+}
+
+#if BLOOM_MODE
+/**
+* Returns the position of the bit of a node for one of the hash functions
+* of the Bloom filters
+* @ param  index  : the index of the node (i * MAX_INDEX + j)
+* @ param  k      : the hash function, from 0 to BLOOM_HASHES - 1
+* @ return the position of the bit in the filter
+*/
+static int bloom_bit(int index, int k) {
+  uint32_t h = (uint32_t)(index + 1) * 2654435761UL;
+  return (h >> (7 * k)) & (BLOOM_BITS - 1);
+}
+
+/**
+* Adds a node to a Bloom filter
+* @ param  filter  : the filter
+* @ param  index   : the index of the node
+* @ return /
+*/
+static void bloom_add(uint8_t *filter, int index) {
+  int k;
+  for(k = 0; k < BLOOM_HASHES; k++) {
+    int bit = bloom_bit(index, k);
+    filter[bit / 8] |= 1 << (bit % 8);
+  }
+}
+
+/**
+* Checks if a node may be in a Bloom filter
+* @ param  filter  : the filter
+* @ param  index   : the index of the node
+* @ return 1 if the node may be in the filter, 0 if it is not
+*/
+static int bloom_contains(const uint8_t *filter, int index) {
+  int k;
+  for(k = 0; k < BLOOM_HASHES; k++) {
+    int bit = bloom_bit(index, k);
+    if((filter[bit / 8] & (1 << (bit % 8))) == 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/**
+* Records the Bloom filter advertised by a child in its DAO. A new child
+* takes a free entry, it is ignored if there is none
+* @ param  from  : the child
+* @ param  hex   : the filter in hexadecimal
+* @ return /
+*/
+static void add_child(const linkaddr_t *from, const char *hex) {
+  int i, k, slot = -1;
+  for(i = 0; i < MAX_CHILDREN; i++) {
+    if(linkaddr_cmp(&children[i].addr, from) != 0) {
+      slot = i;
+      break;
+    }
+    if(slot < 0 && linkaddr_cmp(&children[i].addr, &linkaddr_null) != 0) {
+      slot = i;
+    }
+  }
+  if(slot < 0) {
+    return;
+  }
+  linkaddr_copy(&children[slot].addr, from);
+  for(k = 0; k < BLOOM_BYTES && hex[2 * k] != '\0' && hex[2 * k + 1] != '\0'; k++) {
+    char byte[3] = {hex[2 * k], hex[2 * k + 1], '\0'};
+    children[slot].filter[k] = strtol(byte, NULL, 16);
+  }
+  timer_restart(&children_timer[slot]);
+}
+#endif
+
+#if SCHEDULED_MODE || !BLOOM_MODE
+/**
+* Checks if a node can be reached through one of our children. In Bloom
+* mode, the answer may be a false positive
+* @ param  i, j  : the indices of the node
+* @ return 1 if the node is in our subtree, 0 otherwise
+*/
+static int in_subtree(int i, int j) {
+#if BLOOM_MODE
+  int c;
+  for(c = 0; c < MAX_CHILDREN; c++) {
+    if(linkaddr_cmp(&children[c].addr, &linkaddr_null) == 0 && bloom_contains(children[c].filter, i * MAX_INDEX + j)) {
+      return 1;
+    }
+  }
+  return 0;
+#else
+  return linkaddr_cmp(&(children_nodes[i][j]), &linkaddr_null) == 0;
+#endif
+}
+#endif
+
+/**
+* Forwards a command to the child leading to its target node. In Bloom
+* mode, the command is sent to every child whose filter matches, so that a
+* false positive only costs a detour: the wrong subtree drops the command
+* once no filter matches any more
+* @ param  i, j  : the indices of the target node
+* @ param  msg   : the command
+* @ return /
+*/
+static void route_downlink(int i, int j, const char *msg) {
+#if BLOOM_MODE
+  int c;
+  for(c = 0; c < MAX_CHILDREN; c++) {
+    if(linkaddr_cmp(&children[c].addr, &linkaddr_null) == 0 && bloom_contains(children[c].filter, i * MAX_INDEX + j)) {
+      send_downlink(&children[c].addr, msg);
+    }
+  }
+#else
+  if(in_subtree(i, j)) {
+    send_downlink(&children_nodes[i][j], msg);
+  }
+#endif
+}
+
+#if SCHEDULED_MODE
+/**
+* Returns the number of clock ticks elapsed since the start of the current
+* slotframe. The start of the slotframe is moved forward so that it never
+* lags more than one slotframe behind the clock
+* @ param  /
+* @ return the elapsed ticks in the current slotframe
+*/
+static clock_time_t slotframe_elapsed(void) {
+  clock_time_t now = clock_time();
+  while((clock_time_t)(now - slotframe_start) >= SLOTFRAME_LENGTH * SLOT_TICKS) {
+    slotframe_start += SLOTFRAME_LENGTH * SLOT_TICKS;
+  }
+  return now - slotframe_start;
+}
+
+static void cell_callback(void *ptr);
+
+/**
+* Sets the cell timer to the next cell of this node. A node owns one cell
+* per node of its subtree (itself included). The cell of origin o is
+* o * MAX_DEPTH + (MAX_DEPTH - rank), so that a reading climbs one rank
+* per slot, or waits a slotframe when it misses its cell. Two nodes never start a reading in the same cell, since only
+* one node of each rank forwards the readings of a given origin; the other
+* traffic is not scheduled and may still collide with it
+* @ param  /
+* @ return /
+*/
+static void schedule_next_cell(void) {
+  clock_time_t elapsed = slotframe_elapsed();
+  int slot = elapsed / SLOT_TICKS;
+  // nodes deeper than MAX_DEPTH share the first cell of each origin
+  int offset = this_rank <= MAX_DEPTH ? MAX_DEPTH - this_rank : 0;
+  int distance = SLOTFRAME_LENGTH;
+  int i, j;
+  for(i = 0; i < MAX_INDEX; i++) {
+    for(j = 0; j < MAX_INDEX; j++) {
+      // we own the cells of the nodes of our subtree
+      if(has_parent != 0 && ((this_node.u8[0] == i && this_node.u8[1] == j) || in_subtree(i, j))) {
+        int d = ((i * MAX_INDEX + j) * MAX_DEPTH + offset - slot + SLOTFRAME_LENGTH) % SLOTFRAME_LENGTH;
+        if(d != 0 && d < distance) {
+          distance = d;
+        }
+      }
+    }
+  }
+  ctimer_set(&cell_timer, (slot + distance) * SLOT_TICKS - elapsed, cell_callback, NULL);
+}
+
+/**
+* Called at the beginning of each cell of this node. Sends the oldest
+* queued reading of the origin owning the cell. In our own cell, any
+* reading can be sent so that readings of nodes that left our subtree
+* are not stuck in the queue. An alert, queued ahead of the readings,
+* goes in any of our cells
+* @ param  ptr  : unused
+* @ return /
+*/
+static void cell_callback(void *ptr) {
+  int origin = (slotframe_elapsed() / SLOT_TICKS) / MAX_DEPTH;
+  int self = this_node.u8[0] * MAX_INDEX + this_node.u8[1];
+  struct uplink_entry *e;
+
+  if(has_parent != 0 && uplink_inflight == NULL && downlink_inflight == NULL && !runicast_is_transmitting(&runicast)) {
+    e = list_head(uplink_queue);
+    if(e != NULL && !is_alert(e->msg)) {
+      for(; e != NULL; e = e->next) {
+        if(uplink_origin(e->msg) == origin) {
+          break;
+        }
+      }
+    }
+    if(e == NULL && origin == self) {
+      e = list_head(uplink_queue);
+    }
+    if(e != NULL) {
+      uplink_send_entry(e);
+    }
+  }
+  schedule_next_cell();
+}
+
+/**
+* Aligns the slotframe of this node on the slotframe of its parent node
+* @ param  offset  : the elapsed ticks in the slotframe of the parent node
+* @ return /
+*/
+static void align_slotframe(clock_time_t offset) {
+  slotframe_start = clock_time() - offset;
+  schedule_next_cell();
+}
+#endif
+
+/**
+* Takes the sequence number of the next reading of a channel, from 1 to 255 after the first one
+* @ param  seq  : the sequence number of the channel
+* @ return the sequence number of the reading
+*/
+static uint8_t next_seq(uint8_t *seq) {
+  uint8_t current = *seq;
+  *seq = current == 255 ? 1 : current + 1;
+  return current;
+}
+
 /**
 * Sends battery data to the parent node if there is at least
 * one subscriber for this channel and if the current configuration
@@ -108,96 +1074,361 @@ MEMB(history_mem, struct history_entry, NUM_HISTORY_ENTRIES);
 * @ param  config  : the current configuration
 * @ return /
 */
-static void send_battery(char config) {
-  // There is at least one subscriber to the channel -> otherwise we don't send data
-  if(bat_subscriber != 0 ) {
+static void send_battery(char config) {
+  // There is at least one subscriber to the channel -> otherwise we don't send data
+  // (backpressure: the reading waits for the next iteration while our parent node is congested)
+  if(bat_subscriber != 0 && hold_readings() == 0) {
+
+    int x = battery_sensor.value(0);
+
+    // configuration is set to send periodically
+    if(config == 'P') {
+      // only send if the timer expired
+      if(timer_expired(&battery_timer)) {
+        // create message with format <ID/channel/data/seq>
+        sprintf(battery_msg, "%d.%d/B/%d/%u", this_node.u8[0], this_node.u8[1], x, next_seq(&battery_seq));
+        // queue message for the parent node
+        send_uplink(battery_msg);
+        timer_restart(&battery_timer);
+      }
+    }
+    // configuration -> send on change
+    else {
+      // send only if temperature changed
+      if(x != prev_bat) {
+        // update previous battery values
+        prev_bat = x;
+        // create message with format <ID/channel/data/seq>
+        sprintf(battery_msg, "%d.%d/B/%d/%u", this_node.u8[0], this_node.u8[1], x, next_seq(&battery_seq));
+        // queue message for the parent node
+        send_uplink(battery_msg);
+      }
+    }
+  }
+}
+
+
+/**
+* Sends temperature data to the parent node if there is at least
+* one subscriber for this channel and if the current configuration
+* is respected
+* @ param  config  : the current configuration
+* @ return /
+*/
+static void send_temperature(char config) {
+
+  // There is at least one subscriber to the channel -> otherwise we don't send data
+  // (backpressure: the reading waits for the next iteration while our parent node is congested)
+  if(temp_subscriber != 0 && hold_readings() == 0) {
+    // get temperature value
+    unsigned int temp = temperature_sensor.value(0);
+    int first_digit = temp/10;
+    int second_digit = temp - (temp/10)*10;
+    // configuration is set to send periodically
+    if(config == 'P') {
+      // only send if the timer expired
+      if(timer_expired(&data_timer)) {
+        // create message with format <ID/channel/data/seq>
+        sprintf(temp_msg, "%d.%d/T/%d.%d/%u", this_node.u8[0], this_node.u8[1], first_digit, second_digit, next_seq(&temp_seq));
+        // queue message for the parent node
+        send_uplink(temp_msg);
+        timer_restart(&data_timer);
+      }
+    }
+    // configuration -> send on change
+    else {
+      // send only if temperature changed
+      if(first_digit != prev_temp[0] || second_digit != prev_temp[1]) {
+        // set previous temperature to current temperature
+        prev_temp[0] = first_digit;
+        prev_temp[1] = second_digit;
+        // create message with format <ID/channel/data/seq>
+        sprintf(temp_msg, "%d.%d/T/%d.%d/%u", linkaddr_node_addr.u8[0], linkaddr_node_addr.u8[1], first_digit, second_digit, next_seq(&temp_seq));
+        // queue message for the parent node
+        send_uplink(temp_msg);
+      }
+    }
+  }
+}
+
+/**
+* Samples the channels which have an alert rule. An alert is sent as soon
+* as the value crosses a bound of the rule, whatever the subscriptions and
+* the reporting period, and again once the value is back ALERT_HYSTERESIS
+* inside the bound <ID/!channel/L|H|N/value>
+* @ param  ptr  : unused
+* @ return /
+*/
+static void alert_callback(void *ptr) {
+  int c, sampled = 0;
+  for(c = 0; c < 2; c++) {
+    if(alert_low[c] == INT_MIN && alert_high[c] == INT_MAX && alert_state[c] == 'N') {
+      continue;
+    }
+    int value = c == 0 ? battery_sensor.value(0) : (int) temperature_sensor.value(0);
+    char state = alert_state[c];
+    if(value < alert_low[c]) {
+      state = 'L';
+    }
+    else if(value > alert_high[c]) {
+      state = 'H';
+    }
+    else if((state == 'L' && value >= alert_low[c] + ALERT_HYSTERESIS) || (state == 'H' && value <= alert_high[c] - ALERT_HYSTERESIS)) {
+      state = 'N';
+    }
+    if(state != alert_state[c]) {
+      alert_state[c] = state;
+      if(c == 0) {
+        sprintf(alert_msg, "%d.%d/!B/%c/%d", this_node.u8[0], this_node.u8[1], state, value);
+      }
+      else {
+        sprintf(alert_msg, "%d.%d/!T/%c/%d.%d", this_node.u8[0], this_node.u8[1], state, value / 10, value % 10);
+      }
+      send_uplink(alert_msg);
+    }
+    sampled |= alert_low[c] != INT_MIN || alert_high[c] != INT_MAX;
+  }
+  if(sampled != 0) {
+    ctimer_set(&alert_timer, ALERT_SAMPLE, alert_callback, NULL);
+  }
+}
+
+#if ENERGY_ROUTING
+/**
+* Returns the residual energy of our battery
+* @ param  /
+* @ return the level, from 0 (empty) to ENERGY_LEVELS (full)
+*/
+static int energy_level(void) {
+  int level = (battery_sensor.value(0) - BATTERY_EMPTY) * ENERGY_LEVELS / (BATTERY_FULL - BATTERY_EMPTY);
+  if(level < 0) {
+    level = 0;
+  }
+  else if(level > ENERGY_LEVELS) {
+    level = ENERGY_LEVELS;
+  }
+  return level;
+}
+
+/**
+* Returns the cost of the hop through this node: HOP_COST, and ENERGY_WEIGHT
+* for each level of energy our battery lost. A member adds MEMBER_COST
+* @ param  /
+* @ return the cost
+*/
+static int hop_cost(void) {
+  int cost = HOP_COST + (ENERGY_LEVELS - energy_level()) * ENERGY_WEIGHT;
+#if CLUSTER_MODE
+  if(cluster_head == 0) {
+    cost += MEMBER_COST;
+  }
+#endif
+  return cost;
+}
+#endif
+
+#if CLUSTER_MODE
+/**
+* Elects our role once per round of the network time. As in LEACH, a node
+* which was no head yet in the current cycle of CLUSTER_CYCLE rounds becomes
+* one with a probability growing along the cycle, so that each node takes its
+* turn, here weighted by our residual energy so that the depleted nodes leave
+* the backbone to the others. A member which heard no cluster head with a
+* route during the round becomes one, so that no node is left without a head
+* @ param  /
+* @ return /
+*/
+static void cluster_elect(void) {
+  unsigned long round = (local_time() + time_offset) / CLOCK_SECOND / CLUSTER_ROUND;
+  if(time_synced == 0 || round == cluster_round) {
+    return;
+  }
+  unsigned long cycle = round / CLUSTER_CYCLE;
+  int head = 0;
+  if(cluster_head == 0 && heard_head == 0) {
+    head = 1;
+  }
+  else if(head_cycle != cycle) {
+    // threshold of LEACH in percent: P / (1 - P * (round mod 1/P)), 100 in the last round of the cycle
+    int threshold = 100 * CLUSTER_SHARE / (100 - CLUSTER_SHARE * (int)(round % CLUSTER_CYCLE));
+    head = random_rand() % (100 * ENERGY_LEVELS) < threshold * energy_level();
+  }
+  if(head != 0) {
+    head_cycle = cycle;
+  }
+  cluster_head = head;
+  cluster_round = round;
+  heard_head = 0;
+}
+
+/**
+* Makes us a cluster head until the next round when a node takes us as its
+* parent, which only happens when it has no head in reach. The members then
+* keep no entry for other nodes and relay nothing. It counts as our turn of
+* the cycle
+* @ param  /
+* @ return /
+*/
+static void cluster_adopt(void) {
+  if(cluster_head == 0) {
+    cluster_head = 1;
+    head_cycle = cluster_round / CLUSTER_CYCLE;
+  }
+}
+#endif
+
+/**
+* Broadcasts our DIO message <O rank config queue>. A node without parent
+* advertises MAX_RANK, so that its children give it up at once
+* @ param  /
+* @ return /
+*/
+static void send_dio(void) {
+  int rank = has_parent != 0 ? this_rank : MAX_RANK;
+  packetbuf_clear();
+  // message contains the message identififer, the current rank, the current configuration and the occupancy of our queue,
+  // one digit
+  int queue = list_length(uplink_queue);
+  int len = sprintf(broadcast_msg, "O%d%c%d", rank, config, queue > 9 ? 9 : queue);
+  // then the network time in ticks, once we follow it <@time>
+  if(time_synced != 0) {
+    len += sprintf(&broadcast_msg[len], "@%lu", local_time() + time_offset);
+  }
+#if ENERGY_ROUTING
+  // then the cost of our path to the root <E cost>, the one of the root is 0
+  if(has_parent != 0) {
+    len += sprintf(&broadcast_msg[len], "E%d", parent_cost + hop_cost());
+  }
+#endif
+#if CLUSTER_MODE
+  // then the mark of a cluster head <H>, the root is one
+  if(cluster_head != 0) {
+    len += sprintf(&broadcast_msg[len], "H");
+  }
+#endif
+#if SCHEDULED_MODE
+  // in scheduled mode, the message also carries our position in the slotframe
+  sprintf(&broadcast_msg[len], "/%u", (unsigned int) slotframe_elapsed());
+#endif
+  packetbuf_copyfrom(broadcast_msg, strlen(broadcast_msg));
+  broadcast_send(&broadcast);
+  timer_restart(&dio_timer);
+}
 
-    int x = battery_sensor.value(0);
+/**
+* Checks whether an entry of the neighbor table is free
+* @ param  i  : the index of the entry
+* @ return 1 if the entry is empty or its neighbor went silent, 0 otherwise
+*/
+static int neighbor_free(int i) {
+  return linkaddr_cmp(&neighbors[i].addr, &linkaddr_null) != 0 || timer_expired(&neighbors[i].timer);
+}
 
-    // configuration is set to send periodically
-    if(config == 'P') {
-      // only send if the timer expired
-      if(timer_expired(&data_timer)) {
-        // create message with format <ID/channel/data>
-        sprintf(battery_msg, "%d.%d/B/%d", this_node.u8[0], this_node.u8[1], x);
-        // send message via runicast to parent node
-        packetbuf_clear();
-        packetbuf_copyfrom(battery_msg, strlen(battery_msg));
-        runicast_send(&runicast, &parent_node, RETRANSMISSION);
-        timer_restart(&data_timer);
-      }
+/**
+* Records the rank advertised by a neighbor. When the table is full, the
+* neighbor replaces the one with the highest rank
+* @ param  from  : the address of the neighbor
+* @ param  rank  : its rank
+* @ param  cost  : the cost of its path
+* @ return /
+*/
+static void update_neighbor(const linkaddr_t *from, int rank, int cost) {
+  int i;
+  int slot = -1;
+  for(i = 0; i < NUM_NEIGHBORS; i++) {
+    // the neighbor is already known
+    if(linkaddr_cmp(&neighbors[i].addr, from) != 0) {
+      slot = i;
+      break;
     }
-    // configuration -> send on change
-    else {
-      // send only if temperature changed
-      if(x != prev_bat) {
-        // update previous battery values
-        prev_bat = x;
-        // create message with format <ID/channel/data>
-        sprintf(battery_msg, "%d.%d/B/%d", this_node.u8[0], this_node.u8[1], x);
-        // send message via runicast to parent node
-        packetbuf_clear();
-        packetbuf_copyfrom(battery_msg, strlen(battery_msg));
-        runicast_send(&runicast, &parent_node, RETRANSMISSION);
-      }
+    // else a free entry, or the one with the highest rank
+    if(slot < 0 || (neighbor_free(slot) == 0 && (neighbor_free(i) != 0 || neighbors[i].rank > neighbors[slot].rank))) {
+      slot = i;
     }
   }
+  // the table is full of better neighbors
+  if(linkaddr_cmp(&neighbors[slot].addr, from) == 0 && neighbor_free(slot) == 0 && neighbors[slot].rank <= rank) {
+    return;
+  }
+  linkaddr_copy(&neighbors[slot].addr, from);
+  neighbors[slot].rank = rank;
+  neighbors[slot].cost = cost;
+  timer_set(&neighbors[slot].timer, TIME_OUT * CLOCK_SECOND);
 }
 
-
 /**
-* Sends temperature data to the parent node if there is at least
-* one subscriber for this channel and if the current configuration
-* is respected
-* @ param  config  : the current configuration
+* Makes a node our parent node
+* @ param  addr  : the address of the new parent node
+* @ param  rank  : its rank
+* @ param  cost  : the cost of its path
 * @ return /
 */
-static void send_temperature(char config) {
-
-  // There is at least one subscriber to the channel -> otherwise we don't send data
-  if(temp_subscriber != 0 ) {
-    // get temperature value
-    unsigned int temp = temperature_sensor.value(0);
-    int first_digit = temp/10;
-    int second_digit = temp - (temp/10)*10;
-    // configuration is set to send periodically
-    if(config == 'P') {
-      // only send if the timer expired
-      if(timer_expired(&data_timer)) {
-        // create message with format <ID/channel/data>
-        if(!runicast_is_transmitting(&runicast)) {
+static void set_parent(const linkaddr_t *addr, int rank, int cost) {
+  has_parent = 1;
+  linkaddr_copy(&parent_node, addr);
+  this_rank = rank+1;
+  parent_cost = cost;
+  timer_restart(&parent_timer);
+  route_changed = 1;
+  link_etx = 10;
+  parent_queue = 0;
+  parent_timeouts = 0;
+  // send the readings kept while we had no parent node
+  if(stored_count > 0) {
+    ctimer_set(&store_timer, STORE_DRAIN_TIME, store_drain, NULL);
+  }
+}
 
-          sprintf(temp_msg, "%d.%d/T/%d.%d", this_node.u8[0], this_node.u8[1], first_digit, second_digit);
-          // send message via runicast to parent node
-          packetbuf_clear();
-          packetbuf_copyfrom(temp_msg, strlen(temp_msg));
-          runicast_send(&runicast, &parent_node, RETRANSMISSION);
-          timer_restart(&data_timer);
-        }
-      }
+/**
+* Switches to the best backup parent as soon as the parent node is lost,
+* instead of waiting for the next DIO. Only the neighbors with a lower
+* rank than ours are candidates, so that none of them is our descendant.
+* The best one has the lowest rank, or the lowest cost with ENERGY_ROUTING
+* @ param  detach  : 1 -> the parent node is gone (no DIO, poisoned) | 0 -> it
+*                    may only be a lossy link, kept if there is no backup parent
+* @ return 1 if a backup parent was found, 0 otherwise
+*/
+static int parent_failover(int detach) {
+  int i;
+  int best = -1;
+  for(i = 0; i < NUM_NEIGHBORS; i++) {
+    if(linkaddr_cmp(&neighbors[i].addr, &parent_node) == 0 && neighbor_free(i) == 0
+#if ENERGY_ROUTING
+       && neighbors[i].rank < this_rank && (best < 0 || neighbors[i].cost < neighbors[best].cost)) {
+#else
+       && neighbors[i].rank < this_rank && (best < 0 || neighbors[i].rank < neighbors[best].rank)) {
+#endif
+      best = i;
     }
-    // configuration -> send on change
-    else {
-      // send only if temperature changed
-      if(first_digit != prev_temp[0] || second_digit != prev_temp[1]) {
-        // set previous temperature to current temperature
-        prev_temp[0] = first_digit;
-        prev_temp[1] = second_digit;
-        // create message with format <ID/channel/data>
-        sprintf(temp_msg, "%d.%d/T/%d.%d", linkaddr_node_addr.u8[0], linkaddr_node_addr.u8[1], first_digit, second_digit);
-        // send message via runicast to parent node
-        packetbuf_clear();
-        packetbuf_copyfrom(temp_msg, strlen(temp_msg));
-        runicast_send(&runicast, &parent_node, RETRANSMISSION);
-      }
+  }
+  if(best < 0 && detach == 0) {
+    return 0;
+  }
+  // the lost parent node is not a candidate anymore
+  for(i = 0; i < NUM_NEIGHBORS; i++) {
+    if(linkaddr_cmp(&neighbors[i].addr, &parent_node) != 0) {
+      neighbors[i].addr = linkaddr_null;
     }
   }
+  if(best < 0) {
+    printf("LOST CONNECTION TO PARENT");
+    has_parent = 0;
+    parent_node = linkaddr_null;
+    parent_queue = 0;
+    this_rank = INT_MAX;
+    // poison our routes
+    send_dio();
+    return 0;
+  }
+  set_parent(&neighbors[best].addr, neighbors[best].rank, neighbors[best].cost);
+  return 1;
 }
 
 /**
 * This function is called upon a received broadcast packet. It uses the
 * information in this packet to find the best possible parent node
-* according to the number of hops criterion. If the node already has
+* according to the number of hops criterion, or to the cost of the path
+* with ENERGY_ROUTING. If the node already has
 * the best parent node, then the timer of the parent node is restarted upon
 * arrival of a packet of the parent node.
 * @ param  c     : the broadcast structure
@@ -212,26 +1443,382 @@ static void broadcast_recv(struct broadcast_conn *c, const linkaddr_t *from) {
   if(message[0] == 'O') {
     // extract the rank out of the message
     int rank = atoi(&message[1]);
-    // extract the current configuration of the message
-    char con = message[2];
-    // only accept the configuration if it was send by a node with a lower rank
-    if(rank < this_rank) {
-      config = con;
-    }
-    // shortest hop rule
-    if(rank+1 < this_rank) {
+    // and the cost of its path <E cost>, none from the root
+    char *energy = strchr(message, 'E');
+    int cost = energy != NULL ? atoi(energy + 1) : 0;
+    update_neighbor(from, rank, cost);
+#if CLUSTER_MODE
+    // a cluster head, or the root, which could be our parent
+    if(rank+1 < MAX_RANK && rank < this_rank && (energy == NULL || strchr(message, 'H') != NULL)) {
+      heard_head = 1;
+    }
+#endif
+    // the configuration is only taken from the network state (see dissemination_recv)
+#if ENERGY_ROUTING
+    // lowest cost rule with hysteresis, among the neighbors which are not further from the
+    // root than our parent node, so that none of them is our descendant
+    if(rank+1 < MAX_RANK && rank < this_rank && linkaddr_cmp(&parent_node, from) == 0
+       && (has_parent == 0 || cost + COST_HYSTERESIS < parent_cost)) {
+#else
+    // shortest hop rule, a node with MAX_RANK has no route
+    if(rank+1 < this_rank && rank+1 < MAX_RANK) {
+#endif
       // the broadcasting node becomes our new parent node
-      has_parent = 1;
-      linkaddr_t new_node;
-      new_node.u8[0] = from -> u8[0];
-      new_node.u8[1] = from -> u8[1];
-      parent_node = new_node;
-      this_rank = rank+1;
-      timer_restart(&parent_timer);
-    }
-    // the message was sent from our parent node -> restart timer
+      set_parent(from, rank, cost);
+    }
+    // the message was sent from our parent node
     else if (has_parent == 1 && linkaddr_cmp(&parent_node, from) != 0) {
-      timer_restart(&parent_timer);
+      if(rank+1 >= MAX_RANK) {
+        // our parent node lost its route, or the rank counted up around a loop
+        parent_failover(1);
+      }
+      else {
+        timer_restart(&parent_timer);
+        parent_cost = cost;
+        // our rank follows the one of our parent node, which may have moved away from the root
+        if(rank+1 != this_rank) {
+          this_rank = rank+1;
+          route_changed = 1;
+        }
+      }
+    }
+    // the occupancy of the queue of our parent node follows the configuration <O rank config queue>
+    if(has_parent == 1 && linkaddr_cmp(&parent_node, from) != 0) {
+      const char *queue = &message[1];
+      while(*queue >= '0' && *queue <= '9') {
+        queue++;
+      }
+      parent_queue = (queue[0] != '\0' && queue[1] >= '0' && queue[1] <= '9') ? queue[1] - '0' : 0;
+      // follow the network time of our parent node, the latency of the radio is neglected
+      char *time = strchr(message, '@');
+      if(time != NULL) {
+        time_offset = (long)(strtoul(time + 1, NULL, 10) - local_time());
+        time_synced = 1;
+      }
+    }
+#if SCHEDULED_MODE
+    // follow the slotframe of our parent node
+    char *offset = strchr(message, '/');
+    if(offset != NULL && has_parent == 1 && linkaddr_cmp(&parent_node, from) != 0) {
+      align_slotframe(atoi(offset + 1));
+    }
+#endif
+  }
+}
+
+/**
+* Starts or stops sending the data of a channel
+* @ param  channel  : B for battery | T for temperature
+* @ param  state    : 0 -> no subscriber | 1 -> subscriber
+* @ return /
+*/
+static void set_subscriber(char channel, char state) {
+  if(channel == 'B') {
+    if(state == '0') {
+      bat_subscriber = 0;
+    }
+    else if(state == '1') {
+      bat_subscriber = 1;
+    }
+  }
+  else if(channel == 'T') {
+    if(state == '0') {
+      temp_subscriber = 0;
+    }
+    else if(state == '1') {
+      temp_subscriber = 1;
+    }
+  }
+}
+
+/**
+* Sets the reporting interval of a channel, bounded by MIN_DATA_TIME and
+* MAX_DATA_TIME. The timer of the channel restarts with the new interval
+* @ param  channel  : B for battery | T for temperature
+* @ param  seconds  : the new interval
+* @ return /
+*/
+static void set_interval(char channel, int seconds) {
+  if(seconds < MIN_DATA_TIME) {
+    seconds = MIN_DATA_TIME;
+  }
+  else if(seconds > MAX_DATA_TIME) {
+    seconds = MAX_DATA_TIME;
+  }
+  if(channel == 'B') {
+    battery_interval = seconds;
+    timer_set(&battery_timer, battery_interval * CLOCK_SECOND);
+  }
+  else if(channel == 'T') {
+    temp_interval = seconds;
+    timer_set(&data_timer, temp_interval * CLOCK_SECOND);
+  }
+}
+
+/**
+* Applies a command of the gateway addressed to this node
+* @ param  command  : <F ID / channel / state> or <I ID / channel / seconds>
+* @ return /
+*/
+static void apply_command(const char *command) {
+  // the fields after the id <channel / state or seconds>
+  const char *field = strchr(command, '/');
+  if(field == NULL || field[1] == '\0') {
+    return;
+  }
+  if(command[0] == 'F') {
+    set_subscriber(field[1], field[3]);
+  }
+  else if(command[0] == 'I') {
+    set_interval(field[1], atoi(&field[3]));
+  }
+}
+
+/**
+* Merges a partial aggregate into the one of the current epoch
+* @ param  a                         : the aggregate
+* @ param  count, sum, min, max      : the partial aggregate
+* @ return /
+*/
+static void aggregate_merge(struct aggregate *a, int count, long sum, int min, int max) {
+  if(a->count == 0 || min < a->min) {
+    a->min = min;
+  }
+  if(a->count == 0 || max > a->max) {
+    a->max = max;
+  }
+  a->count += count;
+  a->sum += sum;
+}
+
+static void aggregate_callback(void *ptr);
+
+/**
+* Starts the partial aggregate of the next epoch whose slot is ahead, and
+* sets the timer to the slot. The epochs follow the network time, so all
+* the nodes agree on their boundaries
+* @ param  a  : the aggregate
+* @ return /
+*/
+static void aggregate_schedule(struct aggregate *a) {
+  unsigned long now = local_time() + time_offset;
+  unsigned long length = (unsigned long) a->epoch * CLOCK_SECOND;
+  unsigned long offset = (unsigned long)(AGG_DEPTH - (this_rank < AGG_DEPTH ? this_rank : AGG_DEPTH)) * AGG_SLOT;
+  // our slot of epoch m - 1 is at m * length + offset
+  unsigned long m = now >= offset ? (now - offset) / length + 1 : 1;
+  a->number = (uint8_t)(m - 1);
+  a->count = 0;
+  a->sum = 0;
+  ctimer_set(&a->timer, m * length + offset - now, aggregate_callback, a);
+}
+
+/**
+* Called at our slot after the end of an epoch: our reading is merged
+* into the partial aggregate of our subtree, which goes to the parent
+* node <ID/A/channel/epoch/count/sum/min/max>
+* @ param  ptr  : the aggregate
+* @ return /
+*/
+static void aggregate_callback(void *ptr) {
+  struct aggregate *a = ptr;
+  char channel = a == &aggregates[0] ? 'B' : 'T';
+  char msg[UPLINK_MSG_LEN];
+  if(a->member != 0) {
+    int value = channel == 'B' ? battery_sensor.value(0) : temperature_sensor.value(0);
+    aggregate_merge(a, 1, value, value, value);
+  }
+  if(a->count > 0 && has_parent != 0) {
+    // a partial longer than a queue entry would be cut, it is dropped instead
+    if(snprintf(msg, sizeof(msg), "%d.%d/A/%c/%u/%d/%ld/%d/%d", this_node.u8[0], this_node.u8[1], channel,
+                a->number, a->count, a->sum, a->min, a->max) < (int) sizeof(msg)) {
+      send_uplink(msg);
+    }
+    else {
+      uplink_drops++;
+    }
+  }
+  aggregate_schedule(a);
+}
+
+/**
+* Merges the partial aggregate of a child node into ours if it belongs to
+* the current epoch. A late partial is forwarded as it is
+* @ param  msg  : the partial aggregate <ID/A/channel/epoch/count/sum/min/max>
+* @ return 1 if the partial was merged, 0 otherwise
+*/
+static int aggregate_partial(const char *msg) {
+  // the fields after the id <A/channel/...>
+  const char *field = strchr(msg, '/');
+  struct aggregate *a = &aggregates[field[3] == 'B' ? 0 : 1];
+  unsigned int number;
+  int count, min, max;
+  long sum;
+  if(a->epoch == 0 || ctimer_expired(&a->timer)
+     || sscanf(&field[5], "%u/%d/%ld/%d/%d", &number, &count, &sum, &min, &max) != 5 || number != a->number) {
+    return 0;
+  }
+  aggregate_merge(a, count, sum, min, max);
+  return 1;
+}
+
+/**
+* Returns the page of a message of the network state. The number of the
+* page follows the configuration when the network has several pages
+* @ param  msg  : the page <V version config [page] / ...>
+* @ return the page
+*/
+static int state_page(const char *msg) {
+  const char *field = &msg[1];
+  while(*field >= '0' && *field <= '9') {
+    field++;
+  }
+  return *field != '\0' ? atoi(field + 1) : 0;
+}
+
+/**
+* Applies the page of the network state holding this node: the configuration,
+* the subscriptions of this node and the aggregate queries. The subscriptions
+* are a bitmap in hexadecimal, two bits per node (bit 0 -> battery, bit 1 ->
+* temperature) in the order of the children_nodes array from the first node
+* of the page; the members of the aggregate queries follow in the same
+* layout, then the epochs of the queries
+* @ param  msg  : the page <V version config [page] / subscriptions / aggregates / battery epoch / temperature epoch>
+* @ return /
+*/
+static void apply_state(const char *msg) {
+  const char *field = &msg[1];
+  // skip the version
+  while(*field >= '0' && *field <= '9') {
+    field++;
+  }
+  config = *field;
+  const char *table = strchr(msg, '/');
+  if(table == NULL) {
+    return;
+  }
+  int index = (this_node.u8[0] * MAX_INDEX + this_node.u8[1]) % STATE_PAGE_NODES;
+  char byte[3] = {table[1 + 2 * (index / 4)], table[2 + 2 * (index / 4)], '\0'};
+  int bits = (strtol(byte, NULL, 16) >> (2 * (index % 4))) & 3;
+  set_subscriber('B', (bits & 1) ? '1' : '0');
+  set_subscriber('T', (bits & 2) ? '1' : '0');
+  const char *members = strchr(table + 1, '/');
+  if(members == NULL) {
+    return;
+  }
+  byte[0] = members[1 + 2 * (index / 4)];
+  byte[1] = members[2 + 2 * (index / 4)];
+  bits = (strtol(byte, NULL, 16) >> (2 * (index % 4))) & 3;
+  const char *epoch = strchr(members + 1, '/');
+  int i;
+  for(i = 0; i < 2 && epoch != NULL; i++) {
+    struct aggregate *a = &aggregates[i];
+    int seconds = atoi(epoch + 1);
+    a->member = (bits >> i) & 1;
+    // a new query starts at the next iteration of the main loop, once we follow the network time
+    if(seconds != a->epoch) {
+      a->epoch = seconds;
+      ctimer_stop(&a->timer);
+    }
+    epoch = strchr(epoch + 1, '/');
+  }
+}
+
+/**
+* Applies the alert rules of the gateway: the bounds of each channel,
+* sampled every ALERT_SAMPLE while it has one
+* @ param  msg  : the rules <K version / battery low / battery high / temperature low / temperature high>
+* @ return /
+*/
+static void apply_rules(const char *msg) {
+  const char *field = strchr(msg, '/');
+  int i;
+  for(i = 0; i < 4 && field != NULL; i++) {
+    if(i % 2 == 0) {
+      alert_low[i / 2] = field[1] == '*' ? INT_MIN : atoi(field + 1);
+    }
+    else {
+      alert_high[i / 2] = field[1] == '*' ? INT_MAX : atoi(field + 1);
+    }
+    field = strchr(field + 1, '/');
+  }
+  // a channel left without a rule clears its alert at the next sample
+  if(ctimer_expired(&alert_timer)) {
+    ctimer_set(&alert_timer, ALERT_SAMPLE, alert_callback, NULL);
+  }
+}
+
+/**
+* Compares a disseminated message with our copy: a newer message is kept
+* and immediately spread (trickle inconsistency), the same message
+* suppresses our next broadcast and an older one is answered with ours
+* @ param  message  : the received message <letter version ...>
+* @ param  copy     : our copy, of len bytes
+* @ param  version  : the version of our copy
+* @ param  has      : 1 once we have a copy
+* @ param  t        : the trickle timer of the message
+* @ return 1 if the message is newer and was kept, 0 otherwise
+*/
+static int dissemination_update(const char *message, char *copy, int len, uint8_t *version, int *has, struct trickle_timer *t) {
+  uint8_t v = atoi(&message[1]);
+  // versions wrap around: a version is newer if it is less than 128 ahead
+  if(*has == 0 || (int8_t)(v - *version) > 0) {
+    strncpy(copy, message, len - 1);
+    copy[len - 1] = '\0';
+    *version = v;
+    *has = 1;
+    trickle_timer_inconsistency(t);
+    return 1;
+  }
+  if(v == *version) {
+    trickle_timer_consistency(t);
+  }
+  else {
+    trickle_timer_inconsistency(t);
+  }
+  return 0;
+}
+
+/**
+* This function is called by the trickle timer when the network state
+* or the alert rules should be broadcast
+* @ param  ptr       : the message, empty until one is received
+* @ param  suppress  : TRICKLE_TIMER_TX_SUPPRESS if enough neighbors sent the same message
+* @ return /
+*/
+static void state_broadcast(void *ptr, uint8_t suppress) {
+  const char *msg = ptr;
+  if(suppress == TRICKLE_TIMER_TX_SUPPRESS || msg[0] == '\0') {
+    return;
+  }
+  packetbuf_clear();
+  packetbuf_copyfrom(msg, strlen(msg) + 1);
+  broadcast_send(&dissemination);
+}
+
+/**
+* This function is called upon a received network state or alert rules.
+* A newer version is applied and spread (see dissemination_update)
+* @ param  c     : the broadcast structure
+* @ param  from  : the address of the broadcasting node
+* @ return /
+*/
+static void dissemination_recv(struct broadcast_conn *c, const linkaddr_t *from) {
+  char *message = (char *)packetbuf_dataptr();
+  // every page is spread, only the one holding this node is applied
+  int p = message[0] == 'V' ? state_page(message) : -1;
+  if(p >= 0 && p < STATE_PAGES
+     && dissemination_update(message, state_msg[p], STATE_MSG_LEN, &state_version[p], &has_state[p], &state_timer[p])
+     && p == (this_node.u8[0] * MAX_INDEX + this_node.u8[1]) / STATE_PAGE_NODES) {
+    apply_state(state_msg[p]);
+  }
+  else if(message[0] == 'K') {
+    // the rules are only broadcast by the nodes which received some
+    if(has_rules == 0) {
+      trickle_timer_config(&rules_timer, TRICKLE_IMIN, TRICKLE_IMAX, TRICKLE_K);
+      trickle_timer_set(&rules_timer, state_broadcast, rules_msg);
+    }
+    if(dissemination_update(message, rules_msg, RULES_MSG_LEN, &rules_version, &has_rules, &rules_timer)) {
+      apply_rules(rules_msg);
     }
   }
 }
@@ -253,7 +1840,7 @@ static void unicast_recv(struct unicast_conn *c, const linkaddr_t *from)
   int index2 = from->u8[1];
 
   // no valid address
-  if(index1 < MIN_INDEX || index1 > MAX_INDEX || index2 < MIN_INDEX || index2 > MAX_INDEX) {
+  if(index1 < MIN_INDEX || index1 >= MAX_INDEX || index2 < MIN_INDEX || index2 >= MAX_INDEX) {
     return;
   }
   // extract the message
@@ -262,8 +1849,23 @@ static void unicast_recv(struct unicast_conn *c, const linkaddr_t *from)
   const char delim[2] = "/";
   char *token = strtok(message, delim);
 
+#if BLOOM_MODE
+  // we received an ALIVE message with the Bloom filter of the subtree of the child <B/filter>
+  if(strcmp(token, "B") == 0) {
+#if CLUSTER_MODE
+    cluster_adopt();
+#endif
+    token = strtok(NULL, delim);
+    if(token != NULL) {
+      add_child(from, token);
+    }
+  }
+#else
   // we received an ALIVE message
   if(strcmp(token, "A") == 0) {
+#if CLUSTER_MODE
+    cluster_adopt();
+#endif
 
     // get the address of the sending node
     linkaddr_t child_node;
@@ -282,13 +1884,14 @@ static void unicast_recv(struct unicast_conn *c, const linkaddr_t *from)
     token = strtok(NULL, delim);
     while(token != NULL) {
       // we can reach the child nodes of the new node
-      index1 = token[0] - '0';
-      index2 = token[2] - '0';
-      children_nodes[index1][index2] = child_node;
-      timer_restart(&(children_timer[index1][index2]));
+      if(parse_id(token, &index1, &index2) > 0) {
+        children_nodes[index1][index2] = child_node;
+        timer_restart(&(children_timer[index1][index2]));
+      }
       token = strtok(NULL, delim);
     }
   }
+#endif
 }
 
 
@@ -329,42 +1932,192 @@ static void runicast_recv(struct runicast_conn *c, const linkaddr_t *from, uint8
   // extract the message
   char *message = (char *)packetbuf_dataptr();
 
-  if(message[0] == 'F') {
+#if SOURCE_ROUTING
+  // source routed command <S number of hops left / next hops / command>
+  if(message[0] == 'S') {
+    int hops = message[1] - '0';
+    if(hops == 0) {
+      // we are the target of the command
+      apply_command(&message[2]);
+    }
+    else {
+      // pop the next hop, one character '0' + index for i and j
+      linkaddr_t next;
+      next.u8[0] = message[2] - '0';
+      next.u8[1] = message[3] - '0';
+      message[1] = hops - 1 + '0';
+      memmove(&message[2], &message[4], strlen(&message[4]) + 1);
+      send_downlink(&next, message);
+    }
+    return;
+  }
+#endif
 
-    int index1 = message[1] - '0'; // msg[1] - '0'?
-    int index2 = message[3] - '0';
+  // subscription <F ID / channel / state> or reporting interval <I ID / channel / seconds>
+  if(message[0] == 'F' || message[0] == 'I') {
 
+    int index1, index2;
+    if(parse_id(&message[1], &index1, &index2) == 0) {
+      return;
+    }
     if(this_node.u8[0] == index1 && this_node.u8[1] == index2) {
-      if(message[5] == 'B') {
-        if(message[7] == '0') {
-          bat_subscriber = 0;
+      apply_command(message);
+    }
+    else {
+      route_downlink(index1, index2, message);
+    }
+  }
+  else {
+    // forwarded reading, followed by the rank of the sender, the hops left and the flags.
+    // Sending a DIO or a packet overwrites packetbuf: the reading is copied first
+#if CLUSTER_MODE
+    char forwarded[PACK_LEN];
+#else
+    char forwarded[UPLINK_MSG_LEN + 8];
+#endif
+    int len = strlen(message) + 1;
+    uint8_t hops = MAX_HOPS;
+    uint8_t flags = 0;
+    strncpy(forwarded, message, sizeof(forwarded) - 1);
+    forwarded[sizeof(forwarded) - 1] = '\0';
+    if(packetbuf_datalen() >= len + UPLINK_TRAILER) {
+      uint8_t *trailer = (uint8_t *)&message[len];
+      hops = trailer[1];
+      flags = trailer[2];
+      // a reading goes down the ranks: the sender has a stale view of our rank, or there is a loop
+      if(trailer[0] <= this_rank) {
+        // the sender re-validates its rank with our DIO
+        if(timer_expired(&dio_timer)) {
+          send_dio();
         }
-        else if(message[7] == '1') {
-          bat_subscriber = 1;
+        // the second inconsistency on the way -> drop the reading
+        if(flags & RANK_ERROR) {
+          uplink_drops++;
+          return;
         }
+        flags |= RANK_ERROR;
       }
-      else if(message[5] == 'T') {
-        if(message[7] == '0') {
-          temp_subscriber = 0;
-        }
-        else if(message[7] == '1') {
-          temp_subscriber = 1;
-        }
+    }
+    message = forwarded;
+#if CLUSTER_MODE
+    // only a cluster head relays
+    cluster_adopt();
+#endif
+    if(hops <= 1) {
+      uplink_drops++;
+      return;
+    }
+    // the partial aggregate of a child node is merged into ours <ID/A/...>
+    if(message_type(message) == 'A' && aggregate_partial(message) != 0) {
+      return;
+    }
+#if CLUSTER_MODE
+    // the readings of a packet are queued one by one, the next cluster head packs them again
+    char *next;
+    while((next = strchr(message, '\n')) != NULL) {
+      *next = '\0';
+      forward_uplink(message, hops - 1, flags);
+      message = next + 1;
+    }
+#endif
+    forward_uplink(message, hops - 1, flags);
+  }
+  }
+
+/**
+* Updates the estimation of the expected number of transmissions to our
+* parent node, a moving average giving 1/4 of the weight to the last packet
+* @ param  transmissions  : the number of transmissions of the last packet
+* @ return /
+*/
+static void update_etx(int transmissions) {
+  link_etx = (3 * link_etx + 10 * transmissions) / 4;
+}
+
+/**
+* Removes the entries of the packet in flight from the uplink queue
+* @ param  store  : 1 -> the readings and alerts go to the store, the other reports are dropped | 0 -> they were sent
+* @ return /
+*/
+static void uplink_release(int store) {
+  int i;
+  for(i = 0; i < uplink_batch && uplink_inflight != NULL; i++) {
+    struct uplink_entry *next = uplink_inflight->next;
+    if(store != 0) {
+      if(is_reading(uplink_inflight->msg) || is_alert(uplink_inflight->msg)) {
+        store_reading(uplink_inflight->msg, uplink_inflight->hops, uplink_inflight->flags, uplink_inflight->created);
+      }
+      else {
+        uplink_drops++;
       }
     }
-    else {
-      packetbuf_clear();
-      packetbuf_copyfrom(message, strlen(message));
-      runicast_send(&runicast, &children_nodes[index1][index2], RETRANSMISSION);
+    list_remove(uplink_queue, uplink_inflight);
+    memb_free(&uplink_mem, uplink_inflight);
+    uplink_inflight = next;
+  }
+  uplink_inflight = NULL;
+}
+
+/**
+* This function is called when the parent node acknowledged a runicast
+* packet. The reading or command is removed from its queue and the next
+* one is sent
+* @ param  c                : the runicast structure
+* @ param  to               : the address of the receiving node
+* @ param  retransmissions  : the number of retransmissions
+* @ return /
+*/
+static void sent_runicast(struct runicast_conn *c, const linkaddr_t *to, uint8_t retransmissions) {
+  if(uplink_inflight != NULL) {
+    update_etx(retransmissions + 1);
+    parent_timeouts = 0;
+    // give our congested parent node time to drain its queue
+    if(parent_queue >= CONGESTION_THRESHOLD) {
+      ctimer_set(&pace_timer, PACE_TICKS * parent_queue, pace_callback, NULL);
+    }
+    uplink_release(0);
+    // the parent node answers again: send the readings kept meanwhile
+    if(stored_count > 0 && ctimer_expired(&store_timer)) {
+      ctimer_set(&store_timer, STORE_DRAIN_TIME, store_drain, NULL);
     }
   }
-  else {
-    // TODO: aggregate the packets and send them when we send our sensor data
-    packetbuf_clear();
-    packetbuf_copyfrom(message, strlen(message));
-    runicast_send(&runicast, &parent_node, RETRANSMISSION);
+  if(downlink_inflight != NULL) {
+    list_remove(downlink_queue, downlink_inflight);
+    memb_free(&downlink_mem, downlink_inflight);
+    downlink_inflight = NULL;
+  }
+  runicast_drain();
+}
+
+/**
+* This function is called when a runicast packet was not acknowledged
+* after RETRANSMISSION attempts. A reading goes to the backup parent or
+* waits in the store, a command is dropped
+* @ param  c                : the runicast structure
+* @ param  to               : the address of the receiving node
+* @ param  retransmissions  : the number of retransmissions
+* @ return /
+*/
+static void timedout_runicast(struct runicast_conn *c, const linkaddr_t *to, uint8_t retransmissions) {
+  if(uplink_inflight != NULL) {
+    // a lost packet weighs twice its attempts
+    update_etx(2 * (retransmissions + 1));
+    // the parent node is lost: the reading stays queued for the backup parent
+    if(++parent_timeouts >= MAX_TIMEOUTS && linkaddr_cmp(to, &parent_node) != 0 && parent_failover(0) != 0) {
+      uplink_inflight = NULL;
+    }
+    else {
+      // the readings wait in the store until the parent node answers again
+      uplink_release(1);
+    }
   }
+  if(downlink_inflight != NULL) {
+    list_remove(downlink_queue, downlink_inflight);
+    memb_free(&downlink_mem, downlink_inflight);
+    downlink_inflight = NULL;
   }
+  runicast_drain();
+}
 
 
   /********************************************//**
@@ -373,7 +2126,8 @@ static void runicast_recv(struct runicast_conn *c, const linkaddr_t *from, uint8
 
   static const struct unicast_callbacks unicast_call = {unicast_recv};
   static const struct broadcast_callbacks broadcast_call = {broadcast_recv};
-  static const struct runicast_callbacks runicast_call = {runicast_recv};
+  static const struct broadcast_callbacks dissemination_call = {dissemination_recv};
+  static const struct runicast_callbacks runicast_call = {runicast_recv, sent_runicast, timedout_runicast};
 
 
   /********************************************//**
@@ -386,6 +2140,7 @@ static void runicast_recv(struct runicast_conn *c, const linkaddr_t *from, uint8
     static struct etimer et;
 
     PROCESS_EXITHANDLER(broadcast_close(&broadcast));
+    PROCESS_EXITHANDLER(broadcast_close(&dissemination));
     PROCESS_EXITHANDLER(unicast_close(&unicast));
     PROCESS_EXITHANDLER(runicast_close(&runicast));
 
@@ -396,11 +2151,24 @@ static void runicast_recv(struct runicast_conn *c, const linkaddr_t *from, uint8
     // initialize all the timers
     int i, j;
     timer_set(&parent_timer, TIME_OUT*CLOCK_SECOND);
-    timer_set(&data_timer, DATA_TIME*CLOCK_SECOND);
+    timer_set(&data_timer, temp_interval*CLOCK_SECOND);
+    timer_set(&battery_timer, battery_interval*CLOCK_SECOND);
+    timer_set(&route_timer, ROUTE_TIME*CLOCK_SECOND);
+    timer_set(&dio_timer, DIO_GAP);
+#if STORE_CFS
+    // the ages of the readings left by a previous run are unknown
+    cfs_remove(STORE_FILE);
+#endif
+#if BLOOM_MODE
+    for(i=0;i < MAX_CHILDREN ; i++) {
+      timer_set(&(children_timer[i]), TIME_OUT*CLOCK_SECOND);
+    }
+#else
     for(i=0;i < MAX_INDEX ; i++) {
       for(j=0; j < MAX_INDEX; j++)
       timer_set(&(children_timer[i][j]), TIME_OUT*CLOCK_SECOND);
     }
+#endif
 
     // set our id
     this_node.u8[0] = linkaddr_node_addr.u8[0];
@@ -412,7 +2180,18 @@ static void runicast_recv(struct runicast_conn *c, const linkaddr_t *from, uint8
     unicast_open(&unicast, 136, &unicast_call);
     // Set up an identified reliable unicast connection
     runicast_open(&runicast, 144, &runicast_call);
+    // Set up the broadcast connection of the network state
+    broadcast_open(&dissemination, 130, &dissemination_call);
+    for(i = 0; i < STATE_PAGES; i++) {
+      trickle_timer_config(&state_timer[i], TRICKLE_IMIN, TRICKLE_IMAX, TRICKLE_K);
+      trickle_timer_set(&state_timer[i], state_broadcast, state_msg[i]);
+    }
 
+#if SCHEDULED_MODE
+    // start our own slotframe until we follow the one of a parent node
+    slotframe_start = clock_time();
+    schedule_next_cell();
+#endif
 
     // Main loop
     while(1) {
@@ -421,47 +2200,95 @@ static void runicast_recv(struct runicast_conn *c, const linkaddr_t *from, uint8
       etimer_set(&et, CLOCK_SECOND * 6 + random_rand() % (CLOCK_SECOND * 6));
       PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&et));
 
+#if CLUSTER_MODE
+      cluster_elect();
+#endif
       // to be executed if the node has a parent -> otherwise we wait for a braodcast message
       if(has_parent != 0) {
+        beacon = (beacon + 1) % BEACON_PERIOD;
         // send a broadcast message
-        packetbuf_clear();
-        // message contains the message identififer, the current rank and the current configuration
-        sprintf(broadcast_msg, "O%d%c", this_rank, config);
-        packetbuf_copyfrom(broadcast_msg, strlen(broadcast_msg));
-        broadcast_send(&broadcast);
+        if(beacon == 0) {
+          send_dio();
+        }
 
+#if BLOOM_MODE
+        // our subtree: ourselves and the subtrees of our children <B/filter>
+        uint8_t filter[BLOOM_BYTES];
+        memset(filter, 0, BLOOM_BYTES);
+        bloom_add(filter, this_node.u8[0] * MAX_INDEX + this_node.u8[1]);
+        for(i=0;i<MAX_CHILDREN;i++){
+          if(linkaddr_cmp(&(children[i].addr), &linkaddr_null) == 0) {
+            for(j=0;j<BLOOM_BYTES;j++) {
+              filter[j] |= children[i].filter[j];
+            }
+          }
+        }
+        strcpy(alive_msg, "B/");
+        for(j=0;j<BLOOM_BYTES;j++) {
+          sprintf(&alive_msg[2 + 2 * j], "%02x", filter[j]);
+        }
+#else
         memset(alive_msg, 0, 500);
         strcat(alive_msg, "A/");
         for(i=0;i<MAX_INDEX;i++){
           for(j=0;j<MAX_INDEX;j++) {
             // append all the nodes accessible via this node
             if(linkaddr_cmp(&(children_nodes[i][j]), &linkaddr_null) == 0) {
-              tmp[0] = i + '0';
-              tmp[1] = '.';
-              tmp[2] = j + '0';
-              tmp[3] = '/';
-              strcat(alive_msg, tmp);
+              sprintf(tmp, "%d.%d/", i, j);
+              if(strlen(alive_msg) + strlen(tmp) < sizeof(alive_msg)) {
+                strcat(alive_msg, tmp);
+              }
             }
           }
         }
+#endif
 
         //printf("send alive message: %s\n", alive_msg);
-        packetbuf_clear();
-        packetbuf_copyfrom(alive_msg, strlen(alive_msg));
-        unicast_send(&unicast, &parent_node);
-        // check if there is some sensor data to transmit
-        send_temperature(config);
-        send_battery(config);
+        if(beacon == 0) {
+          packetbuf_clear();
+          packetbuf_copyfrom(alive_msg, strlen(alive_msg));
+          unicast_send(&unicast, &parent_node);
+        }
+        // tell the root how to reach us
+        if(route_changed != 0 || timer_expired(&route_timer)) {
+          // the drops are bounded to two digits so that the report fits in UPLINK_MSG_LEN, and a report
+          // which still does not fit is not sent rather than cut
+          if(snprintf(route_msg, sizeof(route_msg), "%d.%d/R/%d.%d/%d/%d/%d", this_node.u8[0], this_node.u8[1],
+                      parent_node.u8[0], parent_node.u8[1], this_rank, link_etx,
+                      uplink_drops > 99 ? 99 : uplink_drops) < (int) sizeof(route_msg)
+             && send_uplink(route_msg) != 0) {
+            uplink_drops = 0;
+          }
+          route_changed = 0;
+          timer_restart(&route_timer);
+        }
+        // send the readings that were queued while the channel was busy
+        runicast_drain();
       }
+      // start the aggregate queries of the network state
+      for(i = 0; i < 2; i++) {
+        if(aggregates[i].epoch != 0 && time_synced != 0 && ctimer_expired(&aggregates[i].timer)) {
+          aggregate_schedule(&aggregates[i]);
+        }
+      }
+      // check if there is some sensor data to transmit, kept in the store while we have no parent
+      send_temperature(config);
+      send_battery(config);
 
-      // no parent anymore
-      if(timer_expired(&parent_timer)) {
-        printf("LOST CONNECTION TO PARENT");
-        has_parent = 0;
-        parent_node = linkaddr_null;
-        this_rank = INT_MAX;
+      // no parent anymore -> switch to a backup parent
+      if(has_parent != 0 && timer_expired(&parent_timer)) {
+        parent_failover(1);
       }
       // check if a child disconnected
+#if BLOOM_MODE
+      for(i=0;i<MAX_CHILDREN;i++){
+        // remove the child node and its subtree
+        if(timer_expired(&(children_timer[i])) && linkaddr_cmp(&(children[i].addr), &linkaddr_null) == 0){
+          children[i].addr = linkaddr_null;
+          memset(children[i].filter, 0, BLOOM_BYTES);
+        }
+      }
+#else
       for(i=0;i<MAX_INDEX;i++){
         for(j=0;j<MAX_INDEX;j++) {
           // remove the child node
@@ -470,6 +2297,7 @@ static void runicast_recv(struct runicast_conn *c, const linkaddr_t *from, uint8
           }
         }
       }
+#endif
     }
     PROCESS_END();
   }